@@ -22,6 +22,7 @@
    buffers.c: Internal buffer management
 */
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
 #include "config.h"
@@ -32,6 +33,7 @@
 #endif
 #include "led.h"
 #include "buffers.h"
+#include "storage.h"
 
 dh_t    matchdh;
 uint8_t ops_scratch[33];
@@ -39,11 +41,33 @@ uint8_t ops_scratch[33];
 /// One additional buffer structure for channel 15
 buffer_t buffers[CONFIG_BUFFER_COUNT+1];
 
-/// The actual data buffers
-static uint8_t bufferdata[CONFIG_BUFFER_COUNT*256];
+/// The actual data buffers, allocated at boot
+static uint8_t *bufferdata;
 
-/// Number of active data buffers + 16 * number of dirty buffers
-uint8_t active_buffers;
+/// Number of buffers in the pool
+uint8_t buffer_count;
+
+/// Stored setting for buffer_count, 0 selects CONFIG_BUFFER_DEFAULT
+uint8_t buffer_pool_size;
+
+/// Number of active data buffers + 256 * number of dirty buffers
+uint16_t active_buffers;
+
+#if CONFIG_BUFFER_COUNT > 64
+#  error "CONFIG_BUFFER_COUNT is limited to 64 by the allocation bitmap!"
+#endif
+
+/* Bit n is set while buffers[n] is free, the error buffer is not included */
+typedef uint64_t bufmap_t;
+static bufmap_t free_map;
+
+#define BUFMAP_ALL (buffer_count < 64 ? ((bufmap_t)1 << buffer_count) - 1 : ~(bufmap_t)0)
+
+/* Index of the last buffer found for secondary addresses 0-15,
+   only a hint that find_buffer checks before using it */
+#define SECMAP_SIZE 16
+#define SECMAP_NONE 0xff
+static uint8_t sec_map[SECMAP_SIZE];
 
 /**
  * callback_dummy - dummy function for the buffer callbacks
@@ -58,18 +82,135 @@ uint8_t callback_dummy(buffer_t *buf) {
   return 0;
 }
 
+#ifdef CONFIG_BUFFER_HOT
+/* ------------------------------------------------------------------------- */
+/*  Internal RAM for buffers on the bus                                      */
+/* ------------------------------------------------------------------------- */
+
+/*
+ * The pool may be in PSRAM, which is too slow for some fast loaders.
+ * A few data blocks in internal RAM are lent to the buffers of the
+ * channels used last: buffer_hot copies the data of a buffer into such
+ * a block and parks the pool block of the buffer until the buffer is
+ * freed or has to make room for another one. Every data block belongs
+ * to exactly one buffer structure or is parked, so there always is a
+ * parked pool block when a hot block has to be returned.
+ */
+static uint8_t  hotdata[CONFIG_BUFFER_HOT*256];
+static uint8_t *parked_hot[CONFIG_BUFFER_HOT];   /* unused internal blocks  */
+static uint8_t *parked_pool[CONFIG_BUFFER_HOT];  /* blocks of hot buffers   */
+static uint8_t  parked_hot_count;
+static uint8_t  parked_pool_count;
+static uint32_t hot_stamp[CONFIG_BUFFER_COUNT];  /* last use for replacement */
+static uint32_t hot_clock;
+static bool     hot_enabled;  /* false if the pool is in internal RAM anyway */
+
+uint32_t buffer_migrations;
+
+bool buffer_is_hot(buffer_t *buf) {
+  return buf->data >= hotdata && buf->data < hotdata + sizeof(hotdata);
+}
+
+/* Give the internal block of a buffer back, keeping the data if copy is set */
+static void buffer_cool(buffer_t *buf, bool copy) {
+  uint8_t *data = parked_pool[--parked_pool_count];
+
+  if (copy)
+    memcpy(data, buf->data, 256);
+  parked_hot[parked_hot_count++] = buf->data;
+  buf->data = data;
+}
+
+/**
+ * buffer_hot - move the data of a buffer to internal RAM
+ * @buf: buffer of a channel or a fast loader that is used on the bus
+ *
+ * This function gives @buf one of the internal blocks, taking it from
+ * the hot buffer that was used least recently if none is unused. It is
+ * called for every buffer that find_buffer returns for a channel and
+ * by fast loaders for their own buffers before they start, so callers
+ * must not keep data pointers of other buffers across it.
+ */
+void buffer_hot(buffer_t *buf) {
+  uint8_t idx = buf - buffers;
+  uint8_t *data;
+
+  if (!hot_enabled || idx >= buffer_count)
+    return;
+
+  hot_stamp[idx] = ++hot_clock;
+  if (buffer_is_hot(buf))
+    return;
+
+  if (parked_hot_count == 0) {
+    /* All internal blocks are used by allocated buffers */
+    bufmap_t used = ~free_map & BUFMAP_ALL;
+    buffer_t *victim = NULL;
+
+    while (used != 0) {
+      uint8_t i = __builtin_ctzll(used);
+      used &= used - 1;
+
+      if (buffer_is_hot(&buffers[i]) &&
+          (victim == NULL || hot_stamp[i] < hot_stamp[victim - buffers]))
+        victim = &buffers[i];
+    }
+
+    buffer_cool(victim, true);
+  }
+
+  data = parked_hot[--parked_hot_count];
+  memcpy(data, buf->data, 256);
+  parked_pool[parked_pool_count++] = buf->data;
+  buf->data = data;
+  buffer_migrations++;
+}
+
+/* Set up the internal blocks, unless the pool is in internal RAM */
+static void buffers_hot_init(void) {
+  uint8_t i;
+
+  hot_enabled = ext_is_external(bufferdata);
+  for (i=0;i<CONFIG_BUFFER_HOT;i++)
+    parked_hot[i] = hotdata + 256*i;
+  parked_hot_count = CONFIG_BUFFER_HOT;
+}
+#else
+#  define buffers_hot_init() do {} while (0)
+#endif
+
 /**
  * buffers_init - initializes the buffer data structures
  *
  * This function initialized all the buffer-related data structures.
+ * The pool is sized by buffer_pool_size, so the configuration must
+ * have been read before. If the pool does not fit into memory, it is
+ * halved until it does.
  */
 void buffers_init(void) {
   uint8_t i;
 
+  buffer_count = buffer_pool_size;
+  if (buffer_count == 0 || buffer_count > CONFIG_BUFFER_COUNT)
+    buffer_count = CONFIG_BUFFER_DEFAULT;
+
+  while ((bufferdata = ext_malloc(buffer_count*256)) == NULL &&
+         buffer_count > BUFFER_COUNT_MIN)
+    buffer_count /= 2;
+
+  if (bufferdata == NULL)
+    buffer_count = 0;
+
   memset(buffers,0,sizeof(buffers));
-  for (i=0;i<CONFIG_BUFFER_COUNT;i++)
+  for (i=0;i<buffer_count;i++)
     buffers[i].data = bufferdata + 256*i;
 
+  buffers_hot_init();
+
+  free_map = BUFMAP_ALL;
+  memset(sec_map, SECMAP_NONE, sizeof(sec_map));
+  sec_map[15] = ERRORBUFFER_IDX;
+
   buffers[ERRORBUFFER_IDX].data      = error_buffer;
   buffers[ERRORBUFFER_IDX].secondary = 15;
   buffers[ERRORBUFFER_IDX].allocated = 1;
@@ -94,9 +235,33 @@ static void alloc_specific_buffer(uint8_t bufnum) {
     buffers[bufnum].secondary = BUFFER_SEC_SYSTEM;
     buffers[bufnum].refill    = callback_dummy;
     buffers[bufnum].cleanup   = callback_dummy;
+    free_map &= ~((bufmap_t)1 << bufnum);
   }
 }
 
+/**
+ * alloc_spare_buffer - allocate an optional buffer for system use
+ *
+ * This function allocates a buffer and marks it as used. Returns a
+ * pointer to the buffer structure or NULL if no buffer is free.
+ * Unlike alloc_system_buffer it does not set an error message, so
+ * it can be used for buffers that are nice to have.
+ *
+ * Single buffers are taken from the top of the array and linked
+ * buffers from the bottom, so short-lived single buffers do not
+ * split the free space that a large buffer needs.
+ */
+buffer_t *alloc_spare_buffer(void) {
+  uint8_t i;
+
+  if (free_map == 0)
+    return NULL;
+
+  i = 63 - __builtin_clzll(free_map);
+  alloc_specific_buffer(i);
+  return &buffers[i];
+}
+
 /**
  * alloc_system_buffer - allocate a buffer for system use
  *
@@ -104,17 +269,11 @@ static void alloc_specific_buffer(uint8_t bufnum) {
  * pointer to the buffer structure or NULL of no buffer is free.
  */
 buffer_t *alloc_system_buffer(void) {
-  uint8_t i;
-
-  for (i=0;i<CONFIG_BUFFER_COUNT;i++) {
-    if (!buffers[i].allocated) {
-      alloc_specific_buffer(i);
-      return &buffers[i];
-    }
-  }
+  buffer_t *buf = alloc_spare_buffer();
 
-  set_error(ERROR_NO_CHANNEL);
-  return NULL;
+  if (buf == NULL)
+    set_error(ERROR_NO_CHANNEL);
+  return buf;
 }
 
 /**
@@ -141,34 +300,27 @@ buffer_t *alloc_buffer(void) {
  * This function allocates count buffers, marks them as used and
  * links them. It will also turn on the busy LED to notify the user.
  * Returns a pointer to the first buffer structure or NULL if
- * not enough buffers are free. The data segments of the allocated
- * buffers are guaranteed to be continuous.
+ * not enough buffers are free. The buffers are consecutive in the
+ * buffer array, but their data segments are only continuous as long
+ * as no data blocks were exchanged between buffers by buffer_hot or
+ * a prefetch, so users must follow the chain instead of assuming it.
  */
 buffer_t *alloc_linked_buffers(uint8_t count) {
-  uint8_t i,freebufs,start;
-
-  freebufs = 0;
-  start    = 0;
-  for (i=0;i<CONFIG_BUFFER_COUNT;i++) {
-    if (buffers[i].allocated) {
-      /* Look for continuous buffers */
-      /* Switching data segments is possible, but probably not required */
-      freebufs = 0;
-    } else {
-      if (freebufs == 0)
-        start = i;
-      freebufs++;
-      /* Found enough free space */
-      if (freebufs == count)
-        break;
-    }
-  }
+  bufmap_t runs = free_map;
+  uint8_t i,start;
 
-  if (freebufs < count) {
+  /* Bit n stays set if buffers n..n+count-1 are all free */
+  /* Switching data segments is possible, but probably not required */
+  for (i=1;i<count && runs != 0;i++)
+    runs &= free_map >> i;
+
+  if (count == 0 || count > buffer_count || runs == 0) {
     set_error(ERROR_NO_CHANNEL);
     return NULL;
   }
 
+  start = __builtin_ctzll(runs);
+
   /* Chain the buffers */
   for (i=0;i<count;i++) {
     alloc_specific_buffer(start+i);
@@ -197,6 +349,10 @@ void cleanup_and_free_buffer(buffer_t *buffer) {
   free_buffer(buffer);
 }
 
+#ifdef CONFIG_STORAGE_TASK
+static void buffer_prefetch_release(buffer_t *buf);
+#endif
+
 /**
  * free_buffer - deallocate a buffer
  * @buffer: pointer to the buffer structure to mark as free
@@ -212,10 +368,23 @@ void free_buffer(buffer_t *buffer) {
   if (buffer->secondary == 15) return;
   if (!buffer->allocated) return;
 
+#ifdef CONFIG_STORAGE_TASK
+  /* a failed prefetch leaves its spare to the bus task */
+  if (storage_task_self())
+    return;
+  buffer_prefetch_release(buffer);
+#endif
+
   buffer->allocated = 0;
+  free_map |= (bufmap_t)1 << (buffer - buffers);
+
+#ifdef CONFIG_BUFFER_HOT
+  if (buffer_is_hot(buffer))
+    buffer_cool(buffer, false);
+#endif
 
   if (buffer->dirty)
-    active_buffers -= 16;
+    active_buffers -= 256;
   if (buffer->secondary < BUFFER_SEC_SYSTEM)
     active_buffers--;
 
@@ -234,19 +403,21 @@ void free_buffer(buffer_t *buffer) {
  * set, returns 0.
  */
 uint8_t free_multiple_buffers(uint8_t flags) {
+  bufmap_t used = ~free_map & BUFMAP_ALL;
   uint8_t i,res;
 
   res = 0;
 
-  for (i=0;i<CONFIG_BUFFER_COUNT;i++) {
-    if (buffers[i].allocated) {
-      if ((flags & FMB_FREE_SYSTEM) || buffers[i].secondary < BUFFER_SEC_SYSTEM) {
-        if ((flags & FMB_FREE_STICKY) || !buffers[i].sticky) {
-          if (flags & FMB_CLEAN) {
-            res = res || buffers[i].cleanup(&buffers[i]);
-          }
-          free_buffer(&buffers[i]);
+  while (used != 0) {
+    i = __builtin_ctzll(used);
+    used &= used - 1;
+
+    if ((flags & FMB_FREE_SYSTEM) || buffers[i].secondary < BUFFER_SEC_SYSTEM) {
+      if ((flags & FMB_FREE_STICKY) || !buffers[i].sticky) {
+        if (flags & FMB_CLEAN) {
+          res = res || buffers[i].cleanup(&buffers[i]);
         }
+        free_buffer(&buffers[i]);
       }
     }
   }
@@ -254,6 +425,46 @@ uint8_t free_multiple_buffers(uint8_t flags) {
   return res;
 }
 
+/* Search part of find_buffer */
+static buffer_t *lookup_buffer(uint8_t secondary) {
+  /* Only allocated buffers can match */
+  bufmap_t used = ~free_map & BUFMAP_ALL;
+  uint8_t hint = SECMAP_NONE;
+  uint8_t i;
+
+  if (secondary < SECMAP_SIZE) {
+    i = sec_map[secondary];
+    if (i != SECMAP_NONE && buffers[i].allocated &&
+        buffers[i].secondary == secondary) {
+      /* Several buffers may carry the secondary, the hint is
+         only used if no lower one would be found first */
+      hint = i;
+      if (i < 64)
+        used &= ((bufmap_t)1 << i) - 1;
+    }
+  }
+
+  while (used != 0) {
+    i = __builtin_ctzll(used);
+    used &= used - 1;
+
+    if (buffers[i].secondary == secondary)
+      goto found;
+  }
+
+  if (hint != SECMAP_NONE)
+    return &buffers[hint];
+
+  i = ERRORBUFFER_IDX;
+  if (buffers[i].secondary != secondary)
+    return NULL;
+
+ found:
+  if (secondary < SECMAP_SIZE)
+    sec_map[secondary] = i;
+  return &buffers[i];
+}
+
 /**
  * find_buffer - find the buffer corresponding to a secondary address
  * @secondary: secondary address to look for
@@ -261,15 +472,21 @@ uint8_t free_multiple_buffers(uint8_t flags) {
  * This function returns a pointer to the first buffer structure whose
  * secondary address is the same as the one given. Returns NULL if
  * no matching buffer was found.
+ *
+ * Secondary addresses are assigned directly in many places and buffer
+ * structures are swapped, so the secondary map is only used as a hint:
+ * It is checked first and updated on every lookup that had to search.
+ *
+ * Buffers of channels 0-14 are moved to internal RAM, see buffer_hot.
  */
 buffer_t *find_buffer(uint8_t secondary) {
-  uint8_t i;
+  buffer_t *buf = lookup_buffer(secondary);
 
-  for (i=0;i<CONFIG_BUFFER_COUNT+1;i++) {
-    if (buffers[i].allocated && buffers[i].secondary == secondary)
-      return &buffers[i];
-  }
-  return NULL;
+#ifdef CONFIG_BUFFER_HOT
+  if (buf != NULL && secondary < 15)
+    buffer_hot(buf);
+#endif
+  return buf;
 }
 
 /**
@@ -282,7 +499,7 @@ buffer_t *find_buffer(uint8_t secondary) {
 void mark_buffer_dirty(buffer_t *buf) {
   if (!buf->dirty) {
     buf->dirty = 1;
-    active_buffers += 16;
+    active_buffers += 256;
     set_dirty_led(1);
   }
 }
@@ -297,8 +514,161 @@ void mark_buffer_dirty(buffer_t *buf) {
 void mark_buffer_clean(buffer_t *buf) {
   if (buf->dirty) {
     buf->dirty = 0;
-    active_buffers -= 16;
+    active_buffers -= 256;
     if (get_dirty_buffer_count() == 0)
       set_dirty_led(0);
   }
 }
+
+#ifdef CONFIG_STORAGE_TASK
+/* ------------------------------------------------------------------------- */
+/*  Double-buffered reading                                                  */
+/* ------------------------------------------------------------------------- */
+
+/*
+ * While a block is sent, the storage task runs the refill callback on
+ * a copy of the buffer structure that uses a spare data buffer. At the
+ * end of the block only the structures and data pointers are swapped.
+ * This needs a refill that does not depend on state outside the buffer
+ * (buf->prefetch), a free buffer and a block that is not the last one -
+ * otherwise the block is refilled after sending as usual.
+ *
+ * A transfer that ends early waits for the prefetch but keeps its
+ * result, so a program that reads one byte per TALK (GET#) still reads
+ * every block only once. The result is dropped when the channel is
+ * closed or a DOS command could change its position or data. A failed
+ * prefetch is dropped as well, the refill at the end of the block
+ * then runs on the bus task and reports the error.
+ */
+static buffer_t      *prefetch_owner;  /* buffer the next block is for   */
+static buffer_t      *prefetch_spare;  /* copy that receives that block */
+static storage_req_t  prefetch_req;
+
+static uint8_t prefetch_refill(void *data) {
+  buffer_t *buf = data;
+
+  return buf->refill(buf);
+}
+
+/**
+ * buffer_prefetch - start refilling a copy of a buffer
+ * @buf: buffer whose current block is about to be sent
+ *
+ * This function starts reading the block that follows the current
+ * one of @buf in the background if @buf allows it. The result is
+ * picked up by buffer_swap.
+ */
+void buffer_prefetch(buffer_t *buf) {
+  buffer_t *spare;
+  uint8_t  *data;
+
+  if (prefetch_spare != NULL ||
+      !buf->prefetch || buf->sendeoi || buf->recordlen)
+    return;
+
+  spare = alloc_spare_buffer();
+  if (spare == NULL)
+    return;
+
+  data   = spare->data;
+  *spare = *buf;
+  spare->data      = data;
+  spare->secondary = BUFFER_SEC_SYSTEM;
+  spare->dirty     = 0;
+  /* survive the cleanup after the transfer */
+  spare->sticky    = 1;
+  /* D64 files keep the link to the next sector here */
+  data[0] = buf->data[0];
+  data[1] = buf->data[1];
+
+  prefetch_owner    = buf;
+  prefetch_spare    = spare;
+  prefetch_req.op   = STORAGE_CALL;
+  prefetch_req.call = prefetch_refill;
+  prefetch_req.data = spare;
+  storage_submit(&prefetch_req);
+}
+
+/**
+ * buffer_swap - use the prefetched block
+ * @buf: buffer that was sent completely
+ *
+ * This function waits for the prefetch started for @buf and moves
+ * the new block into it. Returns -1 if there is no usable prefetch,
+ * the caller must refill @buf itself then, or 0 if @buf was refilled.
+ */
+int8_t buffer_swap(buffer_t *buf) {
+  buffer_t *spare = prefetch_spare;
+  uint8_t  *data;
+
+  if (spare == NULL || prefetch_owner != buf)
+    return -1;
+
+  storage_wait(&prefetch_req);
+  prefetch_spare = NULL;
+
+  if (prefetch_req.result) {
+    free_buffer(spare);
+    return -1;
+  }
+
+  data = buf->data;
+  if (buffer_is_hot(buf)) {
+    /* keep the buffer in internal RAM */
+    memcpy(data, spare->data, 256);
+  } else {
+    buf->data   = spare->data;
+    spare->data = data;
+  }
+  buf->lastused = spare->lastused;
+  buf->position = spare->position;
+  buf->sendeoi  = spare->sendeoi;
+  buf->pvt      = spare->pvt;
+  free_buffer(spare);
+  return 0;
+}
+
+/**
+ * buffer_prefetch_wait - finish a prefetch at the end of a transfer
+ *
+ * This function must be called at the end of every transfer that
+ * used buffer_prefetch, so the storage task does not run a refill
+ * while the bus task does something else. A successful prefetch is
+ * kept for the next transfer of the channel, a failed one is dropped.
+ */
+void buffer_prefetch_wait(void) {
+  if (prefetch_spare == NULL)
+    return;
+
+  storage_wait(&prefetch_req);
+  if (prefetch_req.result)
+    buffer_prefetch_drop();
+}
+
+/**
+ * buffer_prefetch_drop - discard a prefetched block
+ *
+ * The buffer state before the prefetch is still intact, so the copy
+ * is just freed and the next block is read again when it is needed.
+ */
+void buffer_prefetch_drop(void) {
+  buffer_t *spare = prefetch_spare;
+
+  if (spare == NULL)
+    return;
+
+  storage_wait(&prefetch_req);
+  prefetch_spare = NULL;
+  free_buffer(spare);
+}
+
+/**
+ * buffer_prefetch_release - drop a prefetch that uses a buffer
+ * @buf: buffer that is freed
+ */
+static void buffer_prefetch_release(buffer_t *buf) {
+  if (prefetch_spare != NULL &&
+      (buf == prefetch_owner || buf == prefetch_spare))
+    buffer_prefetch_drop();
+}
+#endif
@@ -25,10 +25,13 @@
 #ifndef BUFFERS_H
 #define BUFFERS_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include "cbmdirent.h"
 
+/* CONFIG_BUFFER_COUNT is the largest pool, the error buffer follows it */
 #define ERRORBUFFER_IDX   CONFIG_BUFFER_COUNT
+#define BUFFER_COUNT_MIN  4
 #define BUFFER_SEC_SYSTEM 100
 
 /* Special-purpose buffer numbers */
@@ -69,18 +72,20 @@ typedef enum { DIR_FMT_CBM, DIR_FMT_CMD_SHORT, DIR_FMT_CMD_LONG } dirformat_t;
  * @write    : Flags if the buffer was opened for writing
  * @sendeoi  : Flags if the last byte should be sent with EOI
  * @sticky   : Flags if the buffer will survive garbage collection
+ * @prefetch : Flags if refill only depends on the buffer structure and
+ *             data[0..1], so it can fill a copy while data is sent
  * @refill   : Callback to refill/write out the buffer, returns true on error
  * @cleanup  : Callback to clean up and save remaining data, returns true on error
  *
  * Most allocated buffers point into the same bufferdata array, but
  * the error channel uses the same structure to avoid special-casing it
- * everywhere.
+ * everywhere. Buffers of channels on the bus may be moved to internal
+ * RAM blocks when the pool is in PSRAM, see buffer_hot.
  */
 typedef struct buffer_s {
   /* The error channel uses the same data structure for convenience reasons, */
-  /* so data must be a pointer. It also allows swapping the buffers around   */
-  /* in case I ever add external ram (not XRAM) to the design (which will    */
-  /* require locking =( ).                                                   */
+  /* so data must be a pointer. It also allows swapping the buffers between  */
+  /* PSRAM and internal RAM.                                                 */
   uint8_t *data;
   uint8_t lastused;
   uint8_t position;
@@ -94,6 +99,7 @@ typedef struct buffer_s {
   int     dirty:1;
   int     sendeoi:1;
   int     sticky:1;
+  int     prefetch:1;
   uint8_t (*seek) (struct buffer_s *buffer, uint32_t position, uint8_t index);
   uint8_t (*refill)(struct buffer_s *buffer);
   uint8_t (*cleanup)(struct buffer_s *buffer);
@@ -108,6 +114,10 @@ typedef struct buffer_s {
       date_t *match_start; /* Start matching date */
       date_t *match_end;   /* End matching date */
       uint8_t counter;     /* used for counting raw entries */
+      uint8_t order;       /* DIR_ORDER_* value */
+      bool paged;          /* only one page is listed */
+      uint16_t skip;       /* matching entries before the page */
+      uint16_t left;       /* entries left on the page */
     } dir;
 #ifdef CONFIG_HAVE_FATFS
     struct {
@@ -119,6 +129,10 @@ typedef struct buffer_s {
     struct {
       int fd;              /* File access via FAT */
       uint8_t headersize;  /* offset to start of file data */
+      void *readahead;     /* read-ahead stage, NULL if unused */
+      void *writebehind;   /* write-behind stage, NULL if unused */
+      uint32_t size;       /* file size at open time (read-ahead only) */
+      uint32_t offset;     /* file offset of the next byte (read-ahead only) */
     } vfs;
 #endif
     d64fh_t d64;           /* File access on D64  */
@@ -129,6 +143,16 @@ typedef struct buffer_s {
       uint8_t part;        /* partition number for $=P */
       uint8_t *matchstr;   /* Pointer to filename pattern */
     } pdir;
+#ifdef CONFIG_DIRLIST_CACHE
+    struct {
+      uint8_t slot;        /* cached listing */
+      uint32_t offset;     /* offset of the next part to be sent */
+    } dirlist;
+#endif
+    struct {
+      uint8_t op;          /* operation for $=L */
+      uint8_t bucket;      /* histogram bucket for $=L */
+    } latency;
     struct {
       uint8_t part;        /* partition number where the BAM came from */
       uint8_t track;       /* BAM-track (if more than one) */
@@ -157,6 +181,9 @@ uint8_t callback_dummy(buffer_t *buf);
 /* Allocates a buffer for internal use */
 buffer_t *alloc_system_buffer(void);
 
+/* Allocates a buffer for internal use without setting an error */
+buffer_t *alloc_spare_buffer(void);
+
 /* Allocates a buffer - returns pointer to buffer or NULL if failure */
 buffer_t *alloc_buffer(void);
 
@@ -187,14 +214,32 @@ static inline void unstick_buffer(buffer_t *buf) {
 /* Returns pointer to buffer on success or NULL on failure */
 buffer_t *find_buffer(uint8_t secondary);
 
-/* Number of currently allocated buffers + 16 * number of write buffers */
-extern uint8_t active_buffers;
+/* Number of currently allocated buffers + 256 * number of write buffers */
+extern uint16_t active_buffers;
+
+/* Number of buffers in the pool and its stored setting (0: default) */
+extern uint8_t buffer_count;
+extern uint8_t buffer_pool_size;
 
 /* Check if any buffers are free */
-#define check_free_buffers() ((active_buffers & 0x0f) < CONFIG_BUFFER_COUNT)
+#define check_free_buffers() ((active_buffers & 0xff) < buffer_count)
 
 /* Return the number of dirty buffers */
-#define get_dirty_buffer_count() (active_buffers >> 4)
+#define get_dirty_buffer_count() (active_buffers >> 8)
+
+#ifdef CONFIG_BUFFER_HOT
+/* Number of buffers moved to internal RAM */
+extern uint32_t buffer_migrations;
+
+/* Move the data of a buffer used on the bus to internal RAM */
+void buffer_hot(buffer_t *buf);
+
+/* Check if the data of a buffer is in internal RAM */
+bool buffer_is_hot(buffer_t *buf);
+#else
+#  define buffer_hot(buf)    do {} while (0)
+#  define buffer_is_hot(buf) false
+#endif
 
 /* Mark a buffer as write-buffer and sticky it */
 // Note: inline function is smaller than external on AVR with gcc 4.8.2
@@ -209,6 +254,25 @@ void mark_buffer_dirty(buffer_t *buf);
 /* Mark a buffer as clean */
 void mark_buffer_clean(buffer_t *buf);
 
+#ifdef CONFIG_STORAGE_TASK
+/* Start reading the next block into a spare buffer */
+void buffer_prefetch(buffer_t *buf);
+
+/* Move the prefetched block into the buffer: -1 none, 0 ok */
+int8_t buffer_swap(buffer_t *buf);
+
+/* Wait for the prefetch at the end of a transfer, keep it if it worked */
+void buffer_prefetch_wait(void);
+
+/* Discard a prefetched block */
+void buffer_prefetch_drop(void);
+#else
+#  define buffer_prefetch(buf) do {} while (0)
+#  define buffer_swap(buf) (-1)
+#  define buffer_prefetch_wait() do {} while (0)
+#  define buffer_prefetch_drop() do {} while (0)
+#endif
+
 
 #ifdef __AVR__
 /* AVR-specific hack: Address 1 is r1 which is always zero in C code */
@@ -34,6 +34,7 @@
 #endif
 #ifdef CONFIG_HAVE_VFS
 #include <dirent.h>
+#include "pathtab.h"
 #endif
 
 #define CBM_NAME_LENGTH 16
@@ -89,12 +90,13 @@ typedef struct date {
 
 /**
  * struct dir_t - struct of directory references for various ops
+ * @path: handle of the directory name for VFS, see pathtab.h
  * @fat: cluster number of the directory start for FAT
  * @dxx: track/sector of the first directory sector for Dxx
  */
 typedef struct {
 #ifdef CONFIG_HAVE_VFS
-  char pathname[512]; // FIXME - should be more
+  pathref_t path;
 #endif
 #ifdef CONFIG_HAVE_FATFS
   uint32_t fat;
@@ -244,7 +246,14 @@ typedef struct dh_s {
 #ifdef CONFIG_HAVE_VFS
     struct {
       DIR *dirp;
-      char pathname[512]; // FIXME
+      pathref_t path;   /* not held, checked when used */
+#ifdef CONFIG_VFS_DIRCACHE
+      uint8_t  snap;    /* snapshot slot or 0xff for reading the directory */
+      uint32_t stamp;   /* stamp of the snapshot slot when it was opened   */
+      uint32_t offset;  /* offset of the next entry in the snapshot        */
+      uint16_t index;   /* number of entries read so far                   */
+      uint8_t  order;   /* DIR_ORDER_* value if read through a sort index  */
+#endif
     } vfs;
 #endif
 #ifdef CONFIG_HAVE_EEPROMFS
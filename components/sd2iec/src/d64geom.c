@@ -0,0 +1,66 @@
+/* sd2iec - SD/MMC to Commodore serial bus interface/controller
+   Copyright (C) 2007-2022  Ingo Korb <ingo@akana.de>
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+   d64geom.c: Track/sector geometry of Dxx images
+
+*/
+
+#include <stdint.h>
+#include "config.h"
+#include "progmem.h"
+#include "d64geom.h"
+
+/* Tables of uniform tracks: entry 0 and the start of tracks 1..n */
+#define UNIFORM_4(t,s)   ((t)*(s)), (((t)+1)*(s)), (((t)+2)*(s)), (((t)+3)*(s))
+#define UNIFORM_16(t,s)  UNIFORM_4(t,s),  UNIFORM_4((t)+4,s),  UNIFORM_4((t)+8,s),  UNIFORM_4((t)+12,s)
+#define UNIFORM_64(t,s)  UNIFORM_16(t,s), UNIFORM_16((t)+16,s), UNIFORM_16((t)+32,s), UNIFORM_16((t)+48,s)
+#define UNIFORM_256(t,s) UNIFORM_64(t,s), UNIFORM_64((t)+64,s), UNIFORM_64((t)+128,s), UNIFORM_64((t)+192,s)
+
+/* 1541 zones, tracks 36-42 of extended images have 17 sectors */
+const PROGMEM uint16_t d41_track_start[D41_MAX_TRACKS + 2] = {
+     0,    0,   21,   42,   63,   84,  105,  126,  147,  168,
+   189,  210,  231,  252,  273,  294,  315,  336,  357,  376,
+   395,  414,  433,  452,  471,  490,  508,  526,  544,  562,
+   580,  598,  615,  632,  649,  666,  683,  700,  717,  734,
+   751,  768,  785,  802
+};
+
+/* 1571: both sides use the 1541 zones */
+const PROGMEM uint16_t d71_track_start[D71_MAX_TRACKS + 2] = {
+     0,    0,   21,   42,   63,   84,  105,  126,  147,  168,
+   189,  210,  231,  252,  273,  294,  315,  336,  357,  376,
+   395,  414,  433,  452,  471,  490,  508,  526,  544,  562,
+   580,  598,  615,  632,  649,  666,  683,  704,  725,  746,
+   767,  788,  809,  830,  851,  872,  893,  914,  935,  956,
+   977,  998, 1019, 1040, 1059, 1078, 1097, 1116, 1135, 1154,
+  1173, 1191, 1209, 1227, 1245, 1263, 1281, 1298, 1315, 1332,
+  1349, 1366
+};
+
+/* 1581: 40 sectors on every track */
+const PROGMEM uint16_t d81_track_start[D81_MAX_TRACKS + 2] = {
+  0, UNIFORM_64(0, 40), UNIFORM_16(64, 40), 80 * 40
+};
+
+/* CMD native partitions: 256 sectors on every track */
+const PROGMEM uint16_t dnp_track_start[DNP_MAX_TRACKS + 2] = {
+  0, UNIFORM_256(0, 256)
+};
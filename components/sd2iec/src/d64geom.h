@@ -0,0 +1,88 @@
+/* sd2iec - SD/MMC to Commodore serial bus interface/controller
+   Copyright (C) 2007-2022  Ingo Korb <ingo@akana.de>
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+   d64geom.h: Track/sector geometry of Dxx images
+
+*/
+
+#ifndef D64GEOM_H
+#define D64GEOM_H
+
+#include <stdint.h>
+
+/* Highest track number of the supported geometries */
+#define D41_MAX_TRACKS  42
+#define D71_MAX_TRACKS  70
+#define D81_MAX_TRACKS  80
+#define DNP_MAX_TRACKS 255
+
+/**
+ * struct geometry_s - track layout of a mounted Dxx image
+ * @start : first LBA of every track, indexed by track number
+ * @tracks: highest track number of the image
+ *
+ * The start table holds one more entry than the image has tracks, so
+ * start[t+1] - start[t] is the number of sectors on track t and
+ * start[tracks+1] is the number of sectors of the image. Entry 0 is a
+ * placeholder that makes track 0 a track without sectors.
+ */
+typedef struct geometry_s {
+  const uint16_t *start;
+  uint8_t         tracks;
+} geometry_t;
+
+extern const uint16_t d41_track_start[D41_MAX_TRACKS + 2];
+extern const uint16_t d71_track_start[D71_MAX_TRACKS + 2];
+extern const uint16_t d81_track_start[D81_MAX_TRACKS + 2];
+extern const uint16_t dnp_track_start[DNP_MAX_TRACKS + 2];
+
+/*
+ * Track numbers often come from links on the disk, so the accessors
+ * never index past the start table: a track behind the last one maps
+ * to the end of the image and has no sectors.
+ */
+
+/* LBA sector number of track/sector, past the image if it is invalid */
+static inline uint16_t geom_lba(const geometry_t *geo, uint8_t track, uint8_t sector) {
+  if (track > geo->tracks)
+    track = geo->tracks + 1;
+  return geo->start[track] + sector;
+}
+
+/* Number of sectors on a track, 0 for track 0 and tracks past the image */
+static inline uint16_t geom_sectors(const geometry_t *geo, uint8_t track) {
+  if (track > geo->tracks)
+    return 0;
+  return geo->start[track + 1] - geo->start[track];
+}
+
+/* Number of sectors in the image */
+static inline uint16_t geom_total(const geometry_t *geo) {
+  return geo->start[geo->tracks + 1];
+}
+
+/* Check if track/sector is a sector of the image */
+static inline uint8_t geom_valid(const geometry_t *geo, uint8_t track, uint8_t sector) {
+  return track >= 1 && track <= geo->tracks &&
+         sector < geom_sectors(geo, track);
+}
+
+#endif
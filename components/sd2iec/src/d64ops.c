@@ -24,12 +24,17 @@
 */
 
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include "config.h"
 #include "buffers.h"
 #include "cbmdirent.h"
+#include "d64geom.h"
+#include "dirlist.h"
 #include "errormsg.h"
+#include "imgcache.h"
+#include "latency.h"
 #ifdef CONFIG_HAVE_FATFS
 #include "fatops.h"
 #include "ff.h"
@@ -37,13 +42,20 @@
 #include "parser.h"
 #include "progmem.h"
 #include "rtc.h"
+#include "trace.h"
 #include "ustring.h"
 #include "wrapops.h"
+#ifdef CONFIG_HAVE_VFS
+#include <unistd.h>
+#include "storage.h"
+#include "vfsops.h"
+#endif
 #include "d64ops.h"
 
-#define D41_ERROR_OFFSET 174848
-#define D71_ERROR_OFFSET 349696
-#define D81_ERROR_OFFSET 819200
+#if defined(CONFIG_STORAGE_TASK) && defined(CONFIG_HAVE_VFS)
+#  define CHAIN_PREFETCH
+#endif
+
 
 #define D41_BAM_TRACK           18
 #define D41_BAM_SECTOR          0
@@ -80,20 +92,44 @@
 #define DNP_LABEL_AREA_SIZE             (28-4+1)
 #define DNP_ID_OFFSET                    22
 
-/* used for error info only */
-#define MAX_SECTORS_PER_TRACK 40
-
 typedef enum { BAM_BITFIELD, BAM_FREECOUNT } bamdata_t;
 
-struct {
+/* directory sector buffer, part == 255 if unused */
+static struct {
   uint8_t part;
   uint8_t track;
-  uint8_t errors[MAX_SECTORS_PER_TRACK];
-} errorcache;
-
-static buffer_t *bam_buffer;  // recently-used buffer
-static buffer_t *bam_buffer2; // secondary buffer
-static uint8_t   bam_refcount;
+  uint8_t sector;
+  uint8_t dirty;
+  uint8_t data[256];
+} dirsector = { .part = 255 };
+
+/* name index of one directory per partition, data is NULL if unused */
+#define DIRINDEX_SLOT_SIZE   3
+#define DIRINDEX_SECTOR_SIZE (2 + 8 * DIRINDEX_SLOT_SIZE)
+
+static struct {
+  uint8_t *data;    // per directory sector: track, sector, 8 slots
+  uint16_t sectors; // number of directory sectors in the index
+  uint16_t size;    // number of directory sectors allocated
+  uint8_t  track;   // header track/sector of the indexed directory
+  uint8_t  sector;
+} dirindex[CONFIG_MAX_PARTITIONS];
+
+/* track layout of the image mounted on each partition */
+static geometry_t geometry[CONFIG_MAX_PARTITIONS];
+
+/* error info of each partition, one byte per sector, NULL if unused */
+static uint8_t *errormap[CONFIG_MAX_PARTITIONS];
+
+/* BAM mirror of each partition, data is NULL if unused */
+#define BAM_MAX_SECTORS 32 // DNP, one bit per sector in dirty
+
+static struct {
+  uint8_t  *data;      // all BAM sectors of the image
+  uint16_t *freecount; // free sectors per track, behind data
+  uint32_t  dirty;     // bitmask of modified BAM sectors
+  uint8_t   sectors;   // number of BAM sectors
+} bam[CONFIG_MAX_PARTITIONS];
 
 /* ------------------------------------------------------------------------- */
 /*  Forward declarations                                                     */
@@ -101,6 +137,16 @@ static uint8_t   bam_refcount;
 
 static uint8_t d64_opendir(dh_t *dh, path_t *path);
 
+#ifdef CONFIG_TRACK_CACHE
+static uint8_t trackcache_read(uint8_t part, uint8_t track, uint8_t sector, uint8_t *buf, uint16_t len);
+static void trackcache_written(uint8_t part, uint8_t track, uint8_t sector, uint8_t *data);
+static void trackcache_drop(uint8_t part);
+#else
+#  define trackcache_read(part,track,sector,buf,len) image_read(part, sector_offset(part,track,sector), buf, len)
+#  define trackcache_written(part,track,sector,data) do {} while (0)
+#  define trackcache_drop(part) do {} while (0)
+#endif
+
 static void format_d41_image(uint8_t part, buffer_t *buf, uint8_t *name, uint8_t *idbuf);
 static void format_d71_image(uint8_t part, buffer_t *buf, uint8_t *name, uint8_t *idbuf);
 static void format_d81_image(uint8_t part, buffer_t *buf, uint8_t *name, uint8_t *idbuf);
@@ -184,36 +230,12 @@ static uint8_t get_param(uint8_t part, param_t param) {
  * @track : Track number
  * @sector: Sector number
  *
- * Calculates an LBA-style sector number for a given track/sector pair.
+ * Calculates an LBA-style sector number for a given track/sector pair
+ * from the geometry table selected at mount time. Tracks past the end
+ * of the image result in a sector behind it.
  */
-/* This version used the least code of all tested variants. */
-static uint16_t sector_lba(uint8_t part, uint8_t track, const uint8_t sector) {
-  uint16_t offset = 0;
-
-  track--; /* Track numbers are 1-based */
-
-  switch (partition[part].imagetype & D64_TYPE_MASK) {
-  case D64_TYPE_D41:
-  case D64_TYPE_D71:
-  default:
-    if (track >= 35) {
-      offset = 683;
-      track -= 35;
-    }
-    if (track < 17)
-      return track*21 + sector + offset;
-    if (track < 24)
-      return 17*21 + (track-17)*19 + sector + offset;
-    if (track < 30)
-      return 17*21 + 7*19 + (track-24)*18 + sector + offset;
-    return 17*21 + 7*19 + 6*18 + (track-30)*17 + sector + offset;
-
-  case D64_TYPE_D81:
-    return track*40 + sector;
-
-  case D64_TYPE_DNP:
-    return track*256 + sector;
-  }
+static inline uint16_t sector_lba(uint8_t part, uint8_t track, const uint8_t sector) {
+  return geom_lba(&geometry[part], track, sector);
 }
 
 /**
@@ -224,7 +246,7 @@ static uint16_t sector_lba(uint8_t part, uint8_t track, const uint8_t sector) {
  *
  * Calculates an offset into a D64 file from a track and sector number.
  */
-static uint32_t sector_offset(uint8_t part, uint8_t track, const uint8_t sector) {
+static inline uint32_t sector_offset(uint8_t part, uint8_t track, const uint8_t sector) {
   return 256L * sector_lba(part,track,sector);
 }
 
@@ -234,29 +256,10 @@ static uint32_t sector_offset(uint8_t part, uint8_t track, const uint8_t sector)
  * @track: Track number
  *
  * This function returns the number of sectors on the given track
- * of a 1541/71/81 disk. Invalid track numbers will return invalid results.
+ * of a 1541/71/81 disk. Tracks past the end of the image have none.
  */
-static uint16_t sectors_per_track(uint8_t part, uint8_t track) {
-  switch (partition[part].imagetype & D64_TYPE_MASK) {
-  case D64_TYPE_D41:
-  case D64_TYPE_D71:
-  default:
-    if (track > 35)
-      track -= 35;
-    if (track < 18)
-      return 21;
-    if (track < 25)
-      return 19;
-    if (track < 31)
-      return 18;
-    return 17;
-
-  case D64_TYPE_D81:
-    return 40;
-
-  case D64_TYPE_DNP:
-    return 256;
-  }
+static inline uint16_t sectors_per_track(uint8_t part, uint8_t track) {
+  return geom_sectors(&geometry[part], track);
 }
 
 /**
@@ -274,54 +277,22 @@ static uint16_t sectors_per_track(uint8_t part, uint8_t track) {
  * 2 if the range check failed.
  */
 static uint8_t checked_read(uint8_t part, uint8_t track, uint8_t sector, uint8_t *buf, uint16_t len, uint8_t error) {
-  if (track < 1 || track > get_param(part, LAST_TRACK) ||
-      sector >= sectors_per_track(part, track)) {
+  if (!geom_valid(&geometry[part], track, sector)) {
     set_error_ts(error,track,sector);
     return 2;
   }
 
-  if (partition[part].imagetype & D64_HAS_ERRORINFO) {
+  if (errormap[part] != NULL) {
     /* Check if the sector is marked as bad */
-    if (errorcache.part != part || errorcache.track != track) {
-      /* Read the error info for this track */
-      memset(errorcache.errors, 1, sizeof(errorcache.errors));
-
-      switch (partition[part].imagetype & D64_TYPE_MASK) {
-      case D64_TYPE_D41:
-        if (image_read(part, D41_ERROR_OFFSET + sector_lba(part,track,0),
-                       errorcache.errors, sectors_per_track(part, track)) >= 2)
-          return 2;
-        break;
-
-      case D64_TYPE_D71:
-        if (image_read(part, D71_ERROR_OFFSET + sector_lba(part,track,0),
-                       errorcache.errors, sectors_per_track(part, track)) >= 2)
-          return 2;
-        break;
-
-      case D64_TYPE_D81:
-        if (image_read(part, D81_ERROR_OFFSET + sector_lba(part,track,0),
-                       errorcache.errors, sectors_per_track(part, track)) >= 2)
-          return 2;
-        break;
-
-      default:
-        /* Should not happen unless someone enables error info
-           for additional image formats */
-        return 2;
-
-      }
-      errorcache.part  = part;
-      errorcache.track = track;
-    }
+    uint8_t code = errormap[part][sector_lba(part,track,sector)];
 
     /* Calculate error message from the code */
-    if (errorcache.errors[sector] >= 2 && errorcache.errors[sector] <= 11) {
+    if (code >= 2 && code <= 11) {
       /* Most codes can be mapped directly */
-      set_error_ts(errorcache.errors[sector]-2+20,track,sector);
+      set_error_ts(code-2+20,track,sector);
       return 2;
     }
-    if (errorcache.errors[sector] == 15) {
+    if (code == 15) {
       /* Drive not ready */
       set_error(74);
       return 2;
@@ -329,7 +300,7 @@ static uint8_t checked_read(uint8_t part, uint8_t track, uint8_t sector, uint8_t
     /* 1 is OK, unknown values are accepted too */
   }
 
-  return image_read(part, sector_offset(part,track,sector), buf, len);
+  return trackcache_read(part, track, sector, buf, len);
 }
 
 /**
@@ -359,21 +330,214 @@ static void update_timestamp(uint8_t *buffer) {
 #endif
 }
 
+/* ------------------------------------------------------------------------- */
+/*  Directory sector buffer                                                  */
+/* ------------------------------------------------------------------------- */
+
 /**
- * write_entry - write a single directory entry
- * @part : partition number
- * @dh   : pointer to d64dh pointing to the entry
- * @buf  : pointer to the buffer where the data should be read from
+ * dirsector_flush - write the directory sector buffer to disk
  * @flush: if true, data is flushed to disk immediately
  *
+ * This function writes the directory sector buffer to the disk image
+ * if it holds modified data. Returns 0 if successful, != 0 otherwise.
+ */
+static uint8_t dirsector_flush(uint8_t flush) {
+  if (!dirsector.dirty || dirsector.part >= max_part)
+    return 0;
+
+  dirsector.dirty = 0;
+  return image_write(dirsector.part,
+                     sector_offset(dirsector.part, dirsector.track, dirsector.sector),
+                     dirsector.data, 256, flush);
+}
+
+/**
+ * dirsector_load - read a directory sector into the sector buffer
+ * @part  : partition number
+ * @track : track of the directory sector
+ * @sector: sector of the directory sector
+ *
+ * This function makes sure that the directory sector buffer holds the
+ * specified sector, writing back its previous contents if required.
+ * Returns the same as checked_read (0 success, 1 partial read, 2 failed).
+ */
+static uint8_t dirsector_load(uint8_t part, uint8_t track, uint8_t sector) {
+  uint8_t res;
+
+  if (dirsector.part   == part  &&
+      dirsector.track  == track &&
+      dirsector.sector == sector)
+    return 0;
+
+  if (dirsector_flush(0))
+    return 2;
+
+  dirsector.part = 255;
+  res = checked_read(part, track, sector, dirsector.data, 256, ERROR_ILLEGAL_TS_LINK);
+  if (res)
+    return res;
+
+  dirsector.part   = part;
+  dirsector.track  = track;
+  dirsector.sector = sector;
+  return 0;
+}
+
+/**
+ * dirsector_drop - forget the directory sector buffer contents
+ * @part: partition number
+ *
+ * This function invalidates the directory sector buffer if it holds
+ * a sector of partition @part, without writing it back. Used when the
+ * sector on disk is about to be replaced by other means.
+ */
+static void dirsector_drop(uint8_t part) {
+  if (dirsector.part == part) {
+    dirsector.part  = 255;
+    dirsector.dirty = 0;
+  }
+}
+
+/* ------------------------------------------------------------------------- */
+/*  Directory name index                                                     */
+/* ------------------------------------------------------------------------- */
+
+/* The index holds one record per sector of a directory in chain order,  */
+/* consisting of its track and sector followed by one slot per entry.    */
+/* A slot stores the file type byte, the first character of the name and */
+/* a hash of the name, which is enough to skip entries that cannot match. */
+
+/**
+ * dirindex_hash - hash a file name
+ * @name: pointer to the name
+ *
+ * This function calculates the hash of a name as used in the directory
+ * index. The name ends at the first 0 or 0xa0 byte or after 16
+ * characters, matching the length that match_name() compares.
+ */
+static uint8_t dirindex_hash(uint8_t *name) {
+  uint8_t hash = 0;
+
+  for (uint8_t i=0; i<CBM_NAME_LENGTH && name[i] != 0 && name[i] != 0xa0; i++)
+    hash = (hash << 3) + (hash >> 5) + name[i];
+
+  return hash;
+}
+
+/**
+ * dirindex_drop - release the directory index of a partition
+ * @part: partition number
+ */
+static void dirindex_drop(uint8_t part) {
+  free(dirindex[part].data);
+  dirindex[part].data    = NULL;
+  dirindex[part].sectors = 0;
+  dirindex[part].size    = 0;
+}
+
+/**
+ * dirindex_find - find the index record of a directory sector
+ * @part  : partition number
+ * @track : track of the directory sector
+ * @sector: sector of the directory sector
+ *
+ * Returns a pointer to the index record of the given sector or
+ * NULL if it is not part of the indexed directory.
+ */
+static uint8_t *dirindex_find(uint8_t part, uint8_t track, uint8_t sector) {
+  uint8_t *rec = dirindex[part].data;
+
+  for (uint16_t i=0; i<dirindex[part].sectors; i++, rec += DIRINDEX_SECTOR_SIZE)
+    if (rec[0] == track && rec[1] == sector)
+      return rec;
+
+  return NULL;
+}
+
+/**
+ * dirindex_append - add a directory sector to the index
+ * @part  : partition number
+ * @track : track of the directory sector
+ * @sector: sector of the directory sector
+ *
+ * This function appends a record with empty slots for the given sector
+ * to the index of partition @part. If memory runs out, the index
+ * is dropped. Returns a pointer to the new record or NULL.
+ */
+static uint8_t *dirindex_append(uint8_t part, uint8_t track, uint8_t sector) {
+  uint8_t *rec;
+
+  if (dirindex[part].sectors == dirindex[part].size) {
+    rec = realloc(dirindex[part].data,
+                  (dirindex[part].size + 8) * DIRINDEX_SECTOR_SIZE);
+    if (rec == NULL) {
+      dirindex_drop(part);
+      return NULL;
+    }
+    dirindex[part].data  = rec;
+    dirindex[part].size += 8;
+  }
+
+  rec = dirindex[part].data + dirindex[part].sectors++ * DIRINDEX_SECTOR_SIZE;
+  memset(rec, 0, DIRINDEX_SECTOR_SIZE);
+  rec[0] = track;
+  rec[1] = sector;
+
+  return rec;
+}
+
+/**
+ * dirindex_set - update an index slot from a directory entry
+ * @slot : pointer to the index slot
+ * @entry: pointer to the 32 byte directory entry
+ */
+static void dirindex_set(uint8_t *slot, uint8_t *entry) {
+  slot[0] = entry[DIR_OFS_FILE_TYPE];
+  slot[1] = entry[DIR_OFS_FILE_NAME];
+  slot[2] = dirindex_hash(entry + DIR_OFS_FILE_NAME);
+}
+
+/**
+ * dirindex_update - update the index after a directory entry write
+ * @part: partition number
+ * @dh  : pointer to d64dh pointing to the entry
+ * @buf : pointer to the new contents of the entry
+ */
+static void dirindex_update(uint8_t part, struct d64dh *dh, uint8_t *buf) {
+  uint8_t *rec = dirindex_find(part, dh->track, dh->sector);
+
+  if (rec)
+    dirindex_set(rec + 2 + dh->entry * DIRINDEX_SLOT_SIZE, buf);
+}
+
+/**
+ * write_entry - write a single directory entry
+ * @part: partition number
+ * @dh  : pointer to d64dh pointing to the entry
+ * @buf : pointer to the buffer where the data should be read from
+ *
  * This function writes a single directory entry specified by @dh
- * from the buffer @buf.
+ * from the buffer @buf. The entry is merged into the directory sector
+ * buffer, which is written back like the BAM by d64_bam_commit at the
+ * end of the bus transaction or earlier when another sector is loaded,
+ * so all entries changed in one sector cost a single write.
+ * The directory index is updated as well.
  * Assumes that it is never called with an invalid track/sector.
- * Returns the same as image_write
+ * Returns 0 if successful, != 0 if the sector could not be loaded.
  */
-static uint8_t write_entry(uint8_t part, struct d64dh *dh, uint8_t *buf, uint8_t flush) {
-  return image_write(part, sector_offset(part, dh->track, dh->sector) +
-                           dh->entry * 32, buf, 32, flush);
+static uint8_t write_entry(uint8_t part, struct d64dh *dh, uint8_t *buf) {
+  uint8_t res;
+
+  dirindex_update(part, dh, buf);
+
+  res = dirsector_load(part, dh->track, dh->sector);
+  if (res)
+    return res;
+
+  memcpy(dirsector.data + dh->entry * 32, buf, 32);
+  dirsector.dirty = 1;
+  dirlist_invalidate();
+  return 0;
 }
 
 /**
@@ -384,12 +548,18 @@ static uint8_t write_entry(uint8_t part, struct d64dh *dh, uint8_t *buf, uint8_t
  *
  * This function reads a single directory entry specified by dh
  * into the buffer buf which needs to be at least 32 bytes big.
+ * The whole sector is kept in the directory sector buffer.
  * Assumes that it is never called with an invalid track/sector.
  * Returns the same as image_read (0 success, 1 partial read, 2 failed)
  */
 static uint8_t read_entry(uint8_t part, struct d64dh *dh, uint8_t *buf) {
-  return image_read(part, sector_offset(part, dh->track, dh->sector) +
-                          dh->entry * 32, buf, 32);
+  uint8_t res = dirsector_load(part, dh->track, dh->sector);
+
+  if (res)
+    return res;
+
+  memcpy(buf, dirsector.data + dh->entry * 32, 32);
+  return 0;
 }
 
 /**
@@ -423,139 +593,531 @@ static uint8_t clear_dir_sector(uint8_t part, uint8_t t, uint8_t s, uint8_t *dat
 
 
 /* ------------------------------------------------------------------------- */
-/*  BAM buffer handling                                                      */
+/*  File chain prefetch                                                      */
 /* ------------------------------------------------------------------------- */
 
+/* When a reader follows the T/S links of a file sector by sector, the */
+/* storage task walks ahead along the same links and stages the next   */
+/* sectors, so the reader finds them in memory. Only used for images   */
+/* read directly from the card - a RAM copy is fast enough anyway.     */
+
+#ifdef CHAIN_PREFETCH
+
+/* Number of sectors that can be staged ahead of the reader */
+#define CHAIN_DEPTH 8
+
 /**
- * bam_buffer_flush - write BAM buffer to disk
- * @buf: pointer to the BAM buffer
+ * struct chain - sectors staged ahead along a link chain
+ * @data  : CHAIN_DEPTH sectors, allocated on first use
+ * @ts    : track and sector of each staged sector
+ * @filled: number of sectors staged, advanced by the walk
+ * @taken : number of staged sectors used, advanced by the bus task
+ * @stop  : asks a running walk to return early
+ * @active: flags if the staged sectors can be used
+ * @part  : partition of the chain
+ * @track : next sector to be staged, 0 at the end of the chain
+ * @sector: (only changed by the walk)
+ * @writes: image_writes of the partition when the chain was started
+ * @link  : link of the sector that was read last, with its partition
+ * @req   : walk request
+ */
+static struct {
+  uint8_t       *data;
+  uint8_t        ts[CHAIN_DEPTH][2];
+  uint8_t        filled;
+  uint8_t        taken;
+  uint8_t        stop;
+  uint8_t        active;
+  uint8_t        part;
+  uint8_t        track;
+  uint8_t        sector;
+  uint32_t       writes;
+  uint8_t        link[3];
+  storage_req_t  req;
+} chain;
+
+/**
+ * chain_walk - stage sectors along the chain
+ * @data: unused
  *
- * This function writes the contents of the BAM buffer to the disk image.
- * Returns 0 if successful, != 0 otherwise.
+ * This function runs on the storage task. It reads sectors along the
+ * chain until all slots are in use, the chain ends or it is asked to
+ * stop. pread is used because the bus task may access the same file
+ * in the meantime. Always returns 0.
  */
-static uint8_t bam_buffer_flush(buffer_t *buf) {
-  uint8_t res;
+static uint8_t chain_walk(void *data) {
+  uint8_t part = chain.part;
 
-  if (buf->mustflush && buf->pvt.bam.part < max_part) {
-    res = image_write(buf->pvt.bam.part,
-                      sector_offset(buf->pvt.bam.part,
-                                    buf->pvt.bam.track,
-                                    buf->pvt.bam.sector),
-                      buf->data, 256, 1);
-    buf->mustflush = 0;
+  (void)data;
 
-    return res;
-  } else
+  while (!__atomic_load_n(&chain.stop, __ATOMIC_ACQUIRE)) {
+    uint8_t filled = chain.filled;
+    uint8_t t = chain.track;
+    uint8_t s = chain.sector;
+    uint8_t *slot;
+
+    if ((uint8_t)(filled - __atomic_load_n(&chain.taken, __ATOMIC_ACQUIRE)) >= CHAIN_DEPTH)
+      break;
+
+    if (!geom_valid(&geometry[part], t, s)) {
+      chain.track = 0;
+      break;
+    }
+
+    slot = chain.data + 256 * (filled % CHAIN_DEPTH);
+    if (pread(partition[part].imagefd, slot, 256, sector_offset(part, t, s)) != 256) {
+      chain.track = 0;
+      break;
+    }
+
+    chain.ts[filled % CHAIN_DEPTH][0] = t;
+    chain.ts[filled % CHAIN_DEPTH][1] = s;
+    chain.track  = slot[0];
+    chain.sector = slot[1];
+    __atomic_store_n(&chain.filled, (uint8_t)(filled + 1), __ATOMIC_RELEASE);
+    storage_progress();
+  }
+
+  return 0;
+}
+
+/* Continue walking the chain in the background */
+static void chain_continue(void) {
+  chain.req.op   = STORAGE_CALL;
+  chain.req.call = chain_walk;
+  storage_submit(&chain.req);
+}
+
+/* Returns true if sector reads of the partition use the chain */
+static uint8_t chain_usable(uint8_t part) {
+  return partition[part].parent_fop == &vfsops &&
+         !(partition[part].imagetype & D64_HAS_ERRORINFO);
+}
+
+/* Stop the walk and forget the staged sectors */
+static void chain_drop(void) {
+  if (!chain.active)
+    return;
+
+  __atomic_store_n(&chain.stop, 1, __ATOMIC_RELEASE);
+  storage_wait(&chain.req);
+  chain.stop   = 0;
+  chain.active = 0;
+}
+
+/**
+ * chain_start - start staging a chain
+ * @part  : partition number
+ * @track : track of the first sector to stage
+ * @sector: sector of the first sector to stage
+ */
+static void chain_start(uint8_t part, uint8_t track, uint8_t sector) {
+  chain_drop();
+
+  if (!chain_usable(part))
+    return;
+
+  if (chain.data == NULL) {
+    chain.data = malloc(CHAIN_DEPTH * 256);
+    if (chain.data == NULL)
+      return;
+  }
+
+  chain.part   = part;
+  chain.track  = track;
+  chain.sector = sector;
+  chain.filled = 0;
+  chain.taken  = 0;
+  chain.writes = image_writes[part];
+  chain.active = 1;
+  chain_continue();
+}
+
+/**
+ * chain_take - get a staged sector
+ * @part  : partition number
+ * @track : track of the sector
+ * @sector: sector number
+ * @data  : destination for the 256 bytes of the sector
+ *
+ * This function copies the requested sector from the chain if it is
+ * the next one that was or is being staged. Returns 1 if the sector
+ * was copied, 0 if it must be read from the image.
+ */
+static uint8_t chain_take(uint8_t part, uint8_t track, uint8_t sector, uint8_t *data) {
+  uint8_t slot;
+
+  if (!chain.active)
+    return 0;
+
+  if (chain.part != part || chain.writes != image_writes[part]) {
+    chain_drop();
+    return 0;
+  }
+
+  /* wait until the walk has staged the next sector */
+  while (__atomic_load_n(&chain.filled, __ATOMIC_ACQUIRE) == chain.taken) {
+    if (!storage_busy(&chain.req)) {
+      chain_drop();
+      return 0;
+    }
+    storage_wait_progress();
+  }
+
+  slot = chain.taken % CHAIN_DEPTH;
+  if (chain.ts[slot][0] != track || chain.ts[slot][1] != sector) {
+    chain_drop();
     return 0;
+  }
+
+  memcpy(data, chain.data + 256 * slot, 256);
+  __atomic_store_n(&chain.taken, (uint8_t)(chain.taken + 1), __ATOMIC_RELEASE);
+
+  /* a walk that stopped because all slots were used can go on now */
+  if (!storage_busy(&chain.req) && chain.track != 0)
+    chain_continue();
+
+  return 1;
 }
 
 /**
- * d64_bam_commit - write BAM buffers to disk
+ * chain_read - read a sector, using the chain prefetch if possible
+ * @part  : partition number
+ * @track : track number to be read
+ * @sector: sector number to be read
+ * @data  : pointer to where the 256 bytes should be read to
+ * @error : error number to be flagged if the range check fails
  *
- * This function is the exported interface to force the BAM buffer
- * contents to disk. Returns 0 if successful, != 0 otherwise.
+ * This function works like checked_read for a full sector. If the
+ * sector is the one the previously read sector links to, it is taken
+ * from the chain or, if the chain is not running yet, the chain is
+ * started after it. Returns the same as checked_read.
  */
-uint8_t d64_bam_commit(void) {
-  uint8_t res = 0;
+static uint8_t chain_read(uint8_t part, uint8_t track, uint8_t sector, uint8_t *data, uint8_t error) {
+  uint8_t follows, res;
+
+  /* block prefetches of images without a chain run on the storage task */
+  if (storage_task_self())
+    return checked_read(part, track, sector, data, 256, error);
+
+  follows = (chain.link[0] == part && chain.link[1] == track &&
+             chain.link[2] == sector);
 
-  if (bam_buffer)
-    res |= bam_buffer->cleanup(bam_buffer);
+  if (follows && chain_take(part, track, sector, data)) {
+    res = 0;
+  } else {
+    chain_drop();
+    res = checked_read(part, track, sector, data, 256, error);
+    if (res == 0 && follows && data[0] != 0)
+      chain_start(part, data[0], data[1]);
+  }
+
+  chain.link[0] = part;
+  chain.link[1] = (res == 0) ? data[0] : 0;
+  chain.link[2] = data[1];
+  return res;
+}
+
+#else
+#  define chain_read(part,track,sector,data,error) checked_read(part,track,sector,data,256,error)
+#  define chain_drop() do {} while (0)
+#  define chain_usable(part) 0
+#endif
+
+
+/* ------------------------------------------------------------------------- */
+/*  Track cache                                                              */
+/* ------------------------------------------------------------------------- */
+
+#ifdef CONFIG_TRACK_CACHE
+
+/* Largest unit of the cache is a D81 track, DNP tracks are split
+   into units of DNP_UNIT_SECTORS sectors. */
+#define UNIT_SECTORS     40
+#define DNP_UNIT_SECTORS 32
+#define TRACKCACHE_SLOTS 16
+
+/**
+ * struct trackcache - LRU cache of whole tracks of mounted images
+ * @data   : UNIT_SECTORS * 256 bytes per slot, allocated on first use
+ * @lba    : first sector of the unit held by a slot
+ * @used   : value of clock at the last access of a slot
+ * @part   : partition of a slot
+ * @sectors: number of sectors held by a slot, 0 if unused
+ * @writes : image_writes of each partition the cached data matches
+ * @clock  : counter for the LRU order
+ *
+ * The cache only runs on images that are read from the card directly,
+ * an image cache copy is faster already. Writes through d64_write_sector
+ * and file writes update a cached unit in place. Any other write to an
+ * image drops all units of its partition before the next read.
+ */
+static struct {
+  uint8_t  *data[TRACKCACHE_SLOTS];
+  uint16_t  lba[TRACKCACHE_SLOTS];
+  uint32_t  used[TRACKCACHE_SLOTS];
+  uint8_t   part[TRACKCACHE_SLOTS];
+  uint8_t   sectors[TRACKCACHE_SLOTS];
+  uint32_t  writes[CONFIG_MAX_PARTITIONS];
+  uint32_t  clock;
+} tcache;
+
+trackcache_stats_t trackcache_stats;
+
+/* Number of slots that fit into the configured budget */
+static uint8_t trackcache_slots(void) {
+  uint32_t slots = CONFIG_TRACK_CACHE / (UNIT_SECTORS * 256);
+
+  return (slots > TRACKCACHE_SLOTS ? TRACKCACHE_SLOTS : slots);
+}
+
+/**
+ * trackcache_unit - locate the cache unit of a sector
+ * @part   : partition number
+ * @track  : track number
+ * @sector : sector number
+ * @sectors: pointer to a variable receiving the number of sectors in the unit
+ *
+ * Returns the LBA of the first sector of the unit.
+ */
+static uint16_t trackcache_unit(uint8_t part, uint8_t track, uint8_t sector,
+                                uint8_t *sectors) {
+  if (partition[part].imagetype == D64_TYPE_DNP) {
+    *sectors = DNP_UNIT_SECTORS;
+    return sector_lba(part, track, sector & ~(DNP_UNIT_SECTORS-1));
+  }
+
+  *sectors = sectors_per_track(part, track);
+  return sector_lba(part, track, 0);
+}
+
+/* Find the slot that holds a sector, returns TRACKCACHE_SLOTS if none */
+static uint8_t trackcache_find(uint8_t part, uint16_t lba) {
+  for (uint8_t i = 0; i < TRACKCACHE_SLOTS; i++)
+    if (tcache.part[i] == part &&
+        lba >= tcache.lba[i] && lba < tcache.lba[i] + tcache.sectors[i])
+      return i;
+
+  return TRACKCACHE_SLOTS;
+}
+
+/**
+ * trackcache_drop - forget the cached units of a partition
+ * @part: partition number
+ */
+static void trackcache_drop(uint8_t part) {
+  for (uint8_t i = 0; i < TRACKCACHE_SLOTS; i++)
+    if (tcache.part[i] == part)
+      tcache.sectors[i] = 0;
+
+  tcache.writes[part] = image_writes[part];
+}
+
+/**
+ * trackcache_read - read a sector through the track cache
+ * @part  : partition number
+ * @track : track number
+ * @sector: sector number
+ * @buf   : pointer to where the data should be read to
+ * @len   : number of bytes to be read
+ *
+ * The first access to a unit reads all of its sectors with a single
+ * image_read into the least recently used slot. Returns the same as
+ * image_read.
+ */
+static uint8_t trackcache_read(uint8_t part, uint8_t track, uint8_t sector, uint8_t *buf, uint16_t len) {
+  uint8_t slots = trackcache_slots();
+  uint8_t i, sectors;
+  uint16_t first, lba = sector_lba(part, track, sector);
+
+  if (slots == 0 || partition[part].parent_fop != &vfsops)
+    return image_read(part, sector_offset(part, track, sector), buf, len);
+
+  if (tcache.writes[part] != image_writes[part])
+    trackcache_drop(part);
+
+  i = trackcache_find(part, lba);
+  if (i < TRACKCACHE_SLOTS) {
+    trackcache_stats.hits++;
+  } else {
+    trackcache_stats.misses++;
+
+    /* pick an unused or the least recently used slot */
+    i = 0;
+    for (uint8_t j = 0; j < slots; j++) {
+      if (tcache.sectors[j] == 0) {
+        i = j;
+        break;
+      }
+      if (tcache.used[j] < tcache.used[i])
+        i = j;
+    }
+
+    if (tcache.data[i] == NULL) {
+      tcache.data[i] = ext_malloc(UNIT_SECTORS * 256);
+      if (tcache.data[i] == NULL)
+        return image_read(part, sector_offset(part, track, sector), buf, len);
+    }
+
+    first = trackcache_unit(part, track, sector, &sectors);
+    tcache.sectors[i] = 0;
+    if (image_read(part, 256L * first, tcache.data[i], sectors * 256))
+      return image_read(part, sector_offset(part, track, sector), buf, len);
+
+    tcache.part[i]    = part;
+    tcache.lba[i]     = first;
+    tcache.sectors[i] = sectors;
+  }
+
+  tcache.used[i] = ++tcache.clock;
+  memcpy(buf, tcache.data[i] + 256 * (lba - tcache.lba[i]), len);
+  return 0;
+}
+
+/**
+ * trackcache_written - update the cache after a sector write
+ * @part  : partition number
+ * @track : track number
+ * @sector: sector number
+ * @data  : pointer to the 256 bytes that were written
+ *
+ * This function must be called right after the sector was written
+ * to the image. If no other write happened since the cache was last
+ * in sync with the image, the cached copy of the sector is updated
+ * and the cache stays valid.
+ */
+static void trackcache_written(uint8_t part, uint8_t track, uint8_t sector, uint8_t *data) {
+  uint16_t lba;
+  uint8_t i;
 
-  if (bam_buffer2)
-    res |= bam_buffer2->cleanup(bam_buffer2);
+  if (tcache.writes[part] + 1 != image_writes[part])
+    return;
 
-  return 0;
+  tcache.writes[part]++;
+  lba = sector_lba(part, track, sector);
+  i = trackcache_find(part, lba);
+  if (i < TRACKCACHE_SLOTS)
+    memcpy(tcache.data[i] + 256 * (lba - tcache.lba[i]), data, 256);
 }
 
+#endif
+
+
+/* ------------------------------------------------------------------------- */
+/*  BAM mirror handling                                                      */
+/* ------------------------------------------------------------------------- */
+
 /**
- * bam_buffer_alloc - allocates a buffer for the BAM
- * @buf: pointer to the BAM buffer pointer
+ * bam_sector_count - number of BAM sectors of an image
+ * @part: partition
  *
- * This function tries to allocate a buffer for holding the BAM,
- * using the pointer pointed to by @buf. Returns 0 if successful,
- * != 0 otherwise.
+ * Returns the number of BAM sectors used by the image type
+ * mounted on partition @part.
  */
-static uint8_t bam_buffer_alloc(buffer_t **buf) {
-  *buf = alloc_system_buffer();
-  if (!*buf)
+static uint8_t bam_sector_count(uint8_t part) {
+  switch (partition[part].imagetype & D64_TYPE_MASK) {
+  case D64_TYPE_D41:
+  default:
     return 1;
 
-  (*buf)->secondary    = BUFFER_SYS_BAM;
-  (*buf)->pvt.bam.part = 255;
-  (*buf)->cleanup      = bam_buffer_flush;
-  stick_buffer(*buf);
+  case D64_TYPE_D71:
+  case D64_TYPE_D81:
+    return 2;
 
-  return 0;
+  case D64_TYPE_DNP:
+    return (get_param(part, LAST_TRACK) >> 3) + 1;
+  }
 }
 
 /**
- * bam_buffer_swap - swap the two BAM buffers
+ * bam_sector_location - track and sector of a BAM sector
+ * @part  : partition
+ * @index : number of the BAM sector in the mirror
+ * @track : pointer to a variable receiving the track
+ * @sector: pointer to a variable receiving the sector
  *
- * Thus function swaps the pointers to the two BAM buffers
+ * This function calculates the on-disk location of the @index-th
+ * BAM sector of the image mounted on partition @part.
  */
-static void bam_buffer_swap(void) {
-  buffer_t *tmp = bam_buffer;
-  bam_buffer    = bam_buffer2;
-  bam_buffer2   = tmp;
+static void bam_sector_location(uint8_t part, uint8_t index,
+                                uint8_t *track, uint8_t *sector) {
+  switch (partition[part].imagetype & D64_TYPE_MASK) {
+  case D64_TYPE_D41:
+  default:
+    *track  = D41_BAM_TRACK;
+    *sector = D41_BAM_SECTOR;
+    break;
+
+  case D64_TYPE_D71:
+    *track  = (index ? D71_BAM2_TRACK  : D41_BAM_TRACK);
+    *sector = (index ? D71_BAM2_SECTOR : D41_BAM_SECTOR);
+    break;
+
+  case D64_TYPE_D81:
+    *track  = D81_BAM_TRACK;
+    *sector = D81_BAM_SECTOR1 + index;
+    break;
+
+  case D64_TYPE_DNP:
+    *track  = DNP_BAM_TRACK;
+    *sector = DNP_BAM_SECTOR + index;
+    break;
+  }
 }
 
 /**
- * bam_buffer_match - checks if a BAM buffer contains a specific sector
- * @buf   : BAM buffer to check
+ * bam_sector_index - find a sector in the BAM mirror
  * @part  : partition
- * @track : track
- * @sector: sector
+ * @track : track number
+ * @sector: sector number
  *
- * This function checks if the BAM buffer @buf currently holds the data
- * for the given @part, @track and @sector. Returns 1 if it does,
- * 0 otherwise.
+ * Returns the index of @track/@sector in the BAM mirror of partition
+ * @part or 255 if it is not a BAM sector.
  */
-static uint8_t bam_buffer_match(buffer_t *buf, uint8_t part,
-                                uint8_t track, uint8_t sector) {
-  if (buf->pvt.bam.part   == part  &&
-      buf->pvt.bam.track  == track &&
-      buf->pvt.bam.sector == sector)
-    return 1;
-  else
-    return 0;
+static uint8_t bam_sector_index(uint8_t part, uint8_t track, uint8_t sector) {
+  uint8_t t,s;
+
+  for (uint8_t i=0; i<bam[part].sectors; i++) {
+    bam_sector_location(part, i, &t, &s);
+    if (t == track && s == sector)
+      return i;
+  }
+
+  return 255;
 }
 
 /**
- * move_bam_window - read correct BAM sector into window.
+ * bam_pointer - locate the BAM data of a track in the mirror
  * @part  : partition
  * @track : track number
  * @type  : type of pointer requested
- * @ptr   : pointer to track information in BAM sector
+ * @index : pointer to a variable receiving the BAM sector index
  *
- * This function reads the correct BAM sector into memory for the requested
- * track, flushing an existing BAM sector to disk if needed.  It also
- * calculates the correct pointer into the BAM sector for the appropriate
- * track.  Since the BAM contains both sector counts and sector allocation
- * bitmaps, type is used to signal which reference is desired.
- * This function may swap the BAM buffer pointers, after it returns
- * bam_buffer is always the buffer with the requested sector.
- * Returns 0 if successful, != 0 otherwise.
+ * This function calculates the position of the BAM information for
+ * @track in the BAM mirror. Since the BAM contains both sector counts
+ * and sector allocation bitmaps, type is used to signal which reference
+ * is desired. Returns a pointer to the data or NULL if partition
+ * @part has no BAM mirror.
  */
-static uint8_t move_bam_window(uint8_t part, uint8_t track, bamdata_t type, uint8_t **ptr) {
-  uint8_t res;
-  uint8_t t,s, pos;
+static uint8_t *bam_pointer(uint8_t part, uint8_t track, bamdata_t type, uint8_t *index) {
+  uint8_t idx, pos;
+
+  if (bam[part].data == NULL)
+    return NULL;
 
   switch(partition[part].imagetype & D64_TYPE_MASK) {
   case D64_TYPE_D41:
   default:
-    t   = D41_BAM_TRACK;
-    s   = D41_BAM_SECTOR;
+    idx = 0;
     pos = D41_BAM_BYTES_PER_TRACK * track + (type == BAM_BITFIELD ? 1:0);
     break;
 
   case D64_TYPE_D71:
     if (track > 35 && type == BAM_BITFIELD) {
-      t   = D71_BAM2_TRACK;
-      s   = D71_BAM2_SECTOR;
+      idx = 1;
       pos = (track - 36) * D71_BAM2_BYTES_PER_TRACK;
     } else {
-      t = D41_BAM_TRACK;
-      s = D41_BAM_SECTOR;
+      idx = 0;
       if (track > 35) {
         pos = (track - 36) + D71_BAM_COUNTER2OFFSET;
       } else {
@@ -565,67 +1127,218 @@ static uint8_t move_bam_window(uint8_t part, uint8_t track, bamdata_t type, uint
     break;
 
   case D64_TYPE_D81:
-    t   = D81_BAM_TRACK;
-    s   = (track < 41 ? D81_BAM_SECTOR1 : D81_BAM_SECTOR2);
+    idx = (track < 41 ? 0 : 1);
     if (track > 40)
       track -= 40;
     pos = D81_BAM_OFFSET + track * D81_BAM_BYTES_PER_TRACK + (type == BAM_BITFIELD ? 1:0);
     break;
 
   case D64_TYPE_DNP:
-    t   = DNP_BAM_TRACK;
-    s   = DNP_BAM_SECTOR + (track >> 3);
+    idx = track >> 3;
     pos = (track & 0x07) * 32;
     break;
   }
 
-  if (!bam_buffer_match(bam_buffer, part, t, s)) {
-    /* check if the second BAM buffer exists */
-    if (bam_buffer2) {
-      /* unconditionally swap to the other BAM buffer        */
-      /* either it has the data or it was less-recently used */
-
-      /* Note for future optimization:
-       * If buf1 is invalid and buf2 valid but not matching this will swap and
-       * use buf2 for the data instead of buf1 - using buf1
-       * while keeping buf2 without swapping would be better.
-       */
-      bam_buffer_swap();
-
-      /* check again, now in the other buffer */
-      if (bam_buffer_match(bam_buffer, part, t, s))
-        goto found;
-    } else {
-      /* allocate and swap to the second BAM buffer if the first one is valid */
-      if (bam_buffer->pvt.bam.part != 255) {
-        if (bam_buffer_alloc(&bam_buffer2)) {
-          /* allocation failed, reset error and continue with just one buffer */
-          set_error(ERROR_OK);
-        } else {
-          /* switch to the new buffer */
-          bam_buffer_swap();
-        }
-      }
-    }
+  *index = idx;
+  return bam[part].data + 256 * idx + pos;
+}
+
+/**
+ * bam_sector_modify - get a BAM sector for modification
+ * @part : partition
+ * @index: BAM sector index
+ *
+ * Returns a pointer to the @index-th sector in the BAM mirror of
+ * partition @part and marks it for write-back.
+ */
+static uint8_t *bam_sector_modify(uint8_t part, uint8_t index) {
+  bam[part].dirty |= 1UL << index;
+  dirlist_invalidate();
+  return bam[part].data + 256 * index;
+}
+
+/**
+ * bam_count_track - count the free sectors of a track
+ * @part : partition
+ * @track: track number
+ *
+ * This function determines the number of free sectors on @track from
+ * the BAM mirror, using the per-track counter if the format has one
+ * and counting the bits of the allocation map if it does not (DNP).
+ */
+static uint16_t bam_count_track(uint8_t part, uint8_t track) {
+  uint8_t  idx;
+  uint8_t *trackmap;
+  uint16_t blocks = 0;
+
+  if (partition[part].imagetype != D64_TYPE_DNP)
+    return *bam_pointer(part, track, BAM_FREECOUNT, &idx);
+
+  trackmap = bam_pointer(part, track, BAM_BITFIELD, &idx);
+  for (uint8_t i=0;i < DNP_BAM_BYTES_PER_TRACK;i++) {
+    // From http://everything2.com/title/counting%25201%2520bits
+    uint8_t b = (trackmap[i] & 0x55) + (trackmap[i]>>1 & 0x55);
+    b = (b & 0x33) + (b >> 2 & 0x33);
+    b = (b & 0x0f) + (b >> 4 & 0x0f);
+    blocks += b;
+  }
+  return blocks;
+}
+
+/**
+ * bam_load - read the BAM of an image into its mirror
+ * @part: partition
+ *
+ * This function reads all BAM sectors of the image mounted on partition
+ * @part into its BAM mirror, allocating the mirror if required, and
+ * rebuilds the per-track free sector table. Returns 0 if successful,
+ * != 0 otherwise.
+ */
+static uint8_t bam_load(uint8_t part) {
+  image_iov_t iov[BAM_MAX_SECTORS];
+  uint8_t t,s;
+  uint8_t sectors = bam_sector_count(part);
+  uint8_t tracks  = get_param(part, LAST_TRACK);
 
-    /* Need to read the BAM sector - flush only the target buffer */
-    if (bam_buffer->cleanup(bam_buffer))
+  if (bam[part].data == NULL) {
+    bam[part].data = malloc(256 * sectors + sizeof(uint16_t) * (tracks + 1));
+    if (bam[part].data == NULL) {
+      set_error(ERROR_NO_CHANNEL);
       return 1;
+    }
+    bam[part].freecount = (uint16_t *)(bam[part].data + 256 * sectors);
+  }
 
-    res = image_read(part, sector_offset(part, t, s), bam_buffer->data, 256);
-    if(res)
-      return res;
+  bam[part].sectors = sectors;
+  bam[part].dirty   = 0;
+
+  /* read all BAM sectors at once, adjacent ones are merged */
+  for (uint8_t i=0; i<sectors; i++) {
+    bam_sector_location(part, i, &t, &s);
+    iov[i].offset = sector_offset(part, t, s);
+    iov[i].buffer = bam[part].data + 256 * i;
+    iov[i].bytes  = 256;
+  }
+
+  if (image_readv(part, iov, sectors))
+    return 1;
+
+  bam[part].freecount[0] = 0;
+  for (uint16_t i=1; i<=tracks; i++)
+    bam[part].freecount[i] = bam_count_track(part, i);
+
+  return 0;
+}
+
+/**
+ * bam_flush - write back the BAM mirror of a partition
+ * @part: partition
+ *
+ * This function writes all modified sectors of the BAM mirror of
+ * partition @part to the disk image with a single vectored write,
+ * which merges sectors that are adjacent in the image.
+ * Returns 0 if successful, != 0 otherwise.
+ */
+static uint8_t bam_flush(uint8_t part) {
+  image_iov_t iov[BAM_MAX_SECTORS];
+  uint8_t t,s,count;
+
+  if (bam[part].data == NULL || part >= max_part || !bam[part].dirty)
+    return 0;
+
+  count = 0;
+  for (uint8_t i=0; i<bam[part].sectors; i++) {
+    if (!(bam[part].dirty & (1UL << i)))
+      continue;
+
+    bam_sector_location(part, i, &t, &s);
+    iov[count].offset = sector_offset(part, t, s);
+    iov[count].buffer = bam[part].data + 256 * i;
+    iov[count].bytes  = 256;
+    count++;
+  }
+  bam[part].dirty = 0;
+
+  return image_writev(part, iov, count, 1);
+}
+
+/**
+ * errormap_load - read the error info of an image
+ * @part: partition
+ *
+ * This function reads the error info block that follows the last
+ * sector of the image mounted on partition @part into RAM, so
+ * checked_read can look up the state of a sector without accessing
+ * the image. If the block cannot be read completely, all sectors are
+ * treated as fine like in an image without error info. Returns 0 if
+ * successful, != 0 if there was no memory for the map.
+ */
+static uint8_t errormap_load(uint8_t part) {
+  uint16_t sectors = geom_total(&geometry[part]);
 
-    bam_buffer->pvt.bam.part   = part;
-    bam_buffer->pvt.bam.track  = t;
-    bam_buffer->pvt.bam.sector = s;
+  if (errormap[part] == NULL) {
+    errormap[part] = malloc(sectors);
+    if (errormap[part] == NULL) {
+      set_error(ERROR_NO_CHANNEL);
+      return 1;
+    }
   }
 
- found:
-  *ptr = bam_buffer->data + pos;
+  /* a short read must not leave stale or partial codes in the map */
+  if (image_read(part, 256L * sectors, errormap[part], sectors) != 0)
+    memset(errormap[part], 1, sectors);
+
   return 0;
 }
 
+/**
+ * errormap_release - free the error info of a partition
+ * @part: partition
+ */
+static void errormap_release(uint8_t part) {
+  free(errormap[part]);
+  errormap[part] = NULL;
+}
+
+/**
+ * bam_release - free the BAM mirror of a partition
+ * @part: partition
+ *
+ * This function releases the BAM mirror of partition @part
+ * without writing it back.
+ */
+static void bam_release(uint8_t part) {
+  free(bam[part].data);
+  bam[part].data    = NULL;
+  bam[part].sectors = 0;
+  bam[part].dirty   = 0;
+}
+
+/**
+ * d64_bam_commit - write BAM mirrors to disk
+ *
+ * This function is the exported interface to force the modified BAM
+ * sectors to disk. Pending directory entries and sectors written to
+ * cached images are written back here too. A failed write is
+ * reported on the error channel.
+ * Returns 0 if successful, != 0 otherwise.
+ */
+uint8_t d64_bam_commit(void) {
+  uint8_t res = 0;
+
+  for (uint8_t i=0; i<CONFIG_MAX_PARTITIONS; i++)
+    res |= bam_flush(i);
+
+  res |= dirsector_flush(1);
+  res |= imgcache_commit();
+
+  /* Short writes do not set an error, failed ones may have */
+  if (res && current_error < ERROR_READ_NOHEADER)
+    set_error(ERROR_WRITE_VERIFY);
+
+  return res;
+}
+
 /**
  * is_free - checks if the given sector is marked as free
  * @part  : partition
@@ -636,11 +1349,10 @@ static uint8_t move_bam_window(uint8_t part, uint8_t track, bamdata_t type, uint
  * the BAM of drive "part". Returns 0 if allocated, >0 if free, <0 on error.
  */
 static int8_t is_free(uint8_t part, uint8_t track, uint8_t sector) {
-  uint8_t res;
-  uint8_t *ptr = NULL;
+  uint8_t idx;
+  uint8_t *ptr = bam_pointer(part, track, BAM_BITFIELD, &idx);
 
-  res = move_bam_window(part,track,BAM_BITFIELD,&ptr);
-  if(res)
+  if (ptr == NULL)
     return -1;
 
   if (partition[part].imagetype == D64_TYPE_DNP)
@@ -658,35 +1370,11 @@ static int8_t is_free(uint8_t part, uint8_t track, uint8_t sector) {
  * of partition part.
  */
 static uint16_t sectors_free(uint8_t part, uint8_t track) {
-  uint8_t *trackmap = NULL;
-
-  if (track < 1 || track > get_param(part, LAST_TRACK))
+  if (track < 1 || track > get_param(part, LAST_TRACK) ||
+      bam[part].data == NULL)
     return 0;
 
-  switch (partition[part].imagetype & D64_TYPE_MASK) {
-
-  case D64_TYPE_DNP:
-    if(move_bam_window(part,track,BAM_FREECOUNT,&trackmap))
-      return 0;
-
-    uint16_t blocks = 0;
-    for (uint8_t i=0;i < DNP_BAM_BYTES_PER_TRACK;i++) {
-      // From http://everything2.com/title/counting%25201%2520bits
-      uint8_t b = (trackmap[i] & 0x55) + (trackmap[i]>>1 & 0x55);
-      b = (b & 0x33) + (b >> 2 & 0x33);
-      b = (b & 0x0f) + (b >> 4 & 0x0f);
-      blocks += b;
-    }
-    return blocks;
-
-  case D64_TYPE_D71:
-  case D64_TYPE_D81:
-  case D64_TYPE_D41:
-  default:
-    if(move_bam_window(part,track,BAM_FREECOUNT,&trackmap))
-      return 0;
-    return *trackmap;
-  }
+  return bam[part].freecount[track];
 }
 
 /**
@@ -701,21 +1389,21 @@ static uint16_t sectors_free(uint8_t part, uint8_t track) {
  */
 static uint8_t allocate_sector(uint8_t part, uint8_t track, uint8_t sector) {
   uint8_t *trackmap;
+  uint8_t idx;
   int8_t res = is_free(part,track,sector);
 
   if (res < 0)
     return 1;
 
   if (res != 0) {
-    /* do the bitfield first, since is_free already set it up for us. */
-    if(move_bam_window(part,track,BAM_BITFIELD,&trackmap))
-      return 1;
-
-    bam_buffer->mustflush = 1;
+    trackmap = bam_pointer(part, track, BAM_BITFIELD, &idx);
+    bam[part].dirty |= 1UL << idx;
+    dirlist_invalidate();
 
     if (partition[part].imagetype == D64_TYPE_DNP) {
       /* For some reason DNP has its bitfield reversed */
       trackmap[sector>>3] &= (uint8_t)~(0x80>>(sector&7));
+      bam[part].freecount[track]--;
 
       /* DNP has no counter in its BAM */
       return 0;
@@ -723,13 +1411,12 @@ static uint8_t allocate_sector(uint8_t part, uint8_t track, uint8_t sector) {
 
     trackmap[sector>>3] &= (uint8_t)~(1<<(sector&7));
 
-    if(move_bam_window(part,track,BAM_FREECOUNT,&trackmap))
-      return 1;
-
+    trackmap = bam_pointer(part, track, BAM_FREECOUNT, &idx);
     if (trackmap[0] > 0) {
       trackmap[0]--;
-      bam_buffer->mustflush = 1;
+      bam[part].dirty |= 1UL << idx;
     }
+    bam[part].freecount[track] = trackmap[0];
   }
   return 0;
 }
@@ -746,21 +1433,21 @@ static uint8_t allocate_sector(uint8_t part, uint8_t track, uint8_t sector) {
  */
 static uint8_t free_sector(uint8_t part, uint8_t track, uint8_t sector) {
   uint8_t *trackmap;
+  uint8_t idx;
   int8_t res = is_free(part,track,sector);
 
   if (res < 0)
     return 1;
 
   if (res == 0) {
-    /* do the bitfield first, since is_free already set it up for us. */
-    if(move_bam_window(part,track,BAM_BITFIELD,&trackmap))
-      return 1;
-
-    bam_buffer->mustflush = 1;
+    trackmap = bam_pointer(part, track, BAM_BITFIELD, &idx);
+    bam[part].dirty |= 1UL << idx;
+    dirlist_invalidate();
 
     if (partition[part].imagetype == D64_TYPE_DNP) {
       /* For some reason DNP has its bitfield reversed */
       trackmap[sector>>3] |= 0x80>>(sector&7);
+      bam[part].freecount[track]++;
 
       /* DNP has no counter in its BAM */
       return 0;
@@ -768,13 +1455,12 @@ static uint8_t free_sector(uint8_t part, uint8_t track, uint8_t sector) {
 
     trackmap[sector>>3] |= 1<<(sector&7);
 
-    if(move_bam_window(part,track,BAM_FREECOUNT,&trackmap))
-      return 1;
-
+    trackmap = bam_pointer(part, track, BAM_FREECOUNT, &idx);
     if(trackmap[0] < sectors_per_track(part, track)) {
       trackmap[0]++;
-      bam_buffer->mustflush = 1;
+      bam[part].dirty |= 1UL << idx;
     }
+    bam[part].freecount[track] = trackmap[0];
   }
   return 0;
 }
@@ -972,7 +1658,8 @@ static uint8_t get_next_sector(uint8_t part, uint8_t *track, uint8_t *sector) {
  * @dh: directory handle
  *
  * This function reads the next directory entry from the disk
- * into ops_scratch. Returns 1 if an error occured, -1 if there
+ * into ops_scratch. Each directory sector is read only once, the
+ * entries are taken from the directory sector buffer. Returns 1 if an error occured, -1 if there
  * are no more directory entries and 0 if successful. This
  * function will return every entry, even deleted ones.
  */
@@ -980,24 +1667,18 @@ static int8_t nextdirentry(dh_t *dh) {
   /* End of directory entries in this sector? */
   if (dh->dir.d64.entry == 8) {
     /* Read link pointer */
-    if (checked_read(dh->part, dh->dir.d64.track, dh->dir.d64.sector, ops_scratch, 2, ERROR_ILLEGAL_TS_LINK))
+    if (dirsector_load(dh->part, dh->dir.d64.track, dh->dir.d64.sector))
       return 1;
 
     /* Final directory sector? */
-    if (ops_scratch[0] == 0)
+    if (dirsector.data[0] == 0)
       return -1;
 
-    dh->dir.d64.track  = ops_scratch[0];
-    dh->dir.d64.sector = ops_scratch[1];
+    dh->dir.d64.track  = dirsector.data[0];
+    dh->dir.d64.sector = dirsector.data[1];
     dh->dir.d64.entry  = 0;
   }
 
-  if (dh->dir.d64.track < 1 || dh->dir.d64.track > get_param(dh->part, LAST_TRACK) ||
-      dh->dir.d64.sector >= sectors_per_track(dh->part, dh->dir.d64.track)) {
-    set_error_ts(ERROR_ILLEGAL_TS_LINK,dh->dir.d64.track,dh->dir.d64.sector);
-    return 1;
-  }
-
   if (read_entry(dh->part, &dh->dir.d64, ops_scratch))
     return 1;
 
@@ -1036,11 +1717,19 @@ static uint8_t find_empty_entry(path_t *path, dh_t *dh) {
       return 1;
 
     /* Link the old sector to the new */
-    ops_scratch[0] = dh->dir.d64.track;
-    ops_scratch[1] = dh->dir.d64.sector;
-    if (image_write(path->part, sector_offset(path->part,t,s), ops_scratch, 2, 0))
+    if (dirsector_load(path->part, t, s))
+      return 1;
+
+    dirsector.data[0] = dh->dir.d64.track;
+    dirsector.data[1] = dh->dir.d64.sector;
+    dirsector.dirty   = 1;
+    if (dirsector_flush(0))
       return 1;
 
+    /* Extend the index if this directory is indexed */
+    if (dirindex_find(path->part, t, s))
+      dirindex_append(path->part, dh->dir.d64.track, dh->dir.d64.sector);
+
     if (allocate_sector(path->part, dh->dir.d64.track, dh->dir.d64.sector))
       return 1;
 
@@ -1071,18 +1760,16 @@ static uint8_t find_empty_entry(path_t *path, dh_t *dh) {
       }
     }
 
-    /* Clear the new directory sector */
-    memset(ops_scratch, 0, 32);
-    ops_scratch[1] = 0xff;
-    for (uint8_t i=0;i<256/32;i++) {
-      dh->dir.d64.entry = i;
-      if (write_entry(path->part, &dh->dir.d64, ops_scratch, 0))
-        return 1;
-
-      ops_scratch[1] = 0;
-    }
+    /* Clear the new directory sector, it is written with the first entry */
+    dirsector.part   = path->part;
+    dirsector.track  = dh->dir.d64.track;
+    dirsector.sector = dh->dir.d64.sector;
+    dirsector.dirty  = 1;
+    memset(dirsector.data, 0, 256);
+    dirsector.data[1] = 0xff;
 
     /* Mark full sector as used */
+    memset(ops_scratch, 0, 32);
     ops_scratch[1] = 0xff;
     dh->dir.d64.entry = 0;
 
@@ -1094,6 +1781,123 @@ static uint8_t find_empty_entry(path_t *path, dh_t *dh) {
   return 0;
 }
 
+/**
+ * dirindex_build - build the name index of a directory
+ * @path: path of the directory
+ *
+ * This function reads the directory given by @path once and builds
+ * the name index for it, replacing the current index of the partition.
+ * A directory that cannot be read completely is not indexed, lookups
+ * in it fall back to scanning the directory chain.
+ */
+static void dirindex_build(path_t *path) {
+  uint8_t part = path->part;
+  uint8_t olderror = current_error;
+  uint8_t *rec;
+  dh_t dh;
+
+  dirindex[part].sectors = 0;
+  dirindex[part].track   = path->dir.dxx.track;
+  dirindex[part].sector  = path->dir.dxx.sector;
+
+  if (d64_opendir(&dh, path))
+    goto fail;
+
+  while (1) {
+    /* stop on a looped chain */
+    if (dirindex_find(part, dh.dir.d64.track, dh.dir.d64.sector))
+      goto fail;
+
+    if (dirsector_load(part, dh.dir.d64.track, dh.dir.d64.sector))
+      goto fail;
+
+    rec = dirindex_append(part, dh.dir.d64.track, dh.dir.d64.sector);
+    if (rec == NULL)
+      goto fail;
+
+    for (uint8_t i=0; i<8; i++)
+      dirindex_set(rec + 2 + i * DIRINDEX_SLOT_SIZE, dirsector.data + i * 32);
+
+    if (dirsector.data[0] == 0)
+      return;
+
+    dh.dir.d64.track  = dirsector.data[0];
+    dh.dir.d64.sector = dirsector.data[1];
+  }
+
+ fail:
+  dirindex_drop(part);
+  if (olderror == ERROR_OK)
+    set_error(ERROR_OK);
+}
+
+/**
+ * dirindex_follow - make sure the index covers a directory
+ * @path: path of the directory
+ *
+ * This function rebuilds the directory index of the partition
+ * if it does not already cover the directory given by @path.
+ */
+static void dirindex_follow(path_t *path) {
+  if (dirindex[path->part].data   == NULL ||
+      dirindex[path->part].track  != path->dir.dxx.track ||
+      dirindex[path->part].sector != path->dir.dxx.sector)
+    dirindex_build(path);
+}
+
+/**
+ * d64_skip_to_match - move a directory handle to the next candidate
+ * @dh      : directory handle
+ * @matchstr: pattern to be matched
+ *
+ * This function uses the directory index to move @dh forward to the
+ * next entry that may match @matchstr, skipping empty entries, entries
+ * with a different first character if the pattern starts with one and
+ * entries with a different name hash if the pattern has no wildcards.
+ * The handle is left unchanged if its directory is not indexed.
+ * Returns -1 if no remaining entry can match, 0 otherwise.
+ */
+int8_t d64_skip_to_match(dh_t *dh, uint8_t *matchstr) {
+  uint8_t  part = dh->part;
+  uint8_t *rec, *slot;
+  uint8_t  first, hash, exact;
+  uint16_t i, total;
+
+  rec = dirindex_find(part, dh->dir.d64.track, dh->dir.d64.sector);
+  if (rec == NULL)
+    return 0;
+
+  first = matchstr[0];
+  if (first == '*' || first == '?')
+    first = 0;
+
+  exact = 1;
+  for (i=0; i<CBM_NAME_LENGTH && matchstr[i]; i++)
+    if (matchstr[i] == '*' || matchstr[i] == '?')
+      exact = 0;
+  hash = dirindex_hash(matchstr);
+
+  i     = (rec - dirindex[part].data) / DIRINDEX_SECTOR_SIZE * 8 + dh->dir.d64.entry;
+  total = dirindex[part].sectors * 8;
+
+  for (; i<total; i++) {
+    rec  = dirindex[part].data + (i / 8) * DIRINDEX_SECTOR_SIZE;
+    slot = rec + 2 + (i % 8) * DIRINDEX_SLOT_SIZE;
+
+    if (slot[0] == 0 ||
+        (first && slot[1] != first) ||
+        (exact && slot[2] != hash))
+      continue;
+
+    dh->dir.d64.track  = rec[0];
+    dh->dir.d64.sector = rec[1];
+    dh->dir.d64.entry  = i % 8;
+    return 0;
+  }
+
+  return -1;
+}
+
 /**
  * d64_read - refill-callback used for reading
  * @buf: target buffer
@@ -1101,11 +1905,13 @@ static uint8_t find_empty_entry(path_t *path, dh_t *dh) {
  * This is the callback used as refill for files opened for reading.
  */
 static uint8_t d64_read(buffer_t *buf) {
+  uint32_t start = latency_start();
+
   /* Store the current sector, used for append */
   buf->pvt.d64.track  = buf->data[0];
   buf->pvt.d64.sector = buf->data[1];
 
-  if (checked_read(buf->pvt.d64.part, buf->data[0], buf->data[1], buf->data, 256, ERROR_ILLEGAL_TS_LINK)) {
+  if (chain_read(buf->pvt.d64.part, buf->data[0], buf->data[1], buf->data, ERROR_ILLEGAL_TS_LINK)) {
     free_buffer(buf);
     return 1;
   }
@@ -1120,7 +1926,9 @@ static uint8_t d64_read(buffer_t *buf) {
     buf->lastused = 255;
     buf->sendeoi  = 0;
   }
+  trace(TRACE_DATA, TRACE_REFILL, buf->secondary, buf->lastused - 1);
 
+  latency_record(LAT_D64READ, start);
   return 0;
 }
 
@@ -1188,6 +1996,9 @@ static uint8_t d64_write(buffer_t *buf) {
     free_buffer(buf);
     return 1;
   }
+  trackcache_written(buf->pvt.d64.part, buf->pvt.d64.track,
+                     buf->pvt.d64.sector, buf->data);
+  trace(TRACE_DATA, TRACE_WRITE, buf->secondary, buf->lastused - 1);
 
   buf->pvt.d64.track  = t;
   buf->pvt.d64.sector = s;
@@ -1221,6 +2032,7 @@ static uint8_t d64_write_cleanup(buffer_t *buf) {
   /* Store data */
   if (image_write(buf->pvt.d64.part, sector_offset(buf->pvt.d64.part,t,s), buf->data, 256, 1))
     return 1;
+  trackcache_written(buf->pvt.d64.part, t, s, buf->data);
 
   /* Update directory entry */
   if (read_entry(buf->pvt.d64.part, &buf->pvt.d64.dh, ops_scratch))
@@ -1231,7 +2043,7 @@ static uint8_t d64_write_cleanup(buffer_t *buf) {
   ops_scratch[DIR_OFS_SIZE_HI]    = buf->pvt.d64.blocks >> 8;
   update_timestamp(ops_scratch);
 
-  if (write_entry(buf->pvt.d64.part, &buf->pvt.d64.dh, ops_scratch, 1))
+  if (write_entry(buf->pvt.d64.part, &buf->pvt.d64.dh, ops_scratch))
     return 1;
 
   buf->cleanup = callback_dummy;
@@ -1248,6 +2060,9 @@ static uint8_t d64_write_cleanup(buffer_t *buf) {
 uint8_t d64_mount(path_t *path, uint8_t *name, uint32_t fsize) {
   uint8_t imagetype;
   uint8_t part = path->part;
+  uint8_t tracks = 0;
+
+  chain_drop();
 
   switch (fsize) {
   case 174848:
@@ -1260,6 +2075,27 @@ uint8_t d64_mount(path_t *path, uint8_t *name, uint32_t fsize) {
     memcpy_P(&partition[part].d64data, &d41param, sizeof(struct param_s));
     break;
 
+  case 197376:
+    /* 40 tracks with error info */
+    imagetype = D64_TYPE_D41 | D64_HAS_ERRORINFO;
+    memcpy_P(&partition[part].d64data, &d41param, sizeof(struct param_s));
+    tracks = 40;
+    break;
+
+  case 205312:
+    /* 42 tracks */
+    imagetype = D64_TYPE_D41;
+    memcpy_P(&partition[part].d64data, &d41param, sizeof(struct param_s));
+    tracks = 42;
+    break;
+
+  case 206114:
+    /* 42 tracks with error info */
+    imagetype = D64_TYPE_D41 | D64_HAS_ERRORINFO;
+    memcpy_P(&partition[part].d64data, &d41param, sizeof(struct param_s));
+    tracks = 42;
+    break;
+
   case 349696:
     imagetype = D64_TYPE_D71;
     memcpy_P(&partition[part].d64data, &d71param, sizeof(struct param_s));
@@ -1286,13 +2122,15 @@ uint8_t d64_mount(path_t *path, uint8_t *name, uint32_t fsize) {
       return 1;
     }
 
-    /* sanity check: ignore 40-track D64 images */
+    /* a 40-track D64 has the size of a three-track DNP */
     if (fsize == 196608) {
       uint8_t *ptr = ustrrchr(name, '.');
 
       if (ptr[2] == '6' && ptr[3] == '4') {
-        set_error(ERROR_IMAGE_INVALID);
-        return 1;
+        imagetype = D64_TYPE_D41;
+        memcpy_P(&partition[part].d64data, &d41param, sizeof(struct param_s));
+        tracks = 40;
+        break;
       }
     }
 
@@ -1301,21 +2139,53 @@ uint8_t d64_mount(path_t *path, uint8_t *name, uint32_t fsize) {
     partition[part].d64data.last_track = fsize / (256*256L);
   }
 
-  /* allocate the first BAM buffer if required */
-  if (bam_buffer == NULL) {
-    if (bam_buffer_alloc(&bam_buffer))
-      return 1;
+  /* Select the track layout. The BAM of extended 1541 images only
+     covers the first 35 tracks, so last_track stays at 35 for them. */
+  switch (imagetype & D64_TYPE_MASK) {
+  case D64_TYPE_D41:
+  default:
+    geometry[part].start = d41_track_start;
+    break;
+
+  case D64_TYPE_D71:
+    geometry[part].start = d71_track_start;
+    break;
+
+  case D64_TYPE_D81:
+    geometry[part].start = d81_track_start;
+    break;
+
+  case D64_TYPE_DNP:
+    geometry[part].start = dnp_track_start;
+    break;
   }
+  geometry[part].tracks = (tracks ? tracks : get_param(part, LAST_TRACK));
+
+  /* read the whole image into RAM if it fits */
+  if (imgcache_mount(part, fsize))
+    return 1;
 
   partition[part].imagetype = imagetype;
+
+  /* read the error info and the BAM */
+  trackcache_drop(part);
+  errormap_release(part);
+  if (((imagetype & D64_HAS_ERRORINFO) && errormap_load(part)) ||
+      bam_load(part)) {
+    errormap_release(part);
+    bam_release(part);
+    imgcache_unmount(part);
+    return 1;
+  }
+
   path->dir.dxx.track  = get_param(part, DIR_TRACK);
   path->dir.dxx.sector = get_param(part, DIR_START_SECTOR);
 
-  bam_refcount++;
+  /* forget directory data of a previous image on this partition */
+  dirsector_drop(part);
 
-  if (imagetype & D64_HAS_ERRORINFO)
-    /* Invalidate error cache */
-    errorcache.part = 255;
+  /* index the root directory */
+  dirindex_build(path);
 
   return 0;
 }
@@ -1463,9 +2333,10 @@ static uint16_t d64_freeblocks(uint8_t part) {
     if ((partition[part].imagetype & D64_TYPE_MASK)
         == D64_TYPE_DNP && i == 1) {
       /* DNP: ignore sectors 0-63 on track 1 */
-      for (uint16_t j = 64; j < 256; j++) {
+      blocks += sectors_free(part, 1);
+      for (uint8_t j = 0; j < 64; j++) {
         if (is_free(part, 1, j) > 0)
-          blocks++;
+          blocks--;
       }
 
     } else {
@@ -1486,9 +2357,11 @@ static void d64_open_read(path_t *path, cbmdirent_t *dent, buffer_t *buf) {
 
   buf->pvt.d64.part = path->part;
 
-  buf->read    = 1;
-  buf->refill  = d64_read;
-  buf->seek    = d64_seek;
+  buf->read     = 1;
+  /* the chain already reads ahead in the background */
+  buf->prefetch = !chain_usable(path->part);
+  buf->refill   = d64_read;
+  buf->seek     = d64_seek;
   stick_buffer(buf);
 
   buf->refill(buf);
@@ -1517,6 +2390,7 @@ static void d64_open_write(path_t *path, cbmdirent_t *dent, uint8_t type, buffer
     buf->pvt.d64.dh     = dent->pvt.dxx.dh;
     buf->pvt.d64.blocks = ops_scratch[DIR_OFS_SIZE_LOW] + 256 * ops_scratch[DIR_OFS_SIZE_HI]-1;
     buf->read       = 0;
+    buf->prefetch   = 0;
     buf->position   = buf->lastused+1;
     if (buf->position == 0)
       buf->mustflush = 1;
@@ -1528,7 +2402,7 @@ static void d64_open_write(path_t *path, cbmdirent_t *dent, uint8_t type, buffer
     mark_write_buffer(buf);
 
     update_timestamp(ops_scratch);
-    write_entry(buf->pvt.d64.part, &buf->pvt.d64.dh, ops_scratch, 1);
+    write_entry(buf->pvt.d64.part, &buf->pvt.d64.dh, ops_scratch);
 
     return;
   }
@@ -1561,7 +2435,7 @@ static void d64_open_write(path_t *path, cbmdirent_t *dent, uint8_t type, buffer
 
   /* Write the directory entry */
   update_timestamp(ops_scratch);
-  if (write_entry(path->part, &dh.dir.d64, ops_scratch, 1))
+  if (write_entry(path->part, &dh.dir.d64, ops_scratch))
     return;
 
   /* Prepare the data buffer */
@@ -1608,22 +2482,47 @@ static uint8_t d64_delete(path_t *path, cbmdirent_t *dent) {
 
   /* Clear directory entry */
   ops_scratch[DIR_OFS_FILE_TYPE] = 0;
-  if (write_entry(path->part, &dent->pvt.dxx.dh, ops_scratch, 1))
+  if (write_entry(path->part, &dent->pvt.dxx.dh, ops_scratch))
     return 255;
 
   return 1;
 }
 
 static void d64_read_sector(buffer_t *buf, uint8_t part, uint8_t track, uint8_t sector) {
-  checked_read(part, track, sector, buf->data, 256, ERROR_ILLEGAL_TS_COMMAND);
+  /* make sure BAM and directory changes are visible */
+  if (bam_sector_index(part, track, sector) != 255)
+    bam_flush(part);
+  if (dirsector.part == part && dirsector.track == track &&
+      dirsector.sector == sector)
+    dirsector_flush(0);
+
+  chain_read(part, track, sector, buf->data, ERROR_ILLEGAL_TS_COMMAND);
 }
 
 static void d64_write_sector(buffer_t *buf, uint8_t part, uint8_t track, uint8_t sector) {
-  if (track < 1 || track > get_param(part, LAST_TRACK) ||
-      sector >= sectors_per_track(part, track)) {
+  if (!geom_valid(&geometry[part], track, sector)) {
     set_error_ts(ERROR_ILLEGAL_TS_COMMAND,track,sector);
-  } else
-    image_write(part, sector_offset(part,track,sector), buf->data, 256, 1);
+  } else {
+    uint8_t bamsector = bam_sector_index(part, track, sector) != 255;
+
+    if (dirsector.track == track && dirsector.sector == sector)
+      dirsector_drop(part);
+
+    /* write back changes to the other BAM sectors before reloading */
+    if (bamsector)
+      bam_flush(part);
+
+    if (!image_write(part, sector_offset(part,track,sector), buf->data, 256, 1))
+      trackcache_written(part, track, sector, buf->data);
+
+    /* the index cannot follow raw directory changes */
+    if (dirindex_find(part, track, sector))
+      dirindex_drop(part);
+
+    /* keep the BAM mirror in sync */
+    if (bamsector)
+      bam_load(part);
+  }
 }
 
 static void d64_rename(path_t *path, cbmdirent_t *dent, uint8_t *newname) {
@@ -1637,7 +2536,7 @@ static void d64_rename(path_t *path, cbmdirent_t *dent, uint8_t *newname) {
   ptr = ops_scratch + DIR_OFS_FILE_NAME;
   while (*newname) *ptr++ = *newname++;
 
-  write_entry(path->part, &dent->pvt.dxx.dh, ops_scratch, 1);
+  write_entry(path->part, &dent->pvt.dxx.dh, ops_scratch);
 }
 
 
@@ -1659,9 +2558,11 @@ void d64_raw_directory(path_t *path, buffer_t *buf) {
 
   buf->pvt.d64.part = path->part;
 
-  buf->read    = 1;
-  buf->refill  = d64_read;
-  buf->seek    = d64_seek;
+  buf->read     = 1;
+  /* the chain already reads ahead in the background */
+  buf->prefetch = !chain_usable(path->part);
+  buf->refill   = d64_read;
+  buf->seek     = d64_seek;
   stick_buffer(buf);
 
   buf->refill(buf);
@@ -1690,8 +2591,8 @@ static uint8_t image_chdir(path_t *path, cbmdirent_t *dent) {
  * @path   : path object of the location of dirname
  * @dirname: directory to be changed into
  *
- * Changes the directory in the path object for DNP files,
- * returns an error for everything else.
+ * Changes the directory in the path object for DNP files and moves
+ * the directory index there, returns an error for everything else.
  * Returns 0 if successful, 1 otherwise.
  */
 static uint8_t d64_chdir(path_t *path, cbmdirent_t *dirname) {
@@ -1702,6 +2603,7 @@ static uint8_t d64_chdir(path_t *path, cbmdirent_t *dirname) {
     /* Empty string: root directory */
     path->dir.dxx.track  = 1;
     path->dir.dxx.sector = 1;
+    dirindex_follow(path);
     return 0;
   }
 
@@ -1720,6 +2622,7 @@ static uint8_t d64_chdir(path_t *path, cbmdirent_t *dirname) {
 
     path->dir.dxx.track  = parent[0];
     path->dir.dxx.sector = parent[1];
+    dirindex_follow(path);
     return 0;
   }
 
@@ -1728,6 +2631,7 @@ static uint8_t d64_chdir(path_t *path, cbmdirent_t *dirname) {
 
   path->dir.dxx.track  = ops_scratch[DIR_OFS_TRACK];
   path->dir.dxx.sector = ops_scratch[DIR_OFS_SECTOR];
+  dirindex_follow(path);
 
   return 0;
 }
@@ -1849,8 +2753,7 @@ static void d64_mkdir(path_t *path, uint8_t *dirname) {
   ops_scratch[DIR_OFS_SIZE_LOW]  = 2;
   update_timestamp(ops_scratch);
 
-  image_write(path->part, sector_offset(path->part, dh.dir.d64.track, dh.dir.d64.sector)
-                          + dh.dir.d64.entry * 32 + 2, ops_scratch + 2, 30, 1);
+  write_entry(path->part, &dh.dir.d64, ops_scratch);
 }
 
 /**
@@ -1860,41 +2763,53 @@ static void d64_mkdir(path_t *path, uint8_t *dirname) {
  * a card change is detected.
  */
 void d64_invalidate(void) {
-  free_buffer(bam_buffer);
-  bam_buffer   = NULL;
-  free_buffer(bam_buffer2);
-  bam_buffer2  = NULL;
-  bam_refcount = 0;
+  chain_drop();
+
+  for (uint8_t i=0; i<CONFIG_MAX_PARTITIONS; i++) {
+    bam_release(i);
+    errormap_release(i);
+    dirindex_drop(i);
+    trackcache_drop(i);
+  }
+
+  dirsector.part  = 255;
+  dirsector.dirty = 0;
+  imgcache_invalidate();
 }
 
 /**
  * d64_unmount - unmount disk image
  * @part: partition number
  *
- * This function in called on image unmount and handles
- * refcounting for the BAM buffers.
+ * This function in called on image unmount, it writes back
+ * and releases the BAM mirror of the partition. Everything is
+ * released even if a write fails, the failure is reported on the
+ * error channel. Returns 0 if successful, != 0 otherwise.
  */
-void d64_unmount(uint8_t part) {
-  /* invalidate BAM buffers that point to the current partition */
-  if (bam_buffer) {
-    bam_buffer->cleanup(bam_buffer);
-    if (bam_buffer->pvt.bam.part == part)
-      bam_buffer->pvt.bam.part = 255;
-  }
+uint8_t d64_unmount(uint8_t part) {
+  uint8_t res;
 
-  if (bam_buffer2) {
-    bam_buffer2->cleanup(bam_buffer2);
-    if (bam_buffer2->pvt.bam.part == part)
-      bam_buffer2->pvt.bam.part = 255;
-  }
+  chain_drop();
+
+  /* write back the BAM and pending directory entries of this partition */
+  res = bam_flush(part);
+  bam_release(part);
+  errormap_release(part);
+  dirindex_drop(part);
+  trackcache_drop(part);
 
-  /* decrease BAM buffer refcounter - it can never be zero while a Dxx is mounted*/
-  if (--bam_refcount) {
-    free_buffer(bam_buffer);
-    free_buffer(bam_buffer2);
-    bam_buffer  = NULL;
-    bam_buffer2 = NULL;
+  if (dirsector.part == part) {
+    res |= dirsector_flush(1);
+    dirsector_drop(part);
   }
+
+  /* write back and release the RAM copy of the image */
+  res |= imgcache_unmount(part);
+
+  if (res && current_error < ERROR_READ_NOHEADER)
+    set_error(ERROR_WRITE_VERIFY);
+
+  return res;
 }
 
 
@@ -1903,8 +2818,8 @@ void d64_unmount(uint8_t part) {
 /* ------------------------------------------------------------------------- */
 
 /* create a 1581/DNP BAM signature */
-static void format_add_bam_signature(uint8_t doschar, uint8_t *idbuf) {
-  uint8_t *ptr = bam_buffer->data + 2;
+static void format_add_bam_signature(uint8_t *data, uint8_t doschar, uint8_t *idbuf) {
+  uint8_t *ptr = data + 2;
 
   *ptr++ = doschar;
   *ptr++ = doschar ^ 0xff;
@@ -1933,8 +2848,9 @@ static void format_d41_image(uint8_t part, buffer_t *buf, uint8_t *name, uint8_t
   for (uint8_t s=0; s<2; s++)
     allocate_sector(part, D41_BAM_TRACK, s);
 
-  /* 18/0 is now available via bam_buffer */
-  uint8_t *ptr = bam_buffer->data;
+  /* 18/0 is the first sector in the BAM mirror */
+  uint8_t *bamdata = bam_sector_modify(part, 0);
+  uint8_t *ptr = bamdata;
   *ptr++ = 18;
   *ptr++ = 1;
   *ptr++ = 0x41;
@@ -1942,10 +2858,10 @@ static void format_d41_image(uint8_t part, buffer_t *buf, uint8_t *name, uint8_t
   /* copy disk label and ID */
   idbuf[3] = '2';
   idbuf[4] = 'A';
-  format_copy_label(part, bam_buffer->data, name, idbuf);
+  format_copy_label(part, bamdata, name, idbuf);
   /* two additional 0xa0 characters on 5.25" disks */
-  bam_buffer->data[0xa9] = 0xa0;
-  bam_buffer->data[0xaa] = 0xa0;
+  bamdata[0xa9] = 0xa0;
+  bamdata[0xaa] = 0xa0;
 
   clear_dir_sector(part, D41_BAM_TRACK, 1, buf->data);
 }
@@ -1954,8 +2870,8 @@ static void format_d71_image(uint8_t part, buffer_t *buf, uint8_t *name, uint8_t
   /* almost everything is the same as D41 */
   format_d41_image(part, buf, name, idbuf);
 
-  /* add double-sided marker in 18/0 (still in bam_buffer) */
-  bam_buffer->data[3] = 0x80;
+  /* add double-sided marker in 18/0 */
+  bam_sector_modify(part, 0)[3] = 0x80;
 
   /* allocate all of track 53 */
   for (uint8_t s=0; s<19; s++)
@@ -1967,18 +2883,17 @@ static void format_d81_image(uint8_t part, buffer_t *buf, uint8_t *name, uint8_t
   for (uint8_t s=0; s<4; s++)
     allocate_sector(part, D81_BAM_TRACK, s);
 
-  /* bam_buffer buffer now holds 40/1 */
-  bam_buffer->data[0] = 40;
-  bam_buffer->data[1] = 2;
-  format_add_bam_signature('D', idbuf);
-  // mustflush was already set by allocate_sector
+  /* 40/1 */
+  uint8_t *bamdata = bam_sector_modify(part, 0);
+  bamdata[0] = 40;
+  bamdata[1] = 2;
+  format_add_bam_signature(bamdata, 'D', idbuf);
 
-  /* switch bam_buffer to 40/2 */
-  (void)sectors_free(part, 41);
-  bam_buffer->data[0] = 0;
-  bam_buffer->data[1] = 0xff;
-  format_add_bam_signature('D', idbuf);
-  bam_buffer->mustflush = 1;
+  /* 40/2 */
+  bamdata = bam_sector_modify(part, 1);
+  bamdata[0] = 0;
+  bamdata[1] = 0xff;
+  format_add_bam_signature(bamdata, 'D', idbuf);
 
   /* build contents of 40/0 */
   uint8_t *ptr = buf->data;
@@ -2005,9 +2920,10 @@ static void format_dnp_image(uint8_t part, buffer_t *buf, uint8_t *name, uint8_t
   for (uint8_t s=0; s<35; s++)
     allocate_sector(part, DNP_BAM_TRACK, s);
 
-  /* add BAM signature - first BAM sector is in bam_buffer because of allocate_sector */
-  format_add_bam_signature('H', idbuf);
-  bam_buffer->data[DNP_BAM_LAST_TRACK_OFS] = get_param(part, LAST_TRACK);
+  /* add BAM signature to the first BAM sector */
+  uint8_t *bamdata = bam_sector_modify(part, 0);
+  format_add_bam_signature(bamdata, 'H', idbuf);
+  bamdata[DNP_BAM_LAST_TRACK_OFS] = get_param(part, LAST_TRACK);
 
   /* build root dirheader */
   uint8_t *ptr = buf->data;
@@ -2053,11 +2969,9 @@ static void d64_format(uint8_t part, uint8_t *name, uint8_t *id) {
   mark_buffer_dirty(buf);
   memset(buf->data, 0, 256);
 
-  /* Flush BAM buffers and mark their contents as invalid */
+  /* Flush the BAM mirror, it is reread after clearing */
   d64_bam_commit();
-  bam_buffer->pvt.bam.part = 0xff;
-  if (bam_buffer2)
-    bam_buffer2->pvt.bam.part = 0xff;
+  dirsector_drop(part);
 
   if (id != NULL) {
     /* Clear the data area of the disk image */
@@ -2092,6 +3006,10 @@ static void d64_format(uint8_t part, uint8_t *name, uint8_t *id) {
   }
   idbuf[2] = 0xa0;
 
+  /* Reread the cleared BAM */
+  if (bam_load(part))
+    return;
+
   /* Mark all sectors as free */
   for (t=1; t<=get_param(part, LAST_TRACK); t++) {
     for (s=0; s<sectors_per_track(part, t); s++)
@@ -2101,6 +3019,13 @@ static void d64_format(uint8_t part, uint8_t *name, uint8_t *id) {
   /* call imagetype-specific format function */
   partition[part].d64data.format_function(part, buf, name, idbuf);
 
+  /* index the new root directory */
+  path_t root;
+  root.part = part;
+  root.dir.dxx.track  = get_param(part, DIR_TRACK);
+  root.dir.dxx.sector = get_param(part, DIR_START_SECTOR);
+  dirindex_build(&root);
+
   /* FIXME: Clear the error info block */
 }
 
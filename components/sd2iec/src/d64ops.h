@@ -53,14 +53,27 @@
 extern const fileops_t d64ops;
 
 uint8_t d64_mount(path_t *path, uint8_t *name, uint32_t fsize);
-void    d64_unmount(uint8_t part);
+uint8_t d64_unmount(uint8_t part);
 
 /* commit BAM buffer contents to storage medium */
 uint8_t d64_bam_commit(void);
 
+/* skip directory entries that cannot match, using the name index */
+int8_t d64_skip_to_match(dh_t *dh, uint8_t *matchstr);
+
 void d64_raw_directory(path_t *path, buffer_t *buf);
 void d64_invalidate(void);
 
+#ifdef CONFIG_TRACK_CACHE
+/* hit/miss counters of the track cache */
+typedef struct {
+  uint32_t hits;
+  uint32_t misses;
+} trackcache_stats_t;
+
+extern trackcache_stats_t trackcache_stats;
+#endif
+
 typedef enum { IMG_UNKNOWN, IMG_IS_M2I, IMG_IS_DISK } imgtype_t;
 
 imgtype_t check_imageext(uint8_t *name);
@@ -0,0 +1,344 @@
+/* sd2iec - SD/MMC to Commodore serial bus interface/controller
+   Copyright (C) 2007-2022  Ingo Korb <ingo@akana.de>
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+   dirlist.c: Cache of rendered directory listings
+
+   A LOAD"$" listing is recorded byte by byte while it is generated,
+   header and footer included. When the same command is given again
+   for the same directory the recorded bytes are sent instead of
+   reading the directory and counting the free blocks again.
+   Every change to a file system drops all recorded listings, the
+   backends call dirlist_invalidate for that. A listing that is being
+   sent when it is dropped stays in memory until its buffer is freed.
+
+*/
+
+#include <stdbool.h>
+#include <string.h>
+#include "config.h"
+#include "buffers.h"
+#include "doscmd.h"
+#include "fileops.h"
+#include "flags.h"
+#include "pathtab.h"
+#include "dirlist.h"
+
+#ifdef CONFIG_DIRLIST_CACHE
+
+#define DIRLIST_SLOTS  4
+#define DIRLIST_KEYLEN 42    /* longest command string that is cached */
+#define DIRLIST_CHUNK  1024  /* first allocation of a recording */
+
+typedef struct {
+  uint8_t  *data;         /* rendered listing, NULL if the slot is free  */
+  uint32_t  length;       /* bytes recorded                              */
+  uint32_t  size;         /* bytes allocated                             */
+  uint32_t  lastuse;      /* dirlist_clock value of the last use         */
+  path_t    path;         /* listed directory                            */
+  uint8_t   image_as_dir; /* settings that change the listing            */
+  uint8_t   flags;
+  uint8_t   extmode;
+  uint8_t   order;
+  uint8_t   pagesize;
+  uint8_t   cmdlen;       /* command string, selects pattern and format  */
+  uint8_t   cmd[DIRLIST_KEYLEN];
+  bool      complete;     /* footer was recorded                         */
+  bool      stale;        /* dropped while still being sent              */
+} dirlist_t;
+
+static dirlist_t dirlist[DIRLIST_SLOTS];
+static uint32_t  dirlist_clock;
+static uint32_t  dirlist_used;  /* bytes allocated by all slots */
+static buffer_t *recorder;      /* buffer whose listing is recorded */
+static dirlist_t *recording;    /* slot of the recorded listing */
+
+/* Global flags that change the contents of a listing */
+#define DIRLIST_FLAGS (EXTENSION_HIDING | POSTMATCH)
+
+/**
+ * dirlist_refill - send the next part of a cached listing
+ * @buf: buffer to be used
+ *
+ * Used as the refill callback of listings that are sent from the
+ * cache. Always returns 0.
+ */
+static uint8_t dirlist_refill(buffer_t *buf) {
+  dirlist_t *entry = &dirlist[buf->pvt.dirlist.slot];
+  uint32_t bytes = entry->length - buf->pvt.dirlist.offset;
+
+  if (bytes > 256)
+    bytes = 256;
+
+  memcpy(buf->data, entry->data + buf->pvt.dirlist.offset, bytes);
+  buf->pvt.dirlist.offset += bytes;
+  buf->position = 0;
+  buf->lastused = bytes - 1;
+  if (buf->pvt.dirlist.offset == entry->length)
+    buf->sendeoi = 1;
+
+  return 0;
+}
+
+/* Checks if a listing is still being sent */
+static bool dirlist_busy(dirlist_t *entry) {
+  uint8_t i;
+
+  for (i = 0; i < buffer_count; i++)
+    if (buffers[i].allocated &&
+        buffers[i].refill == dirlist_refill &&
+        buffers[i].pvt.dirlist.slot == entry - dirlist)
+      return true;
+
+  return false;
+}
+
+/* Frees a slot */
+static void dirlist_free(dirlist_t *entry) {
+  if (entry == recording)
+    recorder = NULL;
+
+  ext_free(entry->data);
+  dirlist_used -= entry->size;
+#ifdef CONFIG_HAVE_VFS
+  pathtab_release(entry->path.dir.path);
+#endif
+  memset(entry, 0, sizeof(dirlist_t));
+}
+
+/* Frees the least recently used idle slots until @bytes more fit */
+static bool dirlist_evict(dirlist_t *keep, uint32_t bytes) {
+  while (dirlist_used + bytes > CONFIG_DIRLIST_CACHE) {
+    dirlist_t *victim = NULL;
+    uint8_t i;
+
+    for (i = 0; i < DIRLIST_SLOTS; i++) {
+      dirlist_t *entry = &dirlist[i];
+
+      if (entry == keep || entry->data == NULL || dirlist_busy(entry))
+        continue;
+      if (victim == NULL || entry->lastuse < victim->lastuse)
+        victim = entry;
+    }
+
+    if (victim == NULL)
+      return false;
+    dirlist_free(victim);
+  }
+
+  return true;
+}
+
+/* Compares the directory references of two paths */
+static bool dirlist_same_dir(path_t *a, path_t *b) {
+  if (a->part != b->part)
+    return false;
+#ifdef CONFIG_HAVE_VFS
+  if (a->dir.path != b->dir.path)
+    return false;
+#endif
+#ifdef CONFIG_HAVE_FATFS
+  if (a->dir.fat != b->dir.fat)
+    return false;
+#endif
+  return a->dir.dxx.track  == b->dir.dxx.track &&
+         a->dir.dxx.sector == b->dir.dxx.sector;
+}
+
+/* Checks if a slot holds the listing the current command asks for */
+static bool dirlist_match(dirlist_t *entry, path_t *path) {
+  return entry->cmdlen       == command_length &&
+         entry->image_as_dir == image_as_dir &&
+         entry->flags        == (globalflags & DIRLIST_FLAGS) &&
+         entry->extmode      == file_extension_mode &&
+         entry->order        == dir_order &&
+         entry->pagesize     == dir_page_size &&
+         dirlist_same_dir(&entry->path, path) &&
+         !memcmp(entry->cmd, command_buffer, command_length);
+}
+
+/**
+ * dirlist_lookup - send a listing from the cache
+ * @buf : buffer of the listing, with read and secondary set
+ * @path: directory to be listed
+ *
+ * This function checks if the listing requested by the command in
+ * command_buffer is cached. If it is, @buf is set up to send it and
+ * 1 is returned. Otherwise the listing generated next in @buf will be
+ * recorded and 0 is returned.
+ */
+uint8_t dirlist_lookup(buffer_t *buf, path_t *path) {
+  dirlist_t *victim = NULL;
+  uint8_t i;
+
+  recorder = NULL;
+
+  if (command_length > DIRLIST_KEYLEN)
+    return 0;
+
+  for (i = 0; i < DIRLIST_SLOTS; i++) {
+    dirlist_t *entry = &dirlist[i];
+
+    if (entry->data != NULL && entry->stale) {
+      /* free listings that were dropped while being sent */
+      if (dirlist_busy(entry))
+        continue;
+      dirlist_free(entry);
+    }
+
+    if (entry->data == NULL) {
+      if (victim == NULL || victim->data != NULL)
+        victim = entry;
+      continue;
+    }
+
+    if (entry->complete && dirlist_match(entry, path)) {
+      entry->lastuse          = ++dirlist_clock;
+      buf->pvt.dirlist.slot   = i;
+      buf->pvt.dirlist.offset = 0;
+      buf->refill = dirlist_refill;
+      dirlist_refill(buf);
+      return 1;
+    }
+
+    if ((victim == NULL ||
+         (victim->data != NULL && entry->lastuse < victim->lastuse)) &&
+        !dirlist_busy(entry))
+      victim = entry;
+  }
+
+  if (victim == NULL)
+    return 0;
+
+  /* Record the listing in the free or least recently used slot */
+  dirlist_free(victim);
+
+  victim->path         = *path;
+  victim->image_as_dir = image_as_dir;
+  victim->flags        = globalflags & DIRLIST_FLAGS;
+  victim->extmode      = file_extension_mode;
+  victim->order        = dir_order;
+  victim->pagesize     = dir_page_size;
+  victim->cmdlen       = command_length;
+  victim->lastuse      = ++dirlist_clock;
+  memcpy(victim->cmd, command_buffer, command_length);
+#ifdef CONFIG_HAVE_VFS
+  pathtab_hold(path->dir.path);
+#endif
+
+  recorder  = buf;
+  recording = victim;
+  return 0;
+}
+
+/**
+ * dirlist_record - record a part of a listing
+ * @buf: buffer of the listing
+ *
+ * This function must be called with every header, entry and footer
+ * generated for a listing after dirlist_lookup. The listing is cached
+ * when its last part (with sendeoi set) was recorded.
+ */
+void dirlist_record(buffer_t *buf) {
+  dirlist_t *entry = recording;
+  uint16_t bytes;
+
+  if (recorder != buf)
+    return;
+
+  bytes = buf->lastused - buf->position + 1;
+
+  if (entry->length + bytes > entry->size) {
+    uint32_t size = entry->size ? entry->size * 2 : DIRLIST_CHUNK;
+    uint8_t *data = NULL;
+
+    if (dirlist_evict(entry, size - entry->size))
+      data = ext_realloc(entry->data, size);
+
+    if (data == NULL) {
+      /* too large for the cache */
+      dirlist_free(entry);
+      return;
+    }
+
+    dirlist_used += size - entry->size;
+    entry->data = data;
+    entry->size = size;
+  }
+
+  memcpy(entry->data + entry->length, buf->data + buf->position, bytes);
+  entry->length += bytes;
+
+  if (buf->sendeoi) {
+    uint8_t *data = ext_realloc(entry->data, entry->length);
+
+    if (data != NULL) {
+      dirlist_used -= entry->size - entry->length;
+      entry->data = data;
+      entry->size = entry->length;
+    }
+    entry->complete = true;
+    recorder = NULL;
+  }
+}
+
+/**
+ * dirlist_discard - do not cache a listing
+ * @buf: buffer of the listing
+ *
+ * This function stops recording the listing generated in @buf, for
+ * listings that would not be generated the same way again.
+ */
+void dirlist_discard(buffer_t *buf) {
+  if (recorder != buf)
+    return;
+
+  recorder = NULL;
+  dirlist_free(recording);
+}
+
+/**
+ * dirlist_invalidate - drop all cached listings
+ *
+ * Must be called whenever the contents of a directory, the size of a
+ * file or the number of free blocks may have changed and when an image
+ * is mounted or unmounted.
+ */
+void dirlist_invalidate(void) {
+  uint8_t i;
+
+  recorder = NULL;
+  if (dirlist_used == 0)
+    return;
+
+  for (i = 0; i < DIRLIST_SLOTS; i++) {
+    dirlist_t *entry = &dirlist[i];
+
+    if (entry->data == NULL)
+      continue;
+
+    if (dirlist_busy(entry))
+      entry->stale = true;
+    else
+      dirlist_free(entry);
+  }
+}
+
+#endif
@@ -0,0 +1,48 @@
+/* sd2iec - SD/MMC to Commodore serial bus interface/controller
+   Copyright (C) 2007-2022  Ingo Korb <ingo@akana.de>
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+   dirlist.h: Cache of rendered directory listings
+
+*/
+
+#ifndef DIRLIST_H
+#define DIRLIST_H
+
+#include "buffers.h"
+#include "cbmdirent.h"
+
+#ifdef CONFIG_DIRLIST_CACHE
+
+uint8_t dirlist_lookup(buffer_t *buf, path_t *path);
+void    dirlist_record(buffer_t *buf);
+void    dirlist_discard(buffer_t *buf);
+void    dirlist_invalidate(void);
+
+#else
+
+#  define dirlist_lookup(buf, path) 0
+#  define dirlist_record(buf)       do {} while (0)
+#  define dirlist_discard(buf)      do {} while (0)
+#  define dirlist_invalidate()      do {} while (0)
+
+#endif
+
+#endif
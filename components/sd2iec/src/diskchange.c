@@ -23,37 +23,54 @@
 
 */
 
+#include <errno.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "config.h"
 #include "buffers.h"
+#include "d64ops.h"
+#include "dirlist.h"
 #include "display.h"
 #include "doscmd.h"
 #include "errormsg.h"
-#ifdef CONFIG_HAVE_FATFS
-#include "fatops.h"
-#include "ff.h"
-#endif
 #include "flags.h"
+#include "imgcache.h"
 #include "led.h"
 #include "parser.h"
 #include "progmem.h"
 #include "timer.h"
 #include "utils.h"
 #include "ustring.h"
+#include "vfsops.h"
+#include "wrapops.h"
 #include "diskchange.h"
 
 _Static_assert(CONFIG_COMMAND_BUFFER_SIZE < 256, "command buffer too large");
 
 #define MAX_LINE_LEN (CONFIG_COMMAND_BUFFER_SIZE - 1)
 
+/* Largest swap list that is read */
+#define MAX_LIST_SIZE 8192
+
+/* Entries per swap list, line number 255 selects the last one */
+#define MAX_ENTRIES 254
+
 static const char PROGMEM autoswap_lst_name[] = "AUTOSWAP.LST";
 static const char PROGMEM autoswap_gen_name[] = "AUTOSWAP.GEN"; // FIXME: must be 15 chars or less
 static const char PROGMEM petscii_marker[8]   = "#PETSCII";
 
-static FIL     swaplist;
-static path_t  swappath;
-static uint8_t linenum;
+/*
+ * The swap list is read and parsed once when it is set. swaptext holds
+ * its entries without comments and line terminators, each terminated
+ * by a zero byte, and swapline the offset of every entry in it.
+ */
+static uint8_t *swaptext;
+static uint16_t swapline[MAX_ENTRIES];
+static uint8_t  swapcount;
+static path_t   swappath;
+static uint8_t  linenum;
 
 #define BLINK_BACKWARD 1
 #define BLINK_FORWARD  2
@@ -63,8 +80,6 @@ static void confirm_blink(uint8_t type) {
   uint8_t i;
 
   for (i=0;i<2;i++) {
-    tick_t targettime;
-
 #ifdef SINGLE_LED
     (void)type;
     set_dirty_led(1);
@@ -74,131 +89,220 @@ static void confirm_blink(uint8_t type) {
     if (!i || type & 2)
       set_busy_led(1);
 #endif
-    targettime = ticks + MS_TO_TICKS(100);
-    while (time_before(ticks,targettime)) ;
+    delay_ms(100);
 
     set_dirty_led(0);
     set_busy_led(0);
-    targettime = ticks + MS_TO_TICKS(100);
-    while (time_before(ticks,targettime)) ;
+    delay_ms(100);
   }
 }
 
-static bool mount_line(void) {
-  FRESULT res;
-  UINT bytesread;
-  uint8_t *buffer_start;
-  uint16_t curpos; /* offset of current line in swaplist */
-  bool got_colon = false;
-  bool seen_nonwhite = false;
-  bool is_comment = false;
-  uint8_t olderror = current_error;
-  current_error = ERROR_OK;
+/**
+ * list_hostpath - get the card path of a swap list file
+ * @buffer  : buffer for the path, 512 bytes
+ * @path    : path of the swap list
+ * @filename: name of the swap list file
+ *
+ * This function converts @filename to ASCII and builds the full path
+ * of the file in @path.
+ */
+static void list_hostpath(char *buffer, path_t *path, uint8_t *filename) {
+  uint8_t name[CONFIG_COMMAND_BUFFER_SIZE];
+
+  ustrncpy(name, filename, sizeof(name)-1);
+  name[sizeof(name)-1] = 0;
+  pet2asc(name);
+  vfs_hostpath(buffer, path, (char *)name);
+}
 
-  /* Kill all buffers */
-  free_multiple_buffers(FMB_USER_CLEAN);
+/**
+ * read_changelist - read and index a swap list
+ * @path    : path of the swap list
+ * @filename: name of the swap list file
+ *
+ * This function reads the swap list @filename in @path into swaptext
+ * and records the start of every entry in swapline. Returns false if
+ * the file could not be read.
+ */
+static bool read_changelist(path_t *path, uint8_t *filename) {
+  char     buffer[512]; // FIXME
+  uint8_t *text, *src, *dst;
+  size_t   size;
+  FILE    *fp;
+
+  if (partition[path->part].fop != &vfsops) {
+    set_error(ERROR_FILE_NOT_FOUND);
+    return false;
+  }
 
-  /* allocate work area */
-  buffer_t* readbuf = alloc_buffer();
+  list_hostpath(buffer, path, filename);
+  fp = fopen(buffer, "rb");
+  if (fp == NULL) {
+    parse_error(errno, 1);
+    return false;
+  }
 
-  if (!readbuf) {
+  text = malloc(MAX_LIST_SIZE + 1);
+  if (text == NULL) {
+    fclose(fp);
+    set_error(ERROR_BUFFER_TOO_SMALL);
     return false;
   }
 
-  curpos = 0;
-  buffer_start = readbuf->data;
+  size = fread(text, 1, MAX_LIST_SIZE, fp);
+  fclose(fp);
+  text[size] = 0;
+
   globalflags |= SWAPLIST_ASCII;
-  buffer_start[MAX_LINE_LEN] = 0;
+  if (size >= sizeof(petscii_marker) &&
+      !memcmp_P(text, petscii_marker, sizeof(petscii_marker)))
+    /* swaplist is in PETSCII, the marker line is skipped as comment */
+    globalflags &= ~SWAPLIST_ASCII;
+
+  /* Compact the entries in place */
+  src = text;
+  dst = text;
+  swapcount = 0;
+  while (*src && swapcount < MAX_ENTRIES) {
+    uint8_t *line = src;
+    bool seen_nonwhite = false;
+    bool is_comment = false;
+
+    while (*src && *src != '\r' && *src != '\n') {
+      if (*src == ';' && !seen_nonwhite)
+        is_comment = true;
 
-  uint8_t effective_line = 0;
-  while (effective_line <= linenum) {
-    uint8_t* strend = NULL;
-    uint8_t* str = buffer_start;
+      if (*src != ' ' && *src != '\t')
+        seen_nonwhite = true;
 
-    res = f_lseek(&swaplist, curpos);
-    if (res != FR_OK) {
-      parse_error(res, 1);
-      return false;
+      src++;
     }
 
-    res = f_read(&swaplist, str, MAX_LINE_LEN, &bytesread);
-    if (res != FR_OK) {
-      parse_error(res, 1);
-      return false;
-    }
+    size_t len = src - line;
 
-    /* Terminate string in buffer */
-    if (bytesread < MAX_LINE_LEN)
-      str[bytesread] = 0;
-
-    if (bytesread == 0) {
-      if (linenum == 255) {
-        /* Last entry requested, found it */
-        linenum = effective_line - 1;
-      } else {
-        /* End of file - restart loop to read the first entry */
-        linenum = 0;
-      }
-      effective_line = 0;
-      curpos = 0;
-      continue;
+    if (line == text && !(globalflags & SWAPLIST_ASCII))
+      is_comment = true;
+
+    /* Skip line terminator, before it is overwritten below */
+    while (*src == '\r' || *src == '\n')
+      src++;
+
+    if (!is_comment && len != 0) {
+      if (len > MAX_LINE_LEN - 1)
+        len = MAX_LINE_LEN - 1;
+
+      memmove(dst, line, len);
+      swapline[swapcount++] = dst - text;
+      dst += len;
+      *dst++ = 0;
     }
+  }
 
-    /* parse line */
-    is_comment = false;
-    got_colon = false;
-    seen_nonwhite = false;
+  swaptext = realloc(text, dst - text + 1);
+  if (swaptext == NULL)
+    swaptext = text;
 
-    while (*str && *str != '\r' && *str != '\n') {
-      if (*str == ':')
-        got_colon = true;
+  return true;
+}
 
-      if (*str == ';' && !seen_nonwhite) {
-        is_comment = true;
-      }
+/* Forget the current swap list */
+static void drop_changelist(void) {
+  free(swaptext);
+  swaptext  = NULL;
+  swapcount = 0;
+  imgcache_warm(NULL, NULL);
+}
 
-      if (*str != ' ' && *str != '\t') {
-        seen_nonwhite = true;
-      }
+#if defined(CONFIG_IMAGE_CACHE) && defined(CONFIG_STORAGE_TASK)
+/**
+ * entry_hostpath - get the card path of a swap list entry
+ * @line  : number of the entry
+ * @buffer: buffer for the path, 512 bytes
+ *
+ * This function builds the full path of the image named by entry @line
+ * if it is a plain file name in the directory of the swap list.
+ * Returns false for other entries.
+ */
+static bool entry_hostpath(uint8_t line, char *buffer) {
+  uint8_t  name[MAX_LINE_LEN];
+  uint8_t *entry = swaptext + swapline[line];
 
-      str++;
-    }
+  if (*entry == ':')
+    entry++;
 
-    strend = str;
+  /* read_changelist made sure that swappath is a directory on the card */
+  if (*entry == 0 || ustrchr(entry, ':') || ustrchr(entry, '/') ||
+      ustrchr(entry, '*') || ustrchr(entry, '?'))
+    return false;
 
-    /* Skip line terminator */
-    while (*str == '\r' || *str == '\n') str++;
+  ustrcpy(name, entry);
+  if (!(globalflags & SWAPLIST_ASCII))
+    pet2asc(name);
 
-    /* check for PETSCII marker */
-    if (curpos == 0) {
-      if (!memcmp_P(buffer_start, petscii_marker, sizeof(petscii_marker))) {
-        /* swaplist is in PETSCII, ignore this line */
-        globalflags &= ~SWAPLIST_ASCII;
-        is_comment = true;
-      }
-    }
+  vfs_hostpath(buffer, &swappath, (char *)name);
+  return true;
+}
 
-    curpos += str - buffer_start;
+/**
+ * warm_neighbours - read the next and previous images in the background
+ *
+ * This function asks the image cache to read the images before and
+ * after the current entry, so swapping to them does not have to wait
+ * for the card. Entries with the same text as the current one are
+ * skipped, that image is mounted and may change.
+ */
+static void warm_neighbours(void) {
+  char    nextpath[512], prevpath[512]; // FIXME
+  uint8_t next = (linenum + 1 < swapcount) ? linenum + 1 : 0;
+  uint8_t prev = linenum ? linenum - 1 : swapcount - 1;
+  uint8_t *current = swaptext + swapline[linenum];
+  bool    hasnext, hasprev;
+
+  hasnext = ustrcmp(swaptext + swapline[next], current) &&
+            entry_hostpath(next, nextpath);
+  hasprev = prev != next &&
+            ustrcmp(swaptext + swapline[prev], current) &&
+            entry_hostpath(prev, prevpath);
+
+  imgcache_warm(hasnext ? nextpath : NULL, hasprev ? prevpath : NULL);
+}
+#else
+#  define warm_neighbours() do {} while (0)
+#endif
 
-    if (!is_comment) {
-      /* an actual entry, copy it in case it is the last one in the file */
-      effective_line += 1;
-      *strend = 0;
-      memcpy(command_buffer + 1, buffer_start, strend - buffer_start + 1);
-    }
+static bool mount_line(void) {
+  uint8_t *buffer_start;
+  uint8_t olderror = current_error;
+
+  if (swapcount == 0)
+    return false;
+
+  if (linenum >= swapcount) {
+    if (linenum == 255)
+      /* Last entry requested */
+      linenum = swapcount - 1;
+    else
+      /* Wrap around to the first entry */
+      linenum = 0;
   }
 
-  if (partition[swappath.part].fop != &fatops)
+  current_error = ERROR_OK;
+  ustrcpy(command_buffer + 1, swaptext + swapline[linenum]);
+
+  if (partition[swappath.part].fop != &vfsops)
     image_unmount(swappath.part);
 
   /* Start in the partition+directory of the swap list */
   current_part = swappath.part;
   display_current_part(current_part);
+#ifdef CONFIG_HAVE_VFS
+  pathtab_assign(&partition[current_part].current_dir.path, swappath.dir.path);
+#endif
   partition[current_part].current_dir = swappath.dir;
 
   /* add a colon if neccessary */
   buffer_start = command_buffer + 1;
-  if (!got_colon && *buffer_start != '/') {
+  if (!ustrchr(buffer_start, ':') && *buffer_start != '/') {
     command_buffer[0] = ':';
     buffer_start--;
   }
@@ -215,6 +319,7 @@ static bool mount_line(void) {
     return false;
   }
 
+  warm_neighbours();
   return true;
 }
 
@@ -228,61 +333,42 @@ static bool mount_line(void) {
  * into @filename. Returns nonzero if at least one image was found.
  */
 static uint8_t create_changelist(path_t *path, uint8_t *filename) {
-  FRESULT res;
-  FILINFO finfo;
-  DIR dh;
-  FIL fh;
-  UINT byteswritten;
-  uint8_t *name;
-  uint8_t found = 0;
+  char        buffer[512]; // FIXME
+  cbmdirent_t dent;
+  dh_t        dh;
+  FILE       *fp;
+  uint8_t     found = 0;
+
+  if (partition[path->part].fop != &vfsops)
+    return 0;
 
   /* open directory */
-  res = l_opendir(&partition[path->part].fatfs, path->dir.fat, &dh);
-  if (res != FR_OK)
+  if (w_opendir(&dh, path))
     return 0;
 
   /* open file */
-  res = f_open(&partition[path->part].fatfs, &fh, filename, FA_WRITE | FA_CREATE_ALWAYS);
-  if (res != FR_OK)
+  list_hostpath(buffer, path, filename);
+  fp = fopen(buffer, "wb");
+  if (fp == NULL)
     return 0;
 
   /* scan directory */
   set_busy_led(1);
-  finfo.lfn = ops_scratch;
-
-  while (1) {
-    res = f_readdir(&dh, &finfo);
-    if (res != FR_OK)
-      break;
-
-    if (finfo.fname[0] == 0)
-      break;
-
-    if (!(finfo.fattrib & AM_DIR)) {
-      if (check_imageext(finfo.fname) == IMG_IS_DISK) {
-        /* write the name of disk image to file */
-        found = 1;
-
-        if (ops_scratch[0] != 0)
-          name = ops_scratch;
-        else
-          name = finfo.fname;
-
-        res = f_write(&fh, name, ustrlen(name), &byteswritten);
-        if (res != FR_OK || byteswritten == 0)
-          break;
-
-        /* add line terminator */
-        finfo.fname[0] = 0x0d;
-        finfo.fname[1] = 0x0a;
-        res = f_write(&fh, finfo.fname, 2, &byteswritten);
-        if (res != FR_OK || byteswritten == 0)
-          break;
-      }
+
+  while (w_readdir(&dh, &dent) == 0) {
+    if ((dent.typeflags & TYPE_MASK) != TYPE_DIR &&
+        check_imageext((uint8_t *)dent.pvt.vfs.realname) == IMG_IS_DISK) {
+      /* write the name of disk image to file */
+      found = 1;
+
+      if (fprintf(fp, "%s\r\n", dent.pvt.vfs.realname) < 0)
+        break;
     }
   }
 
-  f_close(&fh);
+  fclose(fp);
+  dirsnap_invalidate();
+  dirlist_invalidate();
 
   set_busy_led(0);
 
@@ -290,29 +376,23 @@ static uint8_t create_changelist(path_t *path, uint8_t *filename) {
 }
 
 static void set_changelist_internal(path_t *path, uint8_t *filename, uint8_t at_end) {
-  FRESULT res;
-
   /* Assume this isn't the auto-swap list */
   globalflags &= (uint8_t)~AUTOSWAP_ACTIVE;
 
   /* Remove the old swaplist */
-  if (swaplist.fs != NULL) {
-    f_close(&swaplist);
-    memset(&swaplist,0,sizeof(swaplist));
-  }
+  drop_changelist();
 
   if (ustrlen(filename) == 0)
     return;
 
-  /* Open a new swaplist */
-  partition[path->part].fatfs.curr_dir = path->dir.fat;
-  res = f_open(&partition[path->part].fatfs, &swaplist, filename, FA_READ | FA_OPEN_EXISTING);
-  if (res != FR_OK) {
-    parse_error(res,1);
+  /* Read the new swaplist */
+  if (!read_changelist(path, filename))
     return;
-  }
 
   /* Remember its directory so relative paths work */
+#ifdef CONFIG_HAVE_VFS
+  pathtab_assign(&swappath.dir.path, path->dir.path);
+#endif
   swappath = *path;
 
   if (at_end)
@@ -331,7 +411,7 @@ void set_changelist(path_t *path, uint8_t *filename) {
 void change_disk(void) {
   path_t path;
 
-  if (swaplist.fs == NULL) {
+  if (swaptext == NULL) {
     /* No swaplist active, try using AUTOSWAP.LST */
     /* change_disk is called from the IEC idle loop, so ops_scratch is free */
     ustrcpy_P(ops_scratch, autoswap_lst_name);
@@ -342,7 +422,7 @@ void change_disk(void) {
     else
       set_changelist_internal(&path, ops_scratch, 0);
 
-    if (swaplist.fs == NULL) {
+    if (swaptext == NULL) {
       /* No swap list found, create one if key was "home" */
       if (key_pressed(KEY_HOME)) {
         uint8_t swapname[16]; // FIXME: magic constant
@@ -388,6 +468,6 @@ void change_disk(void) {
 }
 
 void change_init(void) {
-  memset(&swaplist,0,sizeof(swaplist));
+  drop_changelist();
   globalflags &= (uint8_t)~AUTOSWAP_ACTIVE;
 }
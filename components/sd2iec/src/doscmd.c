@@ -45,15 +45,20 @@
 #include "filesystem.h"
 #include "flags.h"
 #include "iec.h"
+#include "latency.h"
 #include "led.h"
 #include "parser.h"
 #include "system.h"
 #include "time.h"
 #include "rtc.h"
+#include "trace.h"
 #include "uart.h"
 #include "ustring.h"
 #include "utils.h"
 #include "wrapops.h"
+#ifdef CONFIG_HAVE_VFS
+#include "vfsops.h"
+#endif
 #include "doscmd.h"
 
 #define CURSOR_RIGHT 0x1d
@@ -392,12 +397,12 @@ static void dump_command(void) {
 
 /* Dump buffer state */
 static void dump_buffer_state(void) {
-  if (CONFIG_CAPTURE_BUFFER_SIZE - (loader_ptr - loader_buffer) > sizeof(buffer_t)*CONFIG_BUFFER_COUNT+2) {
+  if (CONFIG_CAPTURE_BUFFER_SIZE - (loader_ptr - loader_buffer) > sizeof(buffer_t)*buffer_count+2) {
     *loader_ptr++ = 'B';
     *loader_ptr++ = sizeof(buffer_t);
-    *loader_ptr++ = CONFIG_BUFFER_COUNT;
-    memcpy(loader_ptr, buffers, sizeof(buffer_t) * CONFIG_BUFFER_COUNT);
-    loader_ptr += sizeof(buffer_t) * CONFIG_BUFFER_COUNT;
+    *loader_ptr++ = buffer_count;
+    memcpy(loader_ptr, buffers, sizeof(buffer_t) * buffer_count);
+    loader_ptr += sizeof(buffer_t) * buffer_count;
   }
 }
 
@@ -987,7 +992,8 @@ static void parse_direct(void) {
 #if defined(HAVE_SD) || defined(HAVE_ATA)
   case 'R':
     /* Read sector */
-    if (buf->pvt.buffer.size < 2) { // FIXME: Assumes 512-byte sectors
+    if (buf->pvt.buffer.size < 2 || // FIXME: Assumes 512-byte sectors
+        buf->pvt.buffer.next->data != buf->data + 256) {
       set_error(ERROR_BUFFER_TOO_SMALL);
       return;
     }
@@ -1009,7 +1015,8 @@ static void parse_direct(void) {
 
   case 'W':
     /* Write sector */
-    if (buf->pvt.buffer.size < 2) { // FIXME: Assumes 512-byte sectors
+    if (buf->pvt.buffer.size < 2 || // FIXME: Assumes 512-byte sectors
+        buf->pvt.buffer.next->data != buf->data + 256) {
       set_error(ERROR_BUFFER_TOO_SMALL);
       return;
     }
@@ -2006,6 +2013,149 @@ static void parse_xcommand(void) {
     }
     break;
 
+#ifdef CONFIG_HAVE_VFS
+  case 'C':
+    /* Commit policy: XC shows it, XC<mode>[,<size KB>[,<interval 1/10 s>]] sets it */
+    str = command_buffer + 2;
+    if (*str && *str != '?') {
+      commit_policy_t policy = commit_policy;
+      uint16_t val;
+
+      val = parse_number(&str);
+      if (val > COMMIT_GROUP) {
+        set_error(ERROR_SYNTAX_UNKNOWN);
+        break;
+      }
+      policy.mode = val;
+
+      if (*str == ',') {
+        str++;
+        val = parse_number(&str);
+        if (val > 255) {
+          set_error(ERROR_SYNTAX_UNKNOWN);
+          break;
+        }
+        policy.size = val;
+      }
+
+      if (*str == ',') {
+        str++;
+        val = parse_number(&str);
+        if (val > 255) {
+          set_error(ERROR_SYNTAX_UNKNOWN);
+          break;
+        }
+        policy.interval = val;
+      }
+
+      /* Data written under the old policy is committed right away */
+      vfs_commit();
+      commit_policy = policy;
+    }
+    set_error_ts(ERROR_STATUS,device_address,2);
+    break;
+#endif
+
+  case 'N':
+    /* Buffer pool size: XN shows it, XN<count> sets it for the next boot */
+    str = command_buffer + 2;
+    if (*str) {
+      num = parse_number(&str);
+      if (num != 0 && (num < BUFFER_COUNT_MIN || num > CONFIG_BUFFER_COUNT)) {
+        set_error(ERROR_SYNTAX_UNKNOWN);
+        break;
+      }
+      buffer_pool_size = num;
+    }
+    set_error_ts(ERROR_STATUS,device_address,6);
+    break;
+
+  case 'O':
+    /* Listing order: XO shows it, XO<U|N|D>[F][,<page size>] sets it */
+    str = command_buffer + 2;
+    if (*str) {
+      uint16_t size = dir_page_size;
+      uint8_t  order;
+
+      switch (*str++) {
+      case 'U':
+        order = DIR_ORDER_NONE;
+        break;
+
+      case 'N':
+        order = DIR_ORDER_NAME;
+        break;
+
+      case 'D':
+        order = DIR_ORDER_DATE;
+        break;
+
+      default:
+        order = 0xff;
+        break;
+      }
+
+      if (*str == 'F') {
+        order |= DIR_ORDER_DIRFIRST;
+        str++;
+      }
+
+      if (*str == ',') {
+        str++;
+        size = parse_number(&str);
+      }
+
+      if (order == 0xff || *str || size == 0 || size > 255) {
+        set_error(ERROR_SYNTAX_UNKNOWN);
+        break;
+      }
+      dir_order     = order;
+      dir_page_size = size;
+    }
+    set_error_ts(ERROR_STATUS,device_address,7);
+    break;
+
+#ifdef CONFIG_TRACK_CACHE
+  case 'K':
+    /* Track cache counters: XK shows them, XK0 clears them */
+    if (command_buffer[2] == '0')
+      memset(&trackcache_stats, 0, sizeof(trackcache_stats));
+    set_error_ts(ERROR_STATUS,device_address,3);
+    break;
+#endif
+
+#ifdef CONFIG_LATENCY_STATS
+  case 'L':
+    /* Latency histograms: XL<n> shows operation n, XL or XL0 clears all */
+    str = command_buffer + 2;
+    num = parse_number(&str);
+    if (num >= LAT_OPS) {
+      set_error(ERROR_SYNTAX_UNKNOWN);
+    } else if (num == 0) {
+      latency_clear();
+      set_error(ERROR_OK);
+    } else {
+      set_error_ts(ERROR_STATUS,num,5);
+    }
+    break;
+#endif
+
+#ifdef CONFIG_TRACE_LEVEL
+  case 'T':
+    /* Bus trace: XT shows level and counters, XT<level> sets the level */
+    str = command_buffer + 2;
+    if (*str) {
+      num = parse_number(&str);
+      if (num > CONFIG_TRACE_LEVEL) {
+        set_error(ERROR_SYNTAX_UNKNOWN);
+        break;
+      }
+      trace_level = num;
+    }
+    set_error_ts(ERROR_STATUS,device_address,4);
+    break;
+#endif
+
   case 'W':
     /* Write configuration */
     write_configuration();
@@ -2091,6 +2241,9 @@ void parse_doscommand(void) {
   /* Set default message: Everything ok */
   set_error(ERROR_OK);
 
+  /* The command may move a channel or change the sectors it reads next */
+  buffer_prefetch_drop();
+
   /* Abort if the command is too long */
   if (command_length == CONFIG_COMMAND_BUFFER_SIZE) {
     set_error(ERROR_SYNTAX_TOOLONG);
@@ -28,6 +28,7 @@
 #include <stdbool.h>
 #include <string.h>
 #include "config.h"
+#include "dirlist.h"
 #include "eeprom-fs.h"
 #include "errormsg.h"
 #ifdef CONFIG_HAVE_FATFS
@@ -193,6 +194,7 @@ static uint8_t eefs_cleanup_write(buffer_t *buf) {
     return 0;
 
   /* write remaining data */
+  dirlist_invalidate();
   if (buf->refill(buf))
     return 1;
 
@@ -248,6 +250,8 @@ static void eefs_open_write(path_t *path, cbmdirent_t *dent, uint8_t type,
 
   eefs_error_t res;
 
+  dirlist_invalidate();
+
   repad_filename(dent->name);
 
   if (append) {
@@ -286,6 +290,7 @@ static uint8_t eefs_delete(path_t *path, cbmdirent_t *dent) {
   eefs_error_t res;
 
   set_dirty_led(1);
+  dirlist_invalidate();
 
   repad_filename(dent->name);
   res = eepromfs_delete(dent->name);
@@ -353,6 +358,7 @@ static void eefs_format(uint8_t drv, uint8_t *name, uint8_t *id) {
   (void)name;
   (void)id;
 
+  dirlist_invalidate();
   eepromfs_format();
 }
 
@@ -408,6 +414,7 @@ static void eefs_rename(path_t *path, cbmdirent_t *oldname, uint8_t *newname) {
 
   eefs_error_t res;
 
+  dirlist_invalidate();
   repad_filename(oldname->name);
   repad_filename(newname);
 
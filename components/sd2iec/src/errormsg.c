@@ -28,6 +28,7 @@
 #include <string.h>
 #include "config.h"
 #include "buffers.h"
+#include "d64ops.h"
 #include "diskio.h"
 #include "display.h"
 #include "eeprom-conf.h"
@@ -35,10 +36,16 @@
 #include "fatops.h"
 #endif
 #include "flags.h"
+#include "latency.h"
 #include "led.h"
 #include "progmem.h"
+#include "storage.h"
+#include "trace.h"
 #include "ustring.h"
 #include "utils.h"
+#ifdef CONFIG_HAVE_VFS
+#include "vfsops.h"
+#endif
 #include "doscmd.h"
 #include "errormsg.h"
 
@@ -79,6 +86,8 @@ static const PROGMEM uint8_t messages[] = {
     0,'S',' ','S','C','R','A','T','C','H','E','D',
   EC(02),
     8,9,
+  EC(04),
+    'D','I','R',4,'S','O','R','T','E','D',
   EC(20), EC(21), EC(22), EC(23), EC(24), EC(27),
     1,3,
   EC(25), EC(28),
@@ -189,7 +198,17 @@ void set_error_ts(uint8_t errornum, uint8_t track, uint8_t sector) {
   uint8_t *msg = error_buffer;
   uint8_t i = 0;
 
+#ifdef CONFIG_STORAGE_TASK
+  /* A block prefetched by the storage task may never be used, */
+  /* its refill is repeated by the bus task if it failed.      */
+  if (storage_task_self())
+    return;
+#endif
+
   current_error = errornum;
+  if (errornum >= ERROR_READ_NOHEADER && errornum != ERROR_DOSVERSION)
+    trace(TRACE_ERRORS, TRACE_ERROR, errornum, track << 8 | sector);
+
   buffers[ERRORBUFFER_IDX].data     = error_buffer;
   buffers[ERRORBUFFER_IDX].lastused = 0;
   buffers[ERRORBUFFER_IDX].position = 0;
@@ -229,6 +248,69 @@ void set_error_ts(uint8_t errornum, uint8_t track, uint8_t sector) {
         i++;
       }
       break;
+#ifdef CONFIG_HAVE_VFS
+    case 2: // Commit policy
+      *msg++ = 'C';
+      msg = appendnumber(msg, commit_policy.mode);
+      *msg++ = ':';
+      msg = appendnumber(msg, commit_policy.size);
+      *msg++ = ':';
+      msg = appendnumber(msg, commit_policy.interval);
+      break;
+#endif
+#ifdef CONFIG_TRACK_CACHE
+    case 3: // Track cache counters
+      *msg++ = 'K';
+      msg = appendlong(msg, trackcache_stats.hits);
+      *msg++ = ':';
+      msg = appendlong(msg, trackcache_stats.misses);
+      break;
+#endif
+#ifdef CONFIG_TRACE_LEVEL
+    case 4: // Bus trace level and counters
+      *msg++ = 'T';
+      msg = appendnumber(msg, trace_level);
+      *msg++ = ':';
+      msg = appendlong(msg, trace_stats.recorded);
+      *msg++ = ':';
+      msg = appendlong(msg, trace_stats.dropped);
+      break;
+#endif
+#ifdef CONFIG_LATENCY_STATS
+    case 5: // Latency of the operation given as track
+      *msg++ = 'L';
+      msg = appendnumber(msg, track);
+      *msg++ = ':';
+      msg = appendlong(msg, latency_samples(track));
+      *msg++ = ':';
+      msg = appendlong(msg, latency_percentile(track, 50));
+      *msg++ = ':';
+      msg = appendlong(msg, latency_percentile(track, 90));
+      *msg++ = ':';
+      msg = appendlong(msg, latency_hist[track].max);
+      break;
+#endif
+    case 6: // Buffer pool
+      *msg++ = 'N';
+      msg = appendnumber(msg, buffer_pool_size);
+      *msg++ = ':';
+      msg = appendnumber(msg, buffer_count);
+      *msg++ = ':';
+      msg = appendnumber(msg, active_buffers & 0xff);
+#ifdef CONFIG_BUFFER_HOT
+      *msg++ = ':';
+      msg = appendlong(msg, buffer_migrations);
+#endif
+      break;
+
+    case 7: // Listing order
+      *msg++ = 'O';
+      *msg++ = "UND"[dir_order & DIR_ORDER_KEY];
+      if (dir_order & DIR_ORDER_DIRFIRST)
+        *msg++ = 'F';
+      *msg++ = ':';
+      msg = appendnumber(msg, dir_page_size);
+      break;
     }
 
   } else if (errornum == ERROR_LONGVERSION || errornum == ERROR_DOSVERSION) {
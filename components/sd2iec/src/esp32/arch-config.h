@@ -26,7 +26,10 @@
 #ifndef ARCH_CONFIG_H
 #define ARCH_CONFIG_H
 
+#include <stdbool.h>
 #include <stdint.h>
+#include <esp_heap_caps.h>
+#include <esp_memory_utils.h>
 
 #include "esp32/iec-bus.h"
 #include "integer.h"
@@ -101,9 +104,32 @@ static inline unsigned int display_intrq_active(void) { return 0; }
 /* Interrupt handler for system tick */
 #define SYSTEM_TICK_HANDLER IRAM_ATTR void systick_handler(void *arg)
 
+/* Bus trace recording runs inside timing loops, keep it out of flash */
+#define TRACE_ATTRIB IRAM_ATTR
+
 /* so the _HANDLER macros are created here.     */
 // #define SD_CHANGE_HANDLER  IRAM_ATTR void sdcard_change_handler(void)
 
 extern uint8_t file_extension_mode;
 
+// Large allocations, in PSRAM if the board has it
+
+static inline void *ext_malloc(size_t size) {
+  return heap_caps_malloc_prefer(size, 2, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT,
+                                 MALLOC_CAP_DEFAULT);
+}
+
+static inline void *ext_realloc(void *ptr, size_t size) {
+  return heap_caps_realloc_prefer(ptr, size, 2,
+                                  MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT,
+                                  MALLOC_CAP_DEFAULT);
+}
+
+static inline void ext_free(void *ptr) { heap_caps_free(ptr); }
+
+/* True if an ext_malloc result ended up in PSRAM */
+static inline bool ext_is_external(const void *ptr) {
+  return esp_ptr_external_ram(ptr);
+}
+
 #endif
\ No newline at end of file
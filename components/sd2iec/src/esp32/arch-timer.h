@@ -29,6 +29,7 @@
 
 #include <stdint.h>
 #include <esp_attr.h>
+#include <esp_timer.h>
 
 /* Types for unsigned and signed tick values */
 typedef uint32_t tick_t;
@@ -43,6 +44,20 @@ static inline int32_t asm_ccount(void) {
     return r;
 }
 
+/* Bus trace timestamps are CPU cycles of the core that records them */
+#define TRACE_TICKS_PER_US (CONFIG_MCU_FREQ/1000000)
+
+static inline uint32_t trace_ticks(void) {
+  return asm_ccount();
+}
+
+/* Core number, bit 13 of PRID on the ESP32 and ESP32-S3 */
+static inline uint8_t trace_cpu(void) {
+  uint32_t r;
+  asm volatile ("rsr %0, prid" : "=r"(r));
+  return (r >> 13) & 1;
+}
+
 /**
  * start_timeout - start a timeout
  * @usecs: number of microseconds before timeout
@@ -79,5 +94,15 @@ static inline void delay_ms(unsigned int msecs) {
   delay_us(msecs * 1000);
 }
 
+/**
+ * uptime_ms - return the time since boot in milliseconds
+ *
+ * The value wraps around after about 49 days, compare with
+ * signed differences.
+ */
+static inline uint32_t uptime_ms(void) {
+  return esp_timer_get_time() / 1000;
+}
+
 #endif
 
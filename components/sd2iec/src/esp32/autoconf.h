@@ -35,7 +35,8 @@
 
 #define CONFIG_ERROR_BUFFER_SIZE 100
 #define CONFIG_COMMAND_BUFFER_SIZE 250
-#define CONFIG_BUFFER_COUNT 15
+#define CONFIG_BUFFER_COUNT 64
+#define CONFIG_BUFFER_DEFAULT 15
 #define CONFIG_MAX_PARTITIONS 4
 #define HAVE_CLOCK_IRQ 1
 
@@ -79,8 +80,57 @@
 #define CONFIG_UART_DEBUG 1
 #define CONFIG_ERROR_BUFFER_SIZE 100
 #define CONFIG_COMMAND_BUFFER_SIZE 250
-#define CONFIG_BUFFER_COUNT 15
+#define CONFIG_BUFFER_COUNT 64
 
 #define CONFIG_DEBUG_VERBOSE 1
 
+#if CONFIG_SD2IEC_IMAGE_CACHE_SIZE > 0
+#define CONFIG_IMAGE_CACHE
+#define CONFIG_IMAGE_CACHE_SIZE (CONFIG_SD2IEC_IMAGE_CACHE_SIZE * 1024L)
+#endif
+
+#if CONFIG_SD2IEC_TRACK_CACHE > 0
+#define CONFIG_TRACK_CACHE (CONFIG_SD2IEC_TRACK_CACHE * 1024L)
+#endif
+
+#if CONFIG_SD2IEC_VFS_READAHEAD > 0
+#define CONFIG_VFS_READAHEAD (CONFIG_SD2IEC_VFS_READAHEAD * 1024)
+#endif
+
+#if CONFIG_SD2IEC_VFS_DIRCACHE > 0
+#define CONFIG_VFS_DIRCACHE (CONFIG_SD2IEC_VFS_DIRCACHE * 1024L)
+#endif
+
+#if CONFIG_SD2IEC_DIRLIST_CACHE > 0
+#define CONFIG_DIRLIST_CACHE (CONFIG_SD2IEC_DIRLIST_CACHE * 1024L)
+#endif
+
+#if CONFIG_SD2IEC_P00CACHE_SIZE > 0
+#define CONFIG_P00CACHE
+#define CONFIG_P00CACHE_SIZE (CONFIG_SD2IEC_P00CACHE_SIZE * 1024L)
+#ifdef CONFIG_SD2IEC_P00CACHE_INDEX
+#define CONFIG_P00CACHE_INDEX
+#endif
+#endif
+
+#ifdef CONFIG_SD2IEC_STORAGE_TASK
+#define CONFIG_STORAGE_TASK 1
+#endif
+
+#if CONFIG_SD2IEC_TRACE_LEVEL > 0
+#define CONFIG_TRACE_LEVEL CONFIG_SD2IEC_TRACE_LEVEL
+#endif
+
+#ifdef CONFIG_SD2IEC_LATENCY_STATS
+#define CONFIG_LATENCY_STATS 1
+#endif
+
+#if CONFIG_SD2IEC_BUFFER_HOT > 0
+#define CONFIG_BUFFER_HOT CONFIG_SD2IEC_BUFFER_HOT
+#endif
+
+#if CONFIG_SD2IEC_VFS_WRITEBEHIND > 0
+#define CONFIG_VFS_WRITEBEHIND (CONFIG_SD2IEC_VFS_WRITEBEHIND * 1024)
+#endif
+
 #endif
@@ -36,6 +36,45 @@
 static uint32_t llfl_reference_time;
 #define CLOCKS_PER_100ns (CONFIG_MCU_FREQ / 10000000)
 
+/* Both lines can be changed with one set and one clear register store
+   if they are in the same GPIO bank. */
+#if !USE_SLOW_GPIO && ((IEC_PIN_CLOCK < 32) == (IEC_PIN_DATA < 32))
+#  define LLFL_WAVEFORM
+#  if IEC_PIN_CLOCK < 32
+#    define WAVE_SET_REG GPIO_OUT_W1TS_REG
+#    define WAVE_CLR_REG GPIO_OUT_W1TC_REG
+#    define WAVE_CLOCK   (1UL << IEC_PIN_CLOCK)
+#    define WAVE_DATA    (1UL << IEC_PIN_DATA)
+#  else
+#    define WAVE_SET_REG GPIO_OUT1_W1TS_REG
+#    define WAVE_CLR_REG GPIO_OUT1_W1TC_REG
+#    define WAVE_CLOCK   (1UL << (IEC_PIN_CLOCK - 32))
+#    define WAVE_DATA    (1UL << (IEC_PIN_DATA - 32))
+#  endif
+
+/* number of generic_2bit_t definitions kept in compiled form */
+#  define WAVE_SLOTS 4
+
+/**
+ * struct wave_t - a generic_2bit_t definition compiled for replay
+ * @def      : definition this entry was compiled from, NULL if unused
+ * @cycles   : time of each bit pair in CPU cycles after llfl_reference_time
+ * @clockbits: bit of the (eor'd) byte that is sent on clock for each pair
+ * @databits : bit of the (eor'd) byte that is sent on data for each pair
+ * @eorvalue : value the byte is xor'd with
+ */
+typedef struct {
+  const generic_2bit_t *def;
+  uint32_t cycles[4];
+  uint8_t  clockbits[4];
+  uint8_t  databits[4];
+  uint8_t  eorvalue;
+} wave_t;
+
+static wave_t  waves[WAVE_SLOTS];
+static uint8_t nextwave;
+#endif
+
 /* ---------- utility functions ---------- */
 
 /**
@@ -146,6 +185,77 @@ iec_bus_t llfl_read_bus_at(uint32_t time) {
   return iec_bus_read();
 }
 
+#ifdef LLFL_WAVEFORM
+/**
+ * wave_get - get the compiled form of a generic_2bit_t definition
+ * @def: pointer to fastloader definition struct
+ *
+ * The pair times are converted to CPU cycles once per definition,
+ * loaders use only a few definitions so they stay in the slots.
+ */
+IRAM_ATTR
+static const wave_t *wave_get(const generic_2bit_t *def) {
+  wave_t *w;
+  unsigned int i;
+
+  for (i = 0; i < WAVE_SLOTS; i++)
+    if (waves[i].def == def)
+      return &waves[i];
+
+  w = &waves[nextwave];
+  nextwave = (nextwave + 1) % WAVE_SLOTS;
+
+  for (i = 0; i < 4; i++) {
+    w->cycles[i]    = def->pairtimes[i] * CLOCKS_PER_100ns;
+    w->clockbits[i] = def->clockbits[i];
+    w->databits[i]  = def->databits[i];
+  }
+  w->eorvalue = def->eorvalue;
+  w->def      = def;
+
+  return w;
+}
+
+/**
+ * llfl_generic_load_2bit - generic 2-bit fastloader transmit
+ * @def : pointer to fastloader definition struct
+ * @byte: data byte
+ *
+ * This function implements generic 2-bit fastloader transmission
+ * based on a generic_2bit_t struct. The set and clear masks and the
+ * deadlines of all four bit pairs are calculated before the first
+ * one is due, the replay loop only waits and writes both lines with
+ * one set and one clear register store.
+ */
+IRAM_ATTR
+void llfl_generic_load_2bit(const generic_2bit_t *def, uint8_t byte) {
+  const wave_t *w = wave_get(def);
+  uint32_t deadline[4], set[4];
+  unsigned int i;
+
+  byte ^= w->eorvalue;
+
+  for (i = 0; i < 4; i++) {
+    deadline[i] = llfl_reference_time + w->cycles[i];
+    set[i] = (((byte >> w->clockbits[i]) & 1) * WAVE_CLOCK) |
+             (((byte >> w->databits[i])  & 1) * WAVE_DATA);
+  }
+
+  for (i = 0; i < 4; i++) {
+    while ((int32_t)(deadline[i] - asm_ccount()) > 0)
+      ;
+    REG_WRITE(WAVE_SET_REG, set[i]);
+    REG_WRITE(WAVE_CLR_REG, set[i] ^ (WAVE_CLOCK | WAVE_DATA));
+  }
+
+#ifdef CONFIG_DEBUG_VERBOSE
+  clock_state = !!(set[3] & WAVE_CLOCK);
+  data_state  = !!(set[3] & WAVE_DATA);
+#endif
+}
+
+#else
+
 /**
  * llfl_generic_load_2bit - generic 2-bit fastloader transmit
  * @def : pointer to fastloader definition struct
@@ -168,6 +278,7 @@ void llfl_generic_load_2bit(const generic_2bit_t *def, uint8_t byte) {
     set_data(data_state);
   }
 }
+#endif
 
 /**
  * llfl_generic_save_2bit - generic 2-bit fastsaver receive
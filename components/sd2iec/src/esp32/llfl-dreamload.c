@@ -26,6 +26,7 @@
 #include "config.h"
 #include "fastloader.h" // for fl_track etc.
 #include "iec-bus.h"
+#include "latency.h"
 #include "llfl-common.h"
 #include "timer.h"
 #include "fastloader-ll.h"
@@ -122,6 +123,7 @@ IEC_ATN_HANDLER {
   } else {
     /* standard ATN acknowledge */
     set_data(0);
+    latency_atn();
   }
 }
 
@@ -32,7 +32,9 @@
 #include "flags.h"
 #include "eeprom-conf.h"
 #include "diskio.h"
+#include "buffers.h"
 #include "bus.h"
+#include "vfsops.h"
 
 static void write_config_block(void *srcptr, unsigned int length);
 static void read_config_block(void *destptr, unsigned int length);
@@ -57,6 +59,12 @@ uint8_t rom_filename[ROM_NAME_LENGTH+1];
  * @drvflags1  : 16 bits of drv mappings, organized as 4 nybbles.
  * @imagedirs  : Disk images-as-directory mode
  * @romname    : M-R rom emulation file name (zero-padded, but not terminated)
+ * @commitmode : commit policy mode for the card
+ * @commitsize : group commit size threshold in KB
+ * @commitintvl: group commit time threshold in 1/10 s
+ * @buffers    : number of buffers allocated at boot, 0 for the default
+ * @dirorder   : default order of directory listings
+ * @dirpage    : number of entries on a page of a directory listing
  *
  * This is the data structure for the contents of the EEPROM.
  *
@@ -76,6 +84,12 @@ static struct {
   uint16_t drvconfig1;
   uint8_t  imagedirs;
   uint8_t  romname[ROM_NAME_LENGTH];
+  uint8_t  commitmode;
+  uint8_t  commitsize;
+  uint8_t  commitintvl;
+  uint8_t  buffers;
+  uint8_t  dirorder;
+  uint8_t  dirpage;
 } __attribute__((packed)) storedconfig;
 
 #define CONFIG_MEMBER_ADDRESS(member) ((uint8_t*)(member)-(uint8_t*)&storedconfig)
@@ -96,6 +110,11 @@ void read_configuration(void) {
   file_extension_mode  = 1;                    /* Store x00 extensions except for PRG */
   set_drive_config(get_default_driveconfig()); /* Set the default drive configuration */
   memset(rom_filename, 0, sizeof(rom_filename));
+  commit_policy.mode     = COMMIT_GROUP;       /* Group commit after 32KB or 1s */
+  commit_policy.size     = 32;
+  commit_policy.interval = 10;
+  dir_order              = DIR_ORDER_NONE;     /* Directory order, pages of 40 entries */
+  dir_page_size          = 40;
 
 #if _FIXME
   /* Use the NEXT button to skip reading the EEPROM configuration */
@@ -107,12 +126,13 @@ void read_configuration(void) {
 
   read_config_block(&storedconfig, sizeof(storedconfig));
   ESP_LOG_BUFFER_HEXDUMP(TAG, &storedconfig, sizeof(storedconfig), ESP_LOG_INFO);
-  /* abort if the size bytes are not set */
-  if (storedconfig.structsize != sizeof(storedconfig)) {
+  /* abort if the size bytes are not set, accept older smaller configs */
+  if (storedconfig.structsize > sizeof(storedconfig) ||
+      storedconfig.structsize < CONFIG_MEMBER_ADDRESS(&storedconfig.commitmode)) {
     return;
   }
   uint8_t *p;
-  for (checksum = 0, p = (uint8_t *)&storedconfig, i=2;i<sizeof(storedconfig);i++) {
+  for (checksum = 0, p = (uint8_t *)&storedconfig, i=2;i<storedconfig.structsize;i++) {
     checksum += p[i];
   }
   if (storedconfig.checksum != checksum) {
@@ -141,6 +161,24 @@ void read_configuration(void) {
 
   image_as_dir = storedconfig.imagedirs;
   strcpy((char*)rom_filename, (char*)&storedconfig.romname);
+
+  if (storedconfig.structsize > CONFIG_MEMBER_ADDRESS(&storedconfig.commitintvl) &&
+      storedconfig.commitmode <= COMMIT_GROUP) {
+    commit_policy.mode     = storedconfig.commitmode;
+    commit_policy.size     = storedconfig.commitsize;
+    commit_policy.interval = storedconfig.commitintvl;
+  }
+
+  if (storedconfig.structsize > CONFIG_MEMBER_ADDRESS(&storedconfig.buffers) &&
+      storedconfig.buffers <= CONFIG_BUFFER_COUNT)
+    buffer_pool_size = storedconfig.buffers;
+
+  if (storedconfig.structsize > CONFIG_MEMBER_ADDRESS(&storedconfig.dirpage) &&
+      (storedconfig.dirorder & DIR_ORDER_KEY) <= DIR_ORDER_DATE &&
+      storedconfig.dirpage != 0) {
+    dir_order     = storedconfig.dirorder;
+    dir_page_size = storedconfig.dirpage;
+  }
 }
 
 /**
@@ -165,6 +203,12 @@ void write_configuration(void) {
   storedconfig.imagedirs = image_as_dir;
   memset(&storedconfig.romname, 0, sizeof(storedconfig.romname));
   strncpy((char*)&storedconfig.romname, (char*)rom_filename, sizeof(storedconfig.romname));
+  storedconfig.commitmode  = commit_policy.mode;
+  storedconfig.commitsize  = commit_policy.size;
+  storedconfig.commitintvl = commit_policy.interval;
+  storedconfig.buffers     = buffer_pool_size;
+  storedconfig.dirorder    = dir_order;
+  storedconfig.dirpage     = dir_page_size;
   for (checksum = 0, p = (uint8_t *)&storedconfig, i=2;i<sizeof(storedconfig);i++) {
     checksum += p[i];
   }
@@ -31,6 +31,7 @@
 #include <esp_system.h>
 #include <esp_timer.h>
 #include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
 #include <freertos/timers.h>
 #include <string.h>
 
@@ -38,6 +39,8 @@
 #include "cbmdirent.h"
 #include "iec-bus.h"
 #include "diskio.h"
+#include "storage.h"
+#include "trace.h"
 
 static const char *TAG = "system";
 
@@ -63,6 +66,67 @@ bool sd2iec_system_init() {
   return true;
 }
 
+#ifdef CONFIG_STORAGE_TASK
+/* Card I/O runs on core 0, next to the led timer and away from the bus */
+/* Block refills from the talk path run here too, so leave room for them */
+#define STORAGE_STACK_SIZE 6144
+static TaskHandle_t storage_task_handle;
+static StaticTask_t storage_task_buffer;
+static StackType_t storage_stack[STORAGE_STACK_SIZE];
+static SemaphoreHandle_t storage_done_sem;
+static StaticSemaphore_t storage_done_buffer;
+
+static void storage_task_main(void *arg) {
+  storage_task();
+}
+
+void storage_task_start(void) {
+  storage_done_sem = xSemaphoreCreateBinaryStatic(&storage_done_buffer);
+  storage_task_handle = xTaskCreateStaticPinnedToCore(
+      storage_task_main, "storage", STORAGE_STACK_SIZE, 0, 20, storage_stack,
+      &storage_task_buffer, 0);
+}
+
+void storage_task_wake(void) {
+  xTaskNotifyGive(storage_task_handle);
+}
+
+void storage_task_sleep(void) {
+  ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+}
+
+void storage_task_done(void) {
+  xSemaphoreGive(storage_done_sem);
+}
+
+void storage_task_wait(void) {
+  xSemaphoreTake(storage_done_sem, pdMS_TO_TICKS(10));
+}
+
+uint8_t storage_task_self(void) {
+  return xTaskGetCurrentTaskHandle() == storage_task_handle;
+}
+#endif
+
+#ifdef CONFIG_TRACE_LEVEL
+/* The bus trace is printed on core 0 so the console stays off core 1 */
+#define TRACE_STACK_SIZE 3072
+static StaticTask_t trace_task_buffer;
+static StackType_t trace_stack[TRACE_STACK_SIZE];
+
+static void trace_task_main(void *arg) {
+  while (1) {
+    trace_drain(stdout);
+    vTaskDelay(pdMS_TO_TICKS(100));
+  }
+}
+
+void trace_init(void) {
+  xTaskCreateStaticPinnedToCore(trace_task_main, "trace", TRACE_STACK_SIZE, 0,
+                                1, trace_stack, &trace_task_buffer, 0);
+}
+#endif
+
 static void led_timer_callback(TimerHandle_t arg) {
   if (led_state & LED_ERROR)
     toggle_dirty_led();
@@ -132,18 +196,6 @@ void i2c_init(void) {
   ESP_LOGI(TAG, "No i2c_init"); // Not used here
 }
 
-void set_changelist(path_t *path, uint8_t *filename) {
-  ESP_LOGE(TAG, "FIXME set_changelist");
-}
-
-void change_init(void) {
-  ESP_LOGE(TAG, "FIXME change_init");
-}
-
-void change_disk(void) {
-  ESP_LOGE(TAG, "FIXME change_disk");
-}
-
 volatile enum diskstates disk_state = DISK_OK;
 
 /**
@@ -32,6 +32,7 @@
 #include "buffers.h"
 #include "d64ops.h"
 #include "diskchange.h"
+#include "dirlist.h"
 #include "diskio.h"
 #include "display.h"
 #include "doscmd.h"
@@ -553,6 +554,7 @@ static uint8_t fat_file_close(buffer_t *buf) {
 
   if (buf->write) {
     /* Write the remaining data using the callback */
+    dirlist_invalidate();
     if (buf->refill(buf))
       return 1;
   }
@@ -706,6 +708,7 @@ FRESULT create_file(path_t *path, cbmdirent_t *dent, uint8_t type, buffer_t *buf
 void fat_open_write(path_t *path, cbmdirent_t *dent, uint8_t type, buffer_t *buf, uint8_t append) {
   FRESULT res;
 
+  dirlist_invalidate();
   if (append) {
     partition[path->part].fatfs.curr_dir = path->dir.fat;
     res = f_open(&partition[path->part].fatfs, &buf->pvt.fat.fh, dent->pvt.fat.realname, FA_WRITE | FA_OPEN_EXISTING);
@@ -863,7 +866,7 @@ int8_t fat_readdir(dh_t *dh, cbmdirent_t *dent) {
     exttype_t ext = check_extension(finfo.fname, &ptr);
     if (ext == EXT_IS_X00) {
       /* [PSRU]00 file - try to read the internal name */
-      uint8_t *name = p00cache_lookup(dh->part, finfo.clust);
+      uint8_t *name = p00cache_lookup(dh->part, 0, finfo.clust);
       typechar = *ptr;
 
       if (name != NULL) {
@@ -894,7 +897,7 @@ int8_t fat_readdir(dh_t *dh, cbmdirent_t *dent) {
             *ptr = 0;
 
         /* add name to cache */
-        p00cache_add(dh->part, finfo.clust, dent->name);
+        p00cache_add(dh->part, 0, finfo.clust, dent->name);
       }
       finfo.fsize -= P00_HEADER_SIZE;
       dent->opstype = OPSTYPE_FAT_X00;
@@ -989,6 +992,7 @@ uint8_t fat_delete(path_t *path, cbmdirent_t *dent) {
   uint8_t *name;
 
   set_dirty_led(1);
+  dirlist_invalidate();
   if (dent->pvt.fat.realname[0]) {
     name = dent->pvt.fat.realname;
     p00cache_invalidate();
@@ -1056,6 +1060,7 @@ uint8_t fat_chdir(path_t *path, cbmdirent_t *dent) {
     if (check_imageext(dent->pvt.fat.realname) != IMG_UNKNOWN) {
       /* D64/M2I mount request */
       free_multiple_buffers(FMB_USER_CLEAN);
+      dirlist_invalidate();
       /* Open image file */
       res = f_open(&partition[path->part].fatfs,
                    &partition[path->part].imagehandle,
@@ -1102,6 +1107,7 @@ void fat_mkdir(path_t *path, uint8_t *dirname) {
 
   partition[path->part].fatfs.curr_dir = path->dir.fat;
   pet2asc(dirname);
+  dirlist_invalidate();
   res = f_mkdir(&partition[path->part].fatfs, dirname);
   parse_error(res,0);
 }
@@ -1350,6 +1356,7 @@ void fat_rename(path_t *path, cbmdirent_t *dent, uint8_t *newname) {
   FRESULT res;
   UINT byteswritten;
 
+  dirlist_invalidate();
   partition[path->part].fatfs.curr_dir = path->dir.fat;
 
   if (dent->opstype == OPSTYPE_FAT_X00) {
@@ -1457,6 +1464,7 @@ void fatops_init(uint8_t preserve_path) {
   /* Invalidate some caches */
   d64_invalidate();
   p00cache_invalidate();
+  dirlist_invalidate();
 
 #ifndef HAVE_HOTPLUG
   if (!max_part) {
@@ -1479,6 +1487,7 @@ uint8_t fat_image_unmount(uint8_t part) {
   FRESULT res;
 
   free_multiple_buffers(FMB_USER_CLEAN);
+  dirlist_invalidate();
 
   /* call D64 unmount function to handle BAM refcounting etc. */
   // FIXME: ops entry?
@@ -1588,6 +1597,7 @@ uint8_t fat_image_write(uint8_t part, DWORD offset, void *buffer, uint16_t bytes
   FRESULT res;
   UINT byteswritten;
 
+  dirlist_invalidate();
   if (offset != (DWORD)-1) {
     res = f_lseek(&partition[part].imagehandle, offset);
     if (res != FR_OK) {
@@ -1611,6 +1621,42 @@ uint8_t fat_image_write(uint8_t part, DWORD offset, void *buffer, uint16_t bytes
   return 0;
 }
 
+/**
+ * fat_image_readv - read several parts of an image
+ * @part : partition number
+ * @iov  : array of parts to read
+ * @count: number of parts
+ *
+ * Returns the first non-zero result of fat_image_read or 0.
+ */
+uint8_t fat_image_readv(uint8_t part, image_iov_t *iov, uint8_t count) {
+  for (uint8_t i = 0; i < count; i++) {
+    uint8_t res = fat_image_read(part, iov[i].offset, iov[i].buffer, iov[i].bytes);
+    if (res)
+      return res;
+  }
+  return 0;
+}
+
+/**
+ * fat_image_writev - write several parts of an image
+ * @part : partition number
+ * @iov  : array of parts to write
+ * @count: number of parts
+ * @flush: Flags if written data should be flushed to disk immediately
+ *
+ * Returns the first non-zero result of fat_image_write or 0.
+ */
+uint8_t fat_image_writev(uint8_t part, image_iov_t *iov, uint8_t count, uint8_t flush) {
+  for (uint8_t i = 0; i < count; i++) {
+    uint8_t res = fat_image_write(part, iov[i].offset, iov[i].buffer, iov[i].bytes,
+                                  flush && i == count - 1);
+    if (res)
+      return res;
+  }
+  return 0;
+}
+
 /* Dummy function for format */
 void format_dummy(uint8_t drive, uint8_t *name, uint8_t *id) {
   (void)drive;
@@ -1639,5 +1685,7 @@ const PROGMEM fileops_t fatops = {  // These should be at bottom, to be consiste
   &fat_rename,
   &fat_image_unmount,
   &fat_image_read,
-  &fat_image_write
+  &fat_image_write,
+  &fat_image_readv,
+  &fat_image_writev
 };
@@ -30,6 +30,7 @@
 #include "buffers.h"
 #include "d64ops.h"
 #include "cbmdirent.h"
+#include "dirlist.h"
 #include "display.h"
 #include "doscmd.h"
 #include "eefs-ops.h"
@@ -39,12 +40,17 @@
 #include "ff.h"
 #endif
 #include "flags.h"
+#include "latency.h"
 #include "m2iops.h"
 #include "parser.h"
 #include "progmem.h"
+#include "trace.h"
 #include "uart.h"
 #include "ustring.h"
 #include "utils.h"
+#ifdef CONFIG_HAVE_VFS
+#include "vfsops.h"
+#endif
 #include "wrapops.h"
 #include "fileops.h"
 
@@ -53,6 +59,8 @@
 /* ------------------------------------------------------------------------- */
 
 uint8_t       image_as_dir;
+uint8_t       dir_order;
+uint8_t       dir_page_size;
 cbmdirent_t   previous_file_dirent;
 static path_t previous_file_path;
 
@@ -296,6 +304,64 @@ static uint8_t pdir_refill(buffer_t* buf) {
   return 0;
 }
 
+#ifdef CONFIG_LATENCY_STATS
+/**
+ * latency_refill - generate the next line of the latency listing
+ * @buf: target buffer
+ *
+ * This function creates one line for every used bucket of the latency
+ * histograms with the number of measurements as block count, the
+ * operation name and the upper limit of the bucket in microseconds.
+ * Used as a callback during $=L generation.
+ */
+static uint8_t latency_refill(buffer_t *buf) {
+  cbmdirent_t dent;
+
+  buf->position = 0;
+
+  while (buf->pvt.latency.op < LAT_OPS) {
+    uint8_t  op     = buf->pvt.latency.op;
+    uint8_t  bucket = buf->pvt.latency.bucket;
+    uint32_t count  = latency_hist[op].count[bucket];
+    const char *name;
+    uint8_t *ptr;
+
+    if (++buf->pvt.latency.bucket == LATENCY_BUCKETS) {
+      buf->pvt.latency.bucket = 0;
+      buf->pvt.latency.op++;
+    }
+    if (count == 0)
+      continue;
+
+    memset(&dent, 0, sizeof(dent));
+    dent.remainder = 0xff;
+    dent.blocksize = count > 65535 ? 65535 : count;
+    dent.typeflags = TYPE_DEL;
+
+    memset(dent.name, ' ', 8);
+    name = latency_name(op);
+    for (ptr = dent.name; *name; )
+      *ptr++ = *name++;
+    ptr = dent.name + 8;
+    if (bucket == LATENCY_BUCKETS - 1) {
+      *ptr++ = '>';
+      ptr = appendlong(ptr, (1UL << bucket) - 1);
+    } else {
+      *ptr++ = '<';
+      ptr = appendlong(ptr, 2UL << bucket);
+    }
+    *ptr = 0;
+
+    createentry(&dent, buf, DIR_FMT_CBM);
+    return 0;
+  }
+  buf->lastused = 1;
+  buf->sendeoi = 1;
+  memset(buf->data,0,2);
+  return 0;
+}
+#endif
+
 /**
  * dir_refill - generate the next directory entry
  * @buf: buffer to be used
@@ -306,8 +372,9 @@ static uint8_t pdir_refill(buffer_t* buf) {
  */
 static uint8_t dir_refill(buffer_t *buf) {
   cbmdirent_t dent;
+  int8_t res;
 
-  uart_putc('+');
+  trace(TRACE_DATA, TRACE_DIRENTRY, buf->secondary, 0);
 
   buf->position = 0;
 
@@ -317,16 +384,29 @@ static uint8_t dir_refill(buffer_t *buf) {
     memcpy(&dent, buf->data+256-sizeof(dent), sizeof(dent));
     dent.typeflags = TYPE_DIR;
     createentry(&dent, buf, buf->pvt.dir.format);
+    dirlist_record(buf);
     return 0;
   }
 
-  switch (next_match(&buf->pvt.dir.dh,
-                     buf->pvt.dir.matchstr,
-                     buf->pvt.dir.match_start,
-                     buf->pvt.dir.match_end,
-                     buf->pvt.dir.filetype,
-                     &dent)) {
+  if (buf->pvt.dir.paged && buf->pvt.dir.left == 0) {
+    /* End of the page */
+    res = -1;
+  } else {
+    /* Read the next entry, skipping those before the page */
+    while ((res = next_match(&buf->pvt.dir.dh,
+                             buf->pvt.dir.matchstr,
+                             buf->pvt.dir.match_start,
+                             buf->pvt.dir.match_end,
+                             buf->pvt.dir.filetype,
+                             &dent)) == 0 &&
+           buf->pvt.dir.skip > 0)
+      buf->pvt.dir.skip--;
+  }
+
+  switch (res) {
   case 0:
+    if (buf->pvt.dir.paged)
+      buf->pvt.dir.left--;
     if (image_as_dir != IMAGE_DIR_NORMAL &&
         (dent.typeflags & FLAG_IMAGE)) {
       if (image_as_dir == IMAGE_DIR_DIR) {
@@ -339,10 +419,13 @@ static uint8_t dir_refill(buffer_t *buf) {
       }
     }
     createentry(&dent, buf, buf->pvt.dir.format);
+    dirlist_record(buf);
     return 0;
 
   case -1:
-    return dir_footer(buf);
+    dir_footer(buf);
+    dirlist_record(buf);
+    return 0;
 
   default:
     free_buffer(buf);
@@ -438,6 +521,26 @@ static uint8_t rawdir_refill(buffer_t *buf) {
   return 0;
 }
 
+/**
+ * open_listing - open the directory for a listing
+ * @buf      : buffer of the listing
+ * @path     : directory to be listed
+ * @secondary: secondary address used for reading the directory
+ *
+ * This function opens the directory in @path unless the listing can
+ * be sent from the cache, in which case @buf is set up and kept.
+ * Returns 0 if the directory was opened, != 0 if an error occured or
+ * the listing is sent from the cache.
+ */
+static uint8_t open_listing(buffer_t *buf, path_t *path, uint8_t secondary) {
+  if (secondary == 0 && dirlist_lookup(buf, path)) {
+    stick_buffer(buf);
+    return 1;
+  }
+
+  return w_opendir(&buf->pvt.dir.dh, path);
+}
+
 /**
  * load_directory - Prepare directory generation and create header
  * @secondary: secondary address used for reading the directory
@@ -463,6 +566,7 @@ static void load_directory(uint8_t secondary) {
   buf->secondary = secondary;
   buf->read      = 1;
   buf->lastused  = 31;
+  buf->pvt.dir.order = dir_order;
 
   if (command_length > 2 && secondary == 0) {
     if(command_buffer[1]=='=') {
@@ -494,6 +598,18 @@ static void load_directory(uint8_t secondary) {
         buf->pvt.dir.format = DIR_FMT_CMD_SHORT;
         pos=3;
       }
+#ifdef CONFIG_LATENCY_STATS
+      else if(command_buffer[2]=='L') {
+        /* Latency histograms */
+        memcpy_P(buf->data, dirheader, sizeof(dirheader));
+        memcpy(buf->data + HEADER_OFFSET_NAME, "LATENCY (US)", 12);
+        buf->pvt.latency.op     = 1;
+        buf->pvt.latency.bucket = 0;
+        buf->refill = latency_refill;
+        stick_buffer(buf);
+        return;
+      }
+#endif
     }
   }
 
@@ -503,7 +619,7 @@ static void load_directory(uint8_t secondary) {
       if (parse_path(command_buffer+pos, &path, &name, 0))
         return;
 
-      if (w_opendir(&buf->pvt.dir.dh, &path))
+      if (open_listing(buf, &path, secondary))
         return;
 
       buf->pvt.dir.matchstr = name;
@@ -544,9 +660,8 @@ static void load_directory(uint8_t secondary) {
         }
         if(buf->pvt.dir.filetype) {
           name++;
-          if(*name++ != ',') {
-            goto scandone;
-          }
+          if(*name == ',')
+            name++;
         }
         while(*name) {
           switch(*name++) {
@@ -570,12 +685,46 @@ static void load_directory(uint8_t secondary) {
           case 'N':
             buf->pvt.dir.format=DIR_FMT_CBM; /* turn off extended listing */
             break;
-          default:
-            goto scandone;
+          case 'O':
+            /* Extension: sort by name, date or not at all */
+            switch (*name++) {
+            case 'N':
+              buf->pvt.dir.order = (buf->pvt.dir.order & DIR_ORDER_DIRFIRST) | DIR_ORDER_NAME;
+              break;
+            case 'D':
+              buf->pvt.dir.order = (buf->pvt.dir.order & DIR_ORDER_DIRFIRST) | DIR_ORDER_DATE;
+              break;
+            case 'U':
+              buf->pvt.dir.order &= DIR_ORDER_DIRFIRST;
+              break;
+            default:
+              goto scandone;
+            }
+            break;
+          case 'F':
+            /* Extension: directories first */
+            buf->pvt.dir.order |= DIR_ORDER_DIRFIRST;
+            break;
+          case '#': {
+            /* Extension: list only page n */
+            uint16_t page = parse_number(&name);
+            uint32_t first;
+
+            if (page == 0)
+              goto scandone;
+            first = (uint32_t)(page - 1) * dir_page_size;
+            buf->pvt.dir.paged = true;
+            buf->pvt.dir.skip  = first > UINT16_MAX ? UINT16_MAX : first;
+            buf->pvt.dir.left  = dir_page_size;
+            break;
           }
-          if(*name && *name++ != ',') {
+          default:
             goto scandone;
           }
+          /* the open parser cuts the name at the first commas, */
+          /* so the options may follow each other without one   */
+          if(*name == ',')
+            name++;
         }
       }
     } else {
@@ -597,13 +746,13 @@ static void load_directory(uint8_t secondary) {
         return;
       }
       path.dir = partition[path.part].current_dir;
-      if (w_opendir(&buf->pvt.dir.dh, &path))
+      if (open_listing(buf, &path, secondary))
         return;
     }
   } else {
     path.part = current_part;
     path.dir  = partition[path.part].current_dir;  // if you do not do this, get_label will fail below.
-    if (w_opendir(&buf->pvt.dir.dh, &path))
+    if (open_listing(buf, &path, secondary))
       return;
   }
 
@@ -657,8 +806,19 @@ scandone:
     if (disk_id(&path,buf->data+HEADER_OFFSET_ID))
       return;
 
+#ifdef CONFIG_HAVE_VFS
+    if (buf->pvt.dir.order != DIR_ORDER_NONE &&
+        partition[path.part].fop == &vfsops &&
+        !vfs_sortdir(&buf->pvt.dir.dh, buf->pvt.dir.order)) {
+      /* listed in directory order, which should not be cached */
+      set_error(ERROR_DIR_UNSORTED);
+      dirlist_discard(buf);
+    }
+#endif
+
     /* Let the refill callback handle everything else */
     buf->refill = dir_refill;
+    dirlist_record(buf);
   }
 
   /* Keep the buffer around */
@@ -677,6 +837,7 @@ scandone:
  * returns 0.
  */
 uint8_t directbuffer_refill(buffer_t *buf) {
+  uint32_t start = latency_start();
   uint8_t sec = buf->secondary;
 
   buf->secondary = BUFFER_SEC_CHAIN - sec;
@@ -689,6 +850,7 @@ uint8_t directbuffer_refill(buffer_t *buf) {
   buf->secondary = sec;
   buf->position  = 0;
   buf->mustflush = 0;
+  latency_record(LAT_DIRECT, start);
   return 0;
 }
 
@@ -798,14 +960,14 @@ void file_open_previous(void) {
 }
 
 /**
- * file_open - open a file on given secondary
+ * _file_open - open a file on given secondary
  * @secondary: secondary address used in OPEN call
  *
  * This function opens the file named in command_buffer on the given
  * secondary address. All special names and prefixes/suffixed are handled
  * here, e.g. $/#/@/,S,W
  */
-void file_open(uint8_t secondary) {
+static void _file_open(uint8_t secondary) {
   buffer_t *buf;
   uint8_t i = 0;
   uint8_t recordlen = 0;
@@ -1042,6 +1204,9 @@ void file_open(uint8_t secondary) {
     return;
   }
 
+#ifdef CONFIG_HAVE_VFS
+  pathtab_assign(&previous_file_path.dir.path, path.dir.path);
+#endif
   previous_file_path   = path;
   previous_file_dirent = dent;
 
@@ -1061,3 +1226,16 @@ void file_open(uint8_t secondary) {
     break;
   }
 }
+
+/**
+ * file_open - open a file on given secondary
+ * @secondary: secondary address used in OPEN call
+ *
+ * Wrapper around _file_open that records the open latency.
+ */
+void file_open(uint8_t secondary) {
+  uint32_t start = latency_start();
+
+  _file_open(secondary);
+  latency_record(LAT_OPEN, start);
+}
@@ -111,6 +111,7 @@ void load_dreamload(UNUSED_PARAMETER) {
     /* &@$% :-( */
     goto error;
   }
+  buffer_hot(buf);
 
   /* Find the start sector of the current directory */
   dh_t dh;
@@ -232,6 +232,8 @@ void load_geos(UNUSED_PARAMETER) {
   if (!cmdbuf || !databuf)
     return;
 
+  buffer_hot(cmdbuf);
+  buffer_hot(databuf);
   cmddata = cmdbuf->data;
 
   /* Initial handshake */
@@ -395,6 +397,9 @@ void load_geos_s1(uint8_t version) {
   if (!encrbuf || !databuf)
     return;
 
+  buffer_hot(encrbuf);
+  buffer_hot(databuf);
+
   if (version == 0) {
     chainptr = geos64_chains;
   } else {
@@ -686,6 +691,8 @@ void load_wheels_s2(UNUSED_PARAMETER) {
   if (!databuf)
     return;
 
+  buffer_hot(databuf);
+
   /* Initial handshake */
   uart_flush();
   delay_ms(1);
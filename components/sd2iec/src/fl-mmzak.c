@@ -225,6 +225,8 @@ void load_mmzak(UNUSED_PARAMETER) {
   if (buf == NULL)
     return;
 
+  buffer_hot(buf);
+
   set_atn_irq(0);
 
   /* initial handshake */
@@ -111,6 +111,7 @@ void load_nippon(UNUSED_PARAMETER) {
     uart_puts_P(PSTR("BUF ERR")); uart_putcrlf();
     return;
   }
+  buffer_hot(buf);
 
   /* loop until IEC master sends a track greater than $80 = exit code */
   while (1) {
@@ -53,6 +53,7 @@ static uint8_t uload3_transferchain(uint8_t track, uint8_t sector, uint8_t savin
     uload3_send_byte(0xff);
     return 0;
   }
+  buffer_hot(buf);
 
   do {
     /* read current sector */
@@ -52,4 +52,14 @@ extern uint8_t image_as_dir;
 #define IMAGE_DIR_DIR    1
 #define IMAGE_DIR_BOTH   2
 
+/* Default order and page size of listings, defined in fileops.c */
+extern uint8_t dir_order;
+extern uint8_t dir_page_size;
+
+#define DIR_ORDER_NONE     0     /* directory order                    */
+#define DIR_ORDER_NAME     1     /* by name                            */
+#define DIR_ORDER_DATE     2     /* newest first                       */
+#define DIR_ORDER_KEY      0x7f
+#define DIR_ORDER_DIRFIRST 0x80  /* directories before the other files */
+
 #endif
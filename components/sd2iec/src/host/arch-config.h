@@ -0,0 +1,96 @@
+/* sd2iec - SD/MMC to Commodore serial bus interface/controller
+   Copyright (C) 2024 Jarkko Sonninen <kasper@iki.fi>
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+   arch-config.h: Host (Linux) port
+
+*/
+
+#ifndef ARCH_CONFIG_H
+#define ARCH_CONFIG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "integer.h"
+#include "led.h"
+
+/* The "SD card" is a host directory, selected at run time */
+extern const char *host_sdroot;
+#define SDMOUNT_POINT host_sdroot
+
+#define P00CACHE_ATTRIB
+#define TRACE_ATTRIB
+
+// Leds
+
+extern volatile uint8_t led_state;
+
+static inline void leds_init(void) {}
+
+static inline void set_busy_led(uint8_t state) {
+  if (state) {
+    led_state |= LED_BUSY;
+  } else {
+    led_state &= (uint8_t)~LED_BUSY;
+  }
+}
+
+static inline void set_dirty_led(uint8_t state) {
+  if (state) {
+    led_state |= LED_DIRTY;
+  } else {
+    led_state &= (uint8_t)~LED_DIRTY;
+  }
+}
+
+// Toggle function used for error blinking
+static inline void toggle_dirty_led(void) {
+  set_dirty_led(!(led_state & LED_DIRTY));
+}
+
+// Buttons
+
+typedef uint8_t rawbutton_t;
+static inline uint8_t buttons_read() { return 0; }
+static inline void buttons_init(void) {}
+
+static inline void device_hw_address_init(void) {}
+static inline int device_hw_address() { return 8; }
+#define SPI_SPEED_SLOW 0
+static inline void spi_init(int speed) {}
+static inline unsigned int display_intrq_active(void) { return 0; }
+
+/* Interrupt handler for system tick */
+#define SYSTEM_TICK_HANDLER void systick_handler(void)
+
+extern uint8_t file_extension_mode;
+
+// Large allocations
+
+static inline void *ext_malloc(size_t size) { return malloc(size); }
+static inline void *ext_realloc(void *ptr, size_t size) { return realloc(ptr, size); }
+static inline void ext_free(void *ptr) { free(ptr); }
+
+/* Treated as PSRAM, so the buffer tiering runs on the host as well */
+static inline bool ext_is_external(const void *ptr) { (void)ptr; return true; }
+
+#endif
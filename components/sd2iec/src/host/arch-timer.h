@@ -0,0 +1,87 @@
+/* sd2iec - SD/MMC to Commodore serial bus interface/controller
+   Copyright (C) 2024 Jarkko Sonninen <kasper@iki.fi>
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+   arch-timer.h: Host (Linux) timing functions
+
+*/
+
+#ifndef ARCH_TIMER_H
+#define ARCH_TIMER_H
+
+#include <stdint.h>
+
+/* Types for unsigned and signed tick values */
+typedef uint32_t tick_t;
+typedef int32_t stick_t;
+
+extern int64_t arch_timeout;
+
+/* Implemented in system.c, <time.h> clashes with the sd2iec time.h */
+int64_t host_time_us(void);
+void delay_us(unsigned int usecs);
+
+/* Bus trace timestamps are microseconds, the same for all threads */
+#define TRACE_TICKS_PER_US 1
+
+static inline uint32_t trace_ticks(void) {
+  return host_time_us();
+}
+
+static inline uint8_t trace_cpu(void) {
+  return 0;
+}
+
+/**
+ * start_timeout - start a timeout
+ * @usecs: number of microseconds before timeout
+ *
+ * This function sets up a timer so it times out after the specified
+ * number of microseconds.
+ */
+static inline void start_timeout(uint32_t usecs) {
+  arch_timeout = host_time_us() + usecs;
+}
+
+/**
+ * has_timed_out - returns true if timeout was reached
+ *
+ * This function returns true if the timer started by start_timeout
+ * has reached its timeout value.
+ */
+static inline unsigned int has_timed_out(void) {
+  return host_time_us() > arch_timeout;
+}
+
+static inline void delay_ms(unsigned int msecs) {
+  delay_us(msecs * 1000);
+}
+
+/**
+ * uptime_ms - return the time since startup in milliseconds
+ *
+ * The value wraps around after about 49 days, compare with
+ * signed differences.
+ */
+static inline uint32_t uptime_ms(void) {
+  return host_time_us() / 1000;
+}
+
+#endif
@@ -0,0 +1,38 @@
+/* sd2iec - SD/MMC to Commodore serial bus interface/controller
+   Copyright (C) 2024 Jarkko Sonninen <kasper@iki.fi>
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+   atomic.h: Host (Linux) replacement for util/atomic.h
+
+*/
+
+#ifndef _UTIL_ATOMIC_H_
+#define _UTIL_ATOMIC_H_ 1
+
+/* The host build is single-threaded, so atomic blocks are plain blocks */
+#define ATOMIC_BLOCK(type) for (type, __ToDo = 1; __ToDo; __ToDo = 0)
+#define NONATOMIC_BLOCK(type) for (type, __ToDo = 1; __ToDo; __ToDo = 0)
+
+#define ATOMIC_RESTORESTATE    unsigned int sreg_save __attribute__((unused)) = 0
+#define ATOMIC_FORCEON         unsigned int sreg_save __attribute__((unused)) = 0
+#define NONATOMIC_RESTORESTATE unsigned int sreg_save __attribute__((unused)) = 0
+#define NONATOMIC_FORCEOFF     unsigned int sreg_save __attribute__((unused)) = 0
+
+#endif
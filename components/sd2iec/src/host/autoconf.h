@@ -0,0 +1,92 @@
+/* sd2iec - SD/MMC to Commodore serial bus interface/controller
+   Copyright (C) 2024 Jarkko Sonninen <kasper@iki.fi>
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+   autoconf.h: Host (Linux) build configuration
+
+*/
+// Emulates the original build system
+#ifndef AUTOCONF_H
+#define AUTOCONF_H
+#include "sdkconfig.h"
+
+#define CONFIG_ARCH host
+#define CONFIG_HARDWARE_NAME sd2iec-host
+#define VERSION "1.0"
+#define LONGVERSION "1.0-host"
+
+#define CONFIG_ERROR_BUFFER_SIZE 100
+#define CONFIG_COMMAND_BUFFER_SIZE 250
+#define CONFIG_BUFFER_COUNT 64
+#define CONFIG_BUFFER_DEFAULT 15
+#define CONFIG_MAX_PARTITIONS 4
+
+/* No IEC bus, no fastloaders - hostbus.c drives the buffers directly */
+#define CONFIG_MCU host
+#define CONFIG_MCU_FREQ 1000000000
+
+#define CONFIG_HAVE_VFS 1
+#define CONFIG_HARDWARE_VARIANT 2
+
+#define CONFIG_P00CACHE
+#define CONFIG_P00CACHE_SIZE 32768
+#define CONFIG_P00CACHE_INDEX
+
+/* Budget for RAM copies of mounted images, SD2IEC_IMAGE_CACHE (KB) */
+#define CONFIG_IMAGE_CACHE
+#define CONFIG_IMAGE_CACHE_SIZE host_image_cache_size
+extern unsigned long host_image_cache_size;
+
+/* Track cache for images that are not in RAM, SD2IEC_TRACKCACHE (KB) */
+#define CONFIG_TRACK_CACHE host_trackcache_size
+extern unsigned long host_trackcache_size;
+
+/* Read-ahead per file channel, SD2IEC_READAHEAD (KB) */
+#define CONFIG_VFS_READAHEAD host_readahead_size
+extern unsigned long host_readahead_size;
+
+/* Write-behind per file channel, SD2IEC_WRITEBEHIND (KB) */
+#define CONFIG_VFS_WRITEBEHIND host_writebehind_size
+extern unsigned long host_writebehind_size;
+
+/* Budget for decoded directory snapshots, SD2IEC_DIRCACHE (KB) */
+#define CONFIG_VFS_DIRCACHE host_dircache_size
+extern unsigned long host_dircache_size;
+
+/* Budget for rendered directory listings, SD2IEC_DIRLIST (KB) */
+#define CONFIG_DIRLIST_CACHE host_dirlist_size
+extern unsigned long host_dirlist_size;
+
+/* Card I/O in a storage thread */
+#define CONFIG_STORAGE_TASK 1
+
+/* Bus trace with all levels, the level in use is set by SD2IEC_TRACE */
+#define CONFIG_TRACE_LEVEL 3
+
+/* Latency histograms, shown by $=L and XL */
+#define CONFIG_LATENCY_STATS 1
+
+/* Internal RAM blocks for channels on the bus, the pool counts as PSRAM */
+#define CONFIG_BUFFER_HOT 4
+
+/* Define to get the uart_putc() progress markers on stderr */
+//#define CONFIG_UART_DEBUG 1
+
+#endif
@@ -0,0 +1,46 @@
+/* sd2iec - SD/MMC to Commodore serial bus interface/controller
+   Copyright (C) 2024 Jarkko Sonninen <kasper@iki.fi>
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+   crc32.c: Host (Linux) replacement for the ESP32 ROM crc32_le
+
+*/
+
+#include <stdint.h>
+#include "rom/crc.h"
+
+/**
+ * crc32_le - calculate a little-endian CRC32
+ * @crc: CRC of the previous data or 0 to start a new calculation
+ * @buf: pointer to the data
+ * @len: number of bytes in buf
+ *
+ * This function calculates the same CRC32 (polynomial 0xedb88320,
+ * inverted in and out) as the ESP32 ROM version.
+ */
+uint32_t crc32_le(uint32_t crc, uint8_t const *buf, uint32_t len) {
+  crc = ~crc;
+  while (len--) {
+    crc ^= *buf++;
+    for (uint8_t i = 0; i < 8; i++)
+      crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+  }
+  return ~crc;
+}
@@ -0,0 +1,43 @@
+/* sd2iec - SD/MMC to Commodore serial bus interface/controller
+   Copyright (C) 2024 Jarkko Sonninen <kasper@iki.fi>
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+   espfs.c: Host (Linux) file system helpers
+
+*/
+
+#include <stdint.h>
+#include <sys/statvfs.h>
+
+uint64_t esp32fs_get_bytes_free(const char *mount_point) {
+  struct statvfs st;
+
+  if (statvfs(mount_point, &st))
+    return 0;
+  return (uint64_t)st.f_bavail * st.f_frsize;
+}
+
+uint64_t esp32fs_get_bytes_used(const char *mount_point) {
+  struct statvfs st;
+
+  if (statvfs(mount_point, &st))
+    return 0;
+  return (uint64_t)(st.f_blocks - st.f_bfree) * st.f_frsize;
+}
@@ -0,0 +1,232 @@
+/* sd2iec - SD/MMC to Commodore serial bus interface/controller
+   Copyright (C) 2024 Jarkko Sonninen <kasper@iki.fi>
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+   geobench.c: Microbenchmark of the Dxx track/sector translation
+
+*/
+
+/*
+   Translates random track/sector pairs of all image types into image
+   offsets, once with the geometry tables used by d64ops.c and once
+   with the per-access switch over the image type it replaced, and
+   prints the time per translation:
+
+     ./build-host/sd2iec-geobench [iterations]
+
+   Both variants do what checked_read does before it reads a sector:
+   check the pair against the number of tracks and the number of
+   sectors on the track, then calculate the offset. The results are
+   compared for every valid pair of every format before timing.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "config.h"
+#include "d64ops.h"
+#include "d64geom.h"
+
+#define PAIRS 4096
+
+typedef struct {
+  uint8_t part;
+  uint8_t track;
+  uint8_t sector;
+} pair_t;
+
+/* one "partition" per image type */
+static const struct {
+  const char     *name;
+  uint8_t         type;
+  uint8_t         tracks;
+  const uint16_t *start;
+} formats[] = {
+  { "D41",    D64_TYPE_D41,  35, d41_track_start },
+  { "D41/42", D64_TYPE_D41,  42, d41_track_start },
+  { "D71",    D64_TYPE_D71,  70, d71_track_start },
+  { "D81",    D64_TYPE_D81,  80, d81_track_start },
+  { "DNP",    D64_TYPE_DNP, 255, dnp_track_start },
+};
+#define FORMATS (sizeof(formats) / sizeof(formats[0]))
+
+static uint8_t    imagetype[FORMATS];
+static uint8_t    last_track[FORMATS];
+static geometry_t geometry[FORMATS];
+static pair_t     pairs[PAIRS];
+
+/* ------------------------------------------------------------------------- */
+/*  Switch-based translation as used before the geometry tables             */
+/* ------------------------------------------------------------------------- */
+
+static inline uint16_t switch_lba(uint8_t part, uint8_t track, const uint8_t sector) {
+  uint16_t offset = 0;
+
+  track--; /* Track numbers are 1-based */
+
+  switch (imagetype[part] & D64_TYPE_MASK) {
+  case D64_TYPE_D41:
+  case D64_TYPE_D71:
+  default:
+    /* 42-track D41 images have 17 sectors on tracks 36-42 */
+    if (track >= 35 && (imagetype[part] & D64_TYPE_MASK) == D64_TYPE_D71) {
+      offset = 683;
+      track -= 35;
+    }
+    if (track < 17)
+      return track*21 + sector + offset;
+    if (track < 24)
+      return 17*21 + (track-17)*19 + sector + offset;
+    if (track < 30)
+      return 17*21 + 7*19 + (track-24)*18 + sector + offset;
+    return 17*21 + 7*19 + 6*18 + (track-30)*17 + sector + offset;
+
+  case D64_TYPE_D81:
+    return track*40 + sector;
+
+  case D64_TYPE_DNP:
+    return track*256 + sector;
+  }
+}
+
+static inline uint16_t switch_sectors(uint8_t part, uint8_t track) {
+  switch (imagetype[part] & D64_TYPE_MASK) {
+  case D64_TYPE_D41:
+  case D64_TYPE_D71:
+  default:
+    if (track > 35 && (imagetype[part] & D64_TYPE_MASK) == D64_TYPE_D71)
+      track -= 35;
+    if (track < 18)
+      return 21;
+    if (track < 25)
+      return 19;
+    if (track < 31)
+      return 18;
+    return 17;
+
+  case D64_TYPE_D81:
+    return 40;
+
+  case D64_TYPE_DNP:
+    return 256;
+  }
+}
+
+static uint32_t switch_offset(const pair_t *p) {
+  if (p->track < 1 || p->track > last_track[p->part] ||
+      p->sector >= switch_sectors(p->part, p->track))
+    return 0;
+
+  return 256L * switch_lba(p->part, p->track, p->sector);
+}
+
+/* ------------------------------------------------------------------------- */
+/*  Table-based translation                                                  */
+/* ------------------------------------------------------------------------- */
+
+static uint32_t table_offset(const pair_t *p) {
+  if (!geom_valid(&geometry[p->part], p->track, p->sector))
+    return 0;
+
+  return 256L * geom_lba(&geometry[p->part], p->track, p->sector);
+}
+
+/* ------------------------------------------------------------------------- */
+/*  Benchmark                                                                */
+/* ------------------------------------------------------------------------- */
+
+static double now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Check that both variants agree on every pair of every format */
+static int verify(void) {
+  for (uint8_t part = 0; part < FORMATS; part++) {
+    for (unsigned t = 0; t <= 255; t++) {
+      for (unsigned s = 0; s <= 255; s++) {
+        pair_t p = { part, t, s };
+
+        if (switch_offset(&p) != table_offset(&p)) {
+          printf("mismatch: %s track %u sector %u\n", formats[part].name, t, s);
+          return 1;
+        }
+      }
+    }
+  }
+  return 0;
+}
+
+static double run(uint32_t (*translate)(const pair_t *), unsigned long iterations,
+                  uint32_t *sum) {
+  double start = now_ns();
+  uint32_t acc = 0;
+
+  for (unsigned long i = 0; i < iterations; i++)
+    acc += translate(&pairs[i % PAIRS]);
+
+  *sum = acc;
+  return (now_ns() - start) / iterations;
+}
+
+int main(int argc, char *argv[]) {
+  unsigned long iterations = (argc > 1 ? strtoul(argv[1], NULL, 0) : 50000000);
+  uint32_t seed = 0x1541;
+  uint32_t sum1, sum2;
+  double t1, t2;
+
+  for (uint8_t i = 0; i < FORMATS; i++) {
+    imagetype[i]       = formats[i].type;
+    last_track[i]      = formats[i].tracks;
+    geometry[i].start  = formats[i].start;
+    geometry[i].tracks = formats[i].tracks;
+  }
+
+  if (verify())
+    return 1;
+
+  /* random valid pairs of random formats */
+  for (unsigned i = 0; i < PAIRS; i++) {
+    pair_t *p = &pairs[i];
+
+    seed = seed * 1103515245 + 12345;
+    p->part  = (seed >> 16) % FORMATS;
+    seed = seed * 1103515245 + 12345;
+    p->track = 1 + (seed >> 16) % formats[p->part].tracks;
+    seed = seed * 1103515245 + 12345;
+    p->sector = (seed >> 16) % geom_sectors(&geometry[p->part], p->track);
+  }
+
+  /* warm up caches and branch predictors */
+  run(switch_offset, PAIRS, &sum1);
+  run(table_offset, PAIRS, &sum2);
+
+  t1 = run(switch_offset, iterations, &sum1);
+  t2 = run(table_offset, iterations, &sum2);
+
+  printf("%lu translations of %d random pairs\n", iterations, PAIRS);
+  printf("switch: %6.2f ns/op (sum %08x)\n", t1, (unsigned)sum1);
+  printf("table : %6.2f ns/op (sum %08x)\n", t2, (unsigned)sum2);
+
+  return sum1 != sum2;
+}
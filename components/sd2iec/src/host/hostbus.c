@@ -0,0 +1,405 @@
+/* sd2iec - SD/MMC to Commodore serial bus interface/controller
+   Copyright (C) 2024 Jarkko Sonninen <kasper@iki.fi>
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+   hostbus.c: Script-driven bus replacement for the host build
+
+*/
+
+/*
+   Instead of an IEC bus, the host build reads one operation per line
+   from stdin and performs it on the buffers the same way iec.c does:
+
+     open <sa> <name>   send name/command to secondary address sa
+     read <sa> [file]   TALK until EOI, optionally saving the data
+     write <sa> <file>  LISTEN and send the contents of file
+     close <sa>         close secondary address sa
+     cmd <command>      send a command to channel 15, print the status
+     status             read and print the error channel
+     load <name> [file] open 0 + read 0 + close 0
+     save <name> <file> open 1 + write 1 + close 1
+     dir [pattern]      load "$pattern" and print the listing
+     key <next|prev|home> press a disk change key, print the status
+
+   Empty lines and lines starting with # are ignored. Every data
+   transfer prints its byte count and the time it took.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+#include "buffers.h"
+#include "d64ops.h"
+#include "diskchange.h"
+#include "doscmd.h"
+#include "errormsg.h"
+#include "fastloader.h"
+#include "fileops.h"
+#include "storage.h"
+#include "timer.h"
+#include "trace.h"
+#include "vfsops.h"
+#include "bus.h"
+
+/* Current device address */
+uint8_t device_address;
+
+/* There are no fastloaders without a bus */
+fastloaderid_t detected_loader;
+
+/* Keys pressed with the key command */
+volatile uint8_t active_keys;
+
+typedef struct {
+  uint8_t *data;
+  size_t   length;
+  size_t   size;
+} hostdata_t;
+
+static void data_append(hostdata_t *d, uint8_t c) {
+  if (d->length == d->size) {
+    d->size = d->size ? 2 * d->size : 65536;
+    d->data = realloc(d->data, d->size);
+    if (d->data == NULL) {
+      perror("realloc");
+      exit(2);
+    }
+  }
+  d->data[d->length++] = c;
+}
+
+static double elapsed_ms(int64_t start) {
+  return (host_time_us() - start) / 1000.0;
+}
+
+/* Equivalent of the BUS_CLEANUP state after every bus transaction */
+static void bus_cleanup(void) {
+  free_multiple_buffers(FMB_UNSTICKY);
+  d64_bam_commit();
+}
+
+/**
+ * host_open - send a file name or command to a secondary address
+ * @sa  : secondary address
+ * @name: file name or command
+ */
+static void host_open(uint8_t sa, const char *name) {
+  command_length = strlen(name);
+  if (command_length > CONFIG_COMMAND_BUFFER_SIZE)
+    command_length = CONFIG_COMMAND_BUFFER_SIZE;
+  memcpy(command_buffer, name, command_length);
+  command_buffer[command_length] = 0;
+
+  if (sa == 0x0f) {
+    parse_doscommand();
+  } else {
+    datacrc = 0xffff;
+    file_open(sa);
+  }
+  command_length = 0;
+  bus_cleanup();
+}
+
+/**
+ * host_talk - read data from a secondary address until EOI
+ * @sa  : secondary address
+ * @data: buffer for the received data
+ *
+ * This is iec_talk_handler() without the bus. The computer stops
+ * reading after a byte with EOI, so buffers that would continue
+ * (error channel, direct access, REL) are refilled once and left alone.
+ */
+static void host_talk(uint8_t sa, hostdata_t *data) {
+  buffer_t *buf;
+
+  trace(TRACE_COMMANDS, TRACE_TALK, sa, 0);
+
+  buf = find_buffer(sa);
+  if (buf == NULL)
+    return;
+
+  buffer_prefetch(buf);
+
+  while (buf->read) {
+    do {
+      data_append(data, buf->data[buf->position]);
+    } while (buf->position++ < buf->lastused);
+
+    if (buf->sendeoi &&
+        sa != 0x0f &&
+        !buf->recordlen &&
+        buf->refill != directbuffer_refill) {
+      buf->read = 0;
+      break;
+    }
+
+    uint8_t eoi = buf->sendeoi;
+    int8_t res = buffer_swap(buf);
+    if (res < 0)
+      res = buf->refill(buf);
+    if (res || eoi)
+      break;
+
+    /* Search the buffer again, it can change when using large buffers */
+    buf = find_buffer(sa);
+    buffer_prefetch(buf);
+  }
+  buffer_prefetch_wait();
+  bus_cleanup();
+}
+
+/**
+ * host_listen - write data to a secondary address
+ * @sa  : secondary address
+ * @data: pointer to the data
+ * @len : number of bytes to send
+ *
+ * This is the data part of iec_listen_handler() without the bus.
+ * The last byte is sent with EOI.
+ */
+static void host_listen(uint8_t sa, const uint8_t *data, size_t len) {
+  buffer_t *buf;
+
+  trace(TRACE_COMMANDS, TRACE_LISTEN, sa, 0);
+
+  buf = find_buffer(sa);
+  if (buf == NULL || !buf->write) {
+    trace(TRACE_ERRORS, TRACE_NOBUFFER, sa, 0);
+    return;
+  }
+
+  while (len--) {
+    /* Flush buffer if full */
+    if (buf->mustflush) {
+      if (buf->refill(buf))
+        break;
+      buf = find_buffer(sa);
+    }
+
+    buf->data[buf->position] = *data++;
+    mark_buffer_dirty(buf);
+
+    if (buf->lastused < buf->position)
+      buf->lastused = buf->position;
+    buf->position++;
+
+    /* Mark buffer for flushing if position wrapped */
+    if (buf->position == 0)
+      buf->mustflush = 1;
+
+    /* REL files must be syncronized on EOI */
+    if (buf->recordlen && len == 0)
+      if (buf->refill(buf))
+        break;
+  }
+  bus_cleanup();
+}
+
+static void host_close(uint8_t sa) {
+  if (sa == 0x0f) {
+    free_multiple_buffers(FMB_USER_CLEAN);
+  } else {
+    buffer_t *buf = find_buffer(sa);
+    if (buf != NULL) {
+      buf->cleanup(buf);
+      free_buffer(buf);
+    }
+  }
+  bus_cleanup();
+}
+
+static void print_status(void) {
+  hostdata_t status = { 0 };
+
+  host_talk(0x0f, &status);
+  for (size_t i = 0; i < status.length && status.data[i] != 13; i++)
+    putchar(status.data[i]);
+  putchar('\n');
+  free(status.data);
+}
+
+static void print_listing(hostdata_t *d) {
+  size_t pos = 2;
+
+  while (pos + 4 <= d->length && (d->data[pos] || d->data[pos+1])) {
+    printf("%u ", d->data[pos+2] | d->data[pos+3] << 8);
+    pos += 4;
+    while (pos < d->length && d->data[pos]) {
+      uint8_t c = d->data[pos++];
+      putchar(c >= 32 && c < 127 ? c : '.');
+    }
+    putchar('\n');
+    pos++;
+  }
+}
+
+static void report(const char *op, size_t bytes, int64_t start) {
+  double ms = elapsed_ms(start);
+
+  printf("%s: %zu bytes in %.3f ms", op, bytes, ms);
+  if (ms > 0)
+    printf(" (%.1f KB/s)", bytes / ms * 1000.0 / 1024.0);
+  printf(", status %u\n", current_error);
+}
+
+static void save_file(const char *name, hostdata_t *d) {
+  FILE *f = fopen(name, "wb");
+
+  if (f == NULL) {
+    perror(name);
+    return;
+  }
+  fwrite(d->data, 1, d->length, f);
+  fclose(f);
+}
+
+static int load_file(const char *name, hostdata_t *d) {
+  FILE *f = fopen(name, "rb");
+  int c;
+
+  if (f == NULL) {
+    perror(name);
+    return 1;
+  }
+  while ((c = fgetc(f)) != EOF)
+    data_append(d, c);
+  fclose(f);
+  return 0;
+}
+
+static void host_command(char *line) {
+  char *op, *arg, *arg2;
+  hostdata_t data = { 0 };
+  int64_t start;
+
+  op = strtok(line, " \t");
+  if (op == NULL || *op == '#')
+    return;
+  arg = strtok(NULL, "");
+  if (arg != NULL)
+    arg += strspn(arg, " \t");
+
+  start = host_time_us();
+
+  if (!strcmp(op, "cmd")) {
+    host_open(0x0f, arg ? arg : "");
+    print_status();
+
+  } else if (!strcmp(op, "status")) {
+    print_status();
+
+  } else if (!strcmp(op, "open") && arg != NULL) {
+    uint8_t sa = strtoul(arg, &arg2, 10);
+    host_open(sa & 0x0f, arg2 + strspn(arg2, " \t"));
+
+  } else if (!strcmp(op, "close") && arg != NULL) {
+    host_close(atoi(arg) & 0x0f);
+
+  } else if (!strcmp(op, "read") && arg != NULL) {
+    uint8_t sa = strtoul(arg, &arg2, 10);
+    host_talk(sa & 0x0f, &data);
+    report("read", data.length, start);
+    arg2 = strtok(arg2, " \t");
+    if (arg2 != NULL)
+      save_file(arg2, &data);
+
+  } else if (!strcmp(op, "write") && arg != NULL) {
+    uint8_t sa = strtoul(arg, &arg2, 10);
+    arg2 = strtok(arg2, " \t");
+    if (arg2 != NULL && !load_file(arg2, &data)) {
+      host_listen(sa & 0x0f, data.data, data.length);
+      report("write", data.length, start);
+    }
+
+  } else if (!strcmp(op, "load") && arg != NULL) {
+    char *name = strtok(arg, " \t");
+    arg2 = strtok(NULL, " \t");
+    host_open(0, name);
+    host_talk(0, &data);
+    host_close(0);
+    report("load", data.length, start);
+    if (arg2 != NULL)
+      save_file(arg2, &data);
+
+  } else if (!strcmp(op, "save") && arg != NULL) {
+    char *name = strtok(arg, " \t");
+    arg2 = strtok(NULL, " \t");
+    if (arg2 != NULL && !load_file(arg2, &data)) {
+      host_open(1, name);
+      host_listen(1, data.data, data.length);
+      host_close(1);
+      report("save", data.length, start);
+    }
+
+  } else if (!strcmp(op, "dir")) {
+    char name[CONFIG_COMMAND_BUFFER_SIZE];
+    snprintf(name, sizeof(name), "$%s", arg ? arg : "");
+    host_open(0, name);
+    host_talk(0, &data);
+    host_close(0);
+    print_listing(&data);
+    report("dir", data.length, start);
+
+  } else if (!strcmp(op, "key") && arg != NULL) {
+    /* handled like the bus idle loop does */
+    if (!strcmp(arg, "next"))
+      active_keys |= KEY_NEXT;
+    else if (!strcmp(arg, "prev"))
+      active_keys |= KEY_PREV;
+    else if (!strcmp(arg, "home"))
+      active_keys |= KEY_HOME;
+    change_disk();
+    report("key", 0, start);
+    print_status();
+
+  } else {
+    printf("unknown command: %s\n", op);
+  }
+
+  free(data.data);
+}
+
+void bus_interface_init(void) {
+  device_address = device_hw_address();
+}
+
+void bus_init(void) {
+}
+
+void bus_mainloop(void) {
+  char line[512];
+
+  while (fgets(line, sizeof(line), stdin) != NULL) {
+    line[strcspn(line, "\r\n")] = 0;
+    host_command(line);
+    /* between commands the bus would be idle */
+    vfs_p00index_poll();
+    fflush(stdout);
+    trace_drain(stderr);
+  }
+
+  /* Write back anything still open before exiting */
+  free_multiple_buffers(FMB_ALL_CLEAN);
+  d64_bam_commit();
+  storage_drain();
+  trace_drain(stderr);
+  exit(0);
+}
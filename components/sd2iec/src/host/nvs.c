@@ -0,0 +1,101 @@
+/* sd2iec - SD/MMC to Commodore serial bus interface/controller
+   Copyright (C) 2024 Jarkko Sonninen <kasper@iki.fi>
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+   nvs.c: Host (Linux) NVS replacement storing each blob in a file
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "nvs.h"
+#include "nvs_flash.h"
+
+#define MAX_NAMESPACES 4
+
+/* Blobs are stored as <SD2IEC_NVS or .>/<namespace>.<key> */
+static const char *nvs_dir;
+static char namespaces[MAX_NAMESPACES][16];
+
+static void blob_path(char *buffer, size_t size, nvs_handle_t handle,
+                      const char *key) {
+  snprintf(buffer, size, "%s/%s.%s", nvs_dir, namespaces[handle], key);
+}
+
+esp_err_t nvs_flash_init(void) {
+  nvs_dir = getenv("SD2IEC_NVS");
+  if (nvs_dir == NULL)
+    nvs_dir = ".";
+  return ESP_OK;
+}
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t open_mode,
+                   nvs_handle_t *out_handle) {
+  nvs_handle_t i;
+
+  for (i = 0; i < MAX_NAMESPACES; i++) {
+    if (namespaces[i][0] == 0)
+      strncpy(namespaces[i], name, sizeof(namespaces[i]) - 1);
+    if (!strcmp(namespaces[i], name)) {
+      *out_handle = i;
+      return ESP_OK;
+    }
+  }
+  return ESP_FAIL;
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *out_value,
+                       size_t *length) {
+  char path[256];
+  FILE *f;
+
+  blob_path(path, sizeof(path), handle, key);
+  f = fopen(path, "rb");
+  if (f == NULL)
+    return ESP_ERR_NVS_NOT_FOUND;
+  *length = fread(out_value, 1, *length, f);
+  fclose(f);
+  return ESP_OK;
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value,
+                       size_t length) {
+  char path[256];
+  FILE *f;
+
+  blob_path(path, sizeof(path), handle, key);
+  f = fopen(path, "wb");
+  if (f == NULL)
+    return ESP_FAIL;
+  if (fwrite(value, 1, length, f) != length) {
+    fclose(f);
+    return ESP_FAIL;
+  }
+  fclose(f);
+  return ESP_OK;
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle) {
+  return ESP_OK;
+}
+
+void nvs_close(nvs_handle_t handle) {
+}
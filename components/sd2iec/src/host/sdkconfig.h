@@ -0,0 +1,35 @@
+/* sd2iec - SD/MMC to Commodore serial bus interface/controller
+   Copyright (C) 2024 Jarkko Sonninen <kasper@iki.fi>
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+   sdkconfig.h: Host replacement for the ESP-IDF generated sdkconfig.h
+
+*/
+#ifndef SDKCONFIG_H
+#define SDKCONFIG_H
+
+/* The host build always has exactly one "SD card": a directory */
+#define CONFIG_SD2IEC_USE_SDCARD 1
+#define CONFIG_SD2IEC_USE_SPI_PARTITION 0
+
+#define CONFIG_SD2IEC_PIN_LED_BUSY -1
+#define CONFIG_SD2IEC_PIN_LED_DIRTY -1
+
+#endif
@@ -0,0 +1,197 @@
+/* sd2iec - SD/MMC to Commodore serial bus interface/controller
+   Copyright (C) 2024 Jarkko Sonninen <kasper@iki.fi>
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+   system.c: Host (Linux) system functions
+
+*/
+
+#include "config.h"
+
+#include <esp_log.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "cbmdirent.h"
+#include "diskio.h"
+#include "storage.h"
+#include "trace.h"
+#include "system.h"
+
+static const char *TAG = "system";
+
+int64_t arch_timeout;
+
+/* Directory used as the SD card, set from SD2IEC_ROOT */
+const char *host_sdroot = "sdcard";
+
+esp_log_level_t host_log_level = ESP_LOG_ERROR;
+
+unsigned long host_image_cache_size = 1024 * 1024L;
+unsigned long host_trackcache_size  = 80 * 1024L;
+unsigned long host_readahead_size   = 8 * 1024L;
+unsigned long host_writebehind_size = 8 * 1024L;
+unsigned long host_dircache_size    = 128 * 1024L;
+unsigned long host_dirlist_size     = 64 * 1024L;
+
+int64_t host_time_us(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void delay_us(unsigned int usecs) {
+  struct timespec ts = { usecs / 1000000, (usecs % 1000000) * 1000 };
+
+  nanosleep(&ts, NULL);
+}
+
+void timer_init(void) {
+  // No system tick and no leds to blink
+}
+
+void disable_interrupts(void) {}
+
+void enable_interrupts(void) {}
+
+/* Early system initialisation */
+void system_init_early(void) {
+  const char *env;
+
+  env = getenv("SD2IEC_LOGLEVEL");
+  if (env != NULL)
+    host_log_level = atoi(env);
+
+  env = getenv("SD2IEC_IMAGE_CACHE");
+  if (env != NULL)
+    host_image_cache_size = strtoul(env, NULL, 10) * 1024L;
+
+  env = getenv("SD2IEC_TRACKCACHE");
+  if (env != NULL)
+    host_trackcache_size = strtoul(env, NULL, 10) * 1024L;
+
+  env = getenv("SD2IEC_READAHEAD");
+  if (env != NULL)
+    host_readahead_size = strtoul(env, NULL, 10) * 1024L;
+
+  env = getenv("SD2IEC_WRITEBEHIND");
+  if (env != NULL)
+    host_writebehind_size = strtoul(env, NULL, 10) * 1024L;
+
+  env = getenv("SD2IEC_DIRCACHE");
+  if (env != NULL)
+    host_dircache_size = strtoul(env, NULL, 10) * 1024L;
+
+  env = getenv("SD2IEC_DIRLIST");
+  if (env != NULL)
+    host_dirlist_size = strtoul(env, NULL, 10) * 1024L;
+
+  env = getenv("SD2IEC_ROOT");
+  if (env != NULL)
+    host_sdroot = env;
+}
+
+/* The bus trace is printed to stderr by hostbus.c after every command,
+   SD2IEC_TRACE sets the initial trace level */
+void trace_init(void) {
+  const char *env = getenv("SD2IEC_TRACE");
+
+  if (env != NULL && atoi(env) <= CONFIG_TRACE_LEVEL)
+    trace_level = atoi(env);
+}
+
+/* Late initialisation */
+void system_init_late(void) {}
+
+/* Reset MCU */
+void system_reset(void) {
+  ESP_LOGI(TAG, "system_reset");
+  exit(0);
+}
+
+void system_sleep(void) {}
+
+void disk_init(void) {
+  struct stat st;
+
+  ESP_LOGI(TAG, "Using %s as SD card", host_sdroot);
+  if (stat(host_sdroot, &st) || !S_ISDIR(st.st_mode)) {
+    ESP_LOGE(TAG, "%s is not a directory", host_sdroot);
+    disk_state = DISK_REMOVED;
+  }
+}
+
+/* The storage task is a thread, woken through two semaphores */
+static sem_t storage_wake_sem;
+static sem_t storage_done_sem;
+static pthread_t storage_thread_id;
+
+static void *storage_thread(void *arg) {
+  (void)arg;
+  storage_task();
+  return NULL;
+}
+
+void storage_task_start(void) {
+  sem_init(&storage_wake_sem, 0, 0);
+  sem_init(&storage_done_sem, 0, 0);
+  pthread_create(&storage_thread_id, NULL, storage_thread, NULL);
+  pthread_detach(storage_thread_id);
+}
+
+void storage_task_wake(void) {
+  sem_post(&storage_wake_sem);
+}
+
+void storage_task_sleep(void) {
+  sem_wait(&storage_wake_sem);
+}
+
+void storage_task_done(void) {
+  sem_post(&storage_done_sem);
+}
+
+void storage_task_wait(void) {
+  sem_wait(&storage_done_sem);
+}
+
+uint8_t storage_task_self(void) {
+  return pthread_equal(pthread_self(), storage_thread_id);
+}
+
+volatile enum diskstates disk_state = DISK_OK;
+
+DRESULT disk_getinfo(BYTE drv, BYTE page, void *buffer) {
+  diskinfo0_t *di = buffer;
+
+  if (page != 0)
+    return RES_ERROR;
+
+  di->validbytes  = sizeof(diskinfo0_t);
+  di->disktype    = DISK_TYPE_SD;
+  di->sectorsize  = 2;
+  di->sectorcount = 1;
+  return RES_OK;
+}
@@ -49,10 +49,14 @@
 #include "fileops.h"
 #include "filesystem.h"
 #include "iec-bus.h"
+#include "latency.h"
 #include "led.h"
 #include "system.h"
 #include "timer.h"
-#include "uart.h"
+#include "trace.h"
+#ifdef CONFIG_HAVE_VFS
+#include "vfsops.h"
+#endif
 #include "iec.h"
 
 /* ------------------------------------------------------------------------- */
@@ -100,6 +104,7 @@ uint8_t iec_check_atn(void) {
 IEC_ATN_HANDLER {
   if (!IEC_ATN) {
     set_data(0);
+    latency_atn();
   }
 }
 #endif
@@ -143,7 +148,7 @@ static int16_t _iec_getc(void) {
     delay_us(73);                       // E9F5-E9F8, delay calculated from all
     set_data(1);                        //   instructions between IO accesses
 
-    uart_putc('E');
+    trace(TRACE_DATA, TRACE_EOI, 0, 0);
 
     do {
       if (iec_check_atn())                             // E9FD
@@ -211,7 +216,7 @@ static int16_t iec_getc(void) {
 
 
 /**
- * iec_putc - send a byte over the serial bus (E916)
+ * _iec_putc - send a byte over the serial bus (E916)
  * @data    : byte to be sent
  * @with_eoi: Flags if the byte should be send with an EOI condition
  *
@@ -219,7 +224,7 @@ static int16_t iec_getc(void) {
  * a marker for the EOI condition. Returns 0 normally or -1 if the bus state has
  * changed, the caller should return to the main loop in that case.
  */
-static uint8_t iec_putc(uint8_t data, const uint8_t with_eoi) {
+static uint8_t _iec_putc(uint8_t data, const uint8_t with_eoi) {
   uint8_t i;
 
   if (iec_check_atn()) return -1;                      // E916
@@ -301,6 +306,23 @@ static uint8_t iec_putc(uint8_t data, const uint8_t with_eoi) {
   return 0;
 }
 
+/**
+ * iec_putc - wrapper around _iec_putc to time each byte
+ * @data    : byte to be sent
+ * @with_eoi: Flags if the byte should be send with an EOI condition
+ *
+ * The time includes waiting for the listener, so the histogram shows
+ * how fast the computer takes the data.
+ */
+static uint8_t iec_putc(uint8_t data, const uint8_t with_eoi) {
+  uint32_t start = latency_start();
+  uint8_t res;
+
+  res = _iec_putc(data, with_eoi);
+  latency_record(LAT_PUTC, start);
+  return res;
+}
+
 
 /* ------------------------------------------------------------------------- */
 /*  Listen+Talk-Handling                                                     */
@@ -316,14 +338,14 @@ static uint8_t iec_listen_handler(const uint8_t cmd) {
   int16_t c;
   buffer_t *buf;
 
-  uart_putc('L');
+  trace(TRACE_COMMANDS, TRACE_LISTEN, cmd & 0x0f, 0);
 
   buf = find_buffer(cmd & 0x0f);
 
   /* Abort if there is no buffer or it's not open for writing */
   /* and it isn't an OPEN command                             */
   if ((buf == NULL || !buf->write) && (cmd & 0xf0) != 0xf0) {
-    uart_putc('c');
+    trace(TRACE_ERRORS, TRACE_NOBUFFER, cmd & 0x0f, 0);
     iec_data.bus_state = BUS_CLEANUP;
     return 1;
   }
@@ -384,20 +406,21 @@ static uint8_t iec_listen_handler(const uint8_t cmd) {
 }
 
 /**
- * iec_talk_handler - handle an incoming TALK request (E909)
+ * iec_talk_blocks - send the data of a channel
  * @cmd: command byte received from the bus
  *
- * This function handles a talk request from the computer.
+ * This function sends blocks of data to the computer until the end
+ * of the file or until the transfer is interrupted.
  */
-static uint8_t iec_talk_handler(uint8_t cmd) {
+static uint8_t iec_talk_blocks(uint8_t cmd) {
   buffer_t *buf;
 
-  uart_putc('T');
-
   buf = find_buffer(cmd & 0x0f);
   if (buf == NULL)
     return 0; /* 0 because we didn't change the state here */
 
+  buffer_prefetch(buf);
+
   if (iec_data.iecflags & JIFFY_ACTIVE)
     /* wait 360us (J1541 E781) to make sure the C64 is at fbb7/fb0c */
     delay_us(360);
@@ -465,7 +488,7 @@ static uint8_t iec_talk_handler(uint8_t cmd) {
             set_clock(0);
           }
           if (res) {
-            uart_putc('Q');
+            trace(TRACE_ERRORS, TRACE_TALKABORT, cmd & 0x0f, 0);
             return 1;
           }
         } else {
@@ -476,7 +499,7 @@ static uint8_t iec_talk_handler(uint8_t cmd) {
             res = iec_putc(buf->data[buf->position], 0);
 
           if (res) {
-            uart_putc('V');
+            trace(TRACE_ERRORS, TRACE_TALKABORT, cmd & 0x0f, 0);
             return 1;
           }
         }
@@ -491,13 +514,19 @@ static uint8_t iec_talk_handler(uint8_t cmd) {
       break;
     }
 
-    if (buf->refill(buf)) {
+    int8_t res = buffer_swap(buf);
+
+    if (res < 0)
+      res = buf->refill(buf);
+
+    if (res) {
       iec_data.bus_state = BUS_CLEANUP;
       return 1;
     }
 
     /* Search the buffer again, it can change when using large buffers */
     buf = find_buffer(cmd & 0x0f);
+    buffer_prefetch(buf);
 
     if (iec_data.iecflags & JIFFY_LOAD) {
       /* wait until the C64 is at FB06, use timeout in case the STOP key is pressed */
@@ -521,6 +550,22 @@ static uint8_t iec_talk_handler(uint8_t cmd) {
   return 0;
 }
 
+/**
+ * iec_talk_handler - handle an incoming TALK request (E909)
+ * @cmd: command byte received from the bus
+ *
+ * This function handles a talk request from the computer.
+ */
+static uint8_t iec_talk_handler(uint8_t cmd) {
+  uint8_t res;
+
+  trace(TRACE_COMMANDS, TRACE_TALK, cmd & 0x0f, 0);
+
+  res = iec_talk_blocks(cmd);
+  buffer_prefetch_wait();
+  return res;
+}
+
 
 
 /* ------------------------------------------------------------------------- */
@@ -551,6 +596,8 @@ void iec_mainloop(void) {
   iec_data.bus_state = BUS_IDLE;
 
   while (1) {
+    trace(TRACE_COMMANDS, TRACE_STATE, iec_data.bus_state, iec_data.device_state);
+
     switch (iec_data.bus_state) {
     case BUS_SLEEP:
       set_atn_irq(0);
@@ -591,6 +638,10 @@ void iec_mainloop(void) {
           display_service();
           reset_key(KEY_DISPLAY);
         }
+#ifdef CONFIG_HAVE_VFS
+        vfs_commit_poll();
+        vfs_p00index_poll();
+#endif
         system_sleep();
       }
 
@@ -603,6 +654,7 @@ void iec_mainloop(void) {
       set_clock(1);
       set_data(0);
       set_atn_irq(0);
+      latency_atn_done();
 
       iec_data.device_state = DEVICE_IDLE;
       iec_data.bus_state    = BUS_ATNACTIVE;
@@ -629,13 +681,11 @@ void iec_mainloop(void) {
 
       if (cmd < 0) {
         /* iec_check_atn changed our state */
-        uart_putc('C');
+        trace(TRACE_COMMANDS, TRACE_ATNABORT, 0, 0);
         break;
       }
 
-      uart_putc('A');
-      uart_puthex(cmd);
-      uart_putcrlf();
+      trace(TRACE_COMMANDS, TRACE_ATN, cmd, 0);
 
       if (cmd == 0x3f) { /* Unlisten */
         if (iec_data.device_state == DEVICE_LISTEN)
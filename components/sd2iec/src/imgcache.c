@@ -0,0 +1,661 @@
+/* sd2iec - SD/MMC to Commodore serial bus interface/controller
+   Copyright (C) 2007-2022  Ingo Korb <ingo@akana.de>
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+   imgcache.c: Whole-image RAM cache for mounted disk images
+
+   A disk image that fits into CONFIG_IMAGE_CACHE_SIZE is read into RAM
+   when it is mounted. The cache then replaces the parent fileops of the
+   partition, so every image_read/image_write is served from memory.
+   Written sectors are tracked in a bitmap and written back to the
+   image file by imgcache_commit, which is called whenever the BAM is
+   committed (end of every bus transaction) and on unmount. With a
+   storage task the write-back of images on the SD card runs in the
+   background while the bus continues.
+
+   With a storage task, images that are likely to be mounted next (the
+   neighbours in a swap list) can be read in the background as well.
+   Mounting such an image then only takes over the data that is
+   already in memory.
+
+*/
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "config.h"
+#include "cbmdirent.h"
+#include "dirlist.h"
+#include "errormsg.h"
+#include "parser.h"
+#include "wrapops.h"
+#include "storage.h"
+#include "vfsops.h"
+#include "imgcache.h"
+
+#ifdef CONFIG_IMAGE_CACHE
+
+/* Largest chunk for a single parent read/write */
+#define CHUNK_SECTORS 128
+
+/* Chunks per vectored read while an image is loaded */
+#define MOUNT_CHUNKS 16
+
+#ifdef CONFIG_STORAGE_TASK
+/* Background writes per image that can be in flight */
+#  define WRITEBACK_REQUESTS 4
+#endif
+
+typedef struct {
+  uint8_t         *data;
+  uint8_t         *dirty;      /* one bit per 256 byte sector */
+  uint32_t         size;
+  uint32_t         position;   /* for offset (DWORD)-1 */
+  uint32_t         dirtycount;
+  const fileops_t *parent;
+#ifdef CONFIG_STORAGE_TASK
+  uint8_t          nextreq;
+  storage_req_t    req[WRITEBACK_REQUESTS];
+#endif
+} imgcache_t;
+
+static imgcache_t imgcache[CONFIG_MAX_PARTITIONS];
+static uint32_t   cache_used;
+
+static const fileops_t imgcacheops;
+
+#ifdef CONFIG_STORAGE_TASK
+/* ------------------------------------------------------------------------- */
+/*  Warm-up                                                                  */
+/* ------------------------------------------------------------------------- */
+
+/* Images that are read ahead of time, next and previous in a swap list */
+#define WARM_SLOTS 2
+
+/**
+ * struct warm_t - an image file that is read in the background
+ * @path : full path of the file, NULL if the slot is unused
+ * @data : contents of the file, valid when req is done
+ * @size : size of the file, counted in cache_used
+ * @mtime: modification time of the file when the read was started
+ * @fd   : file descriptor used by the read
+ * @req  : the background read
+ */
+typedef struct {
+  char          *path;
+  uint8_t       *data;
+  uint32_t       size;
+  time_t         mtime;
+  int            fd;
+  storage_req_t  req;
+} warm_t;
+
+static warm_t  warm[WARM_SLOTS];
+static warm_t *claimed[CONFIG_MAX_PARTITIONS];
+
+/* Finish or abort the read of a slot and release it */
+static void warm_drop(warm_t *w) {
+  if (w->path == NULL)
+    return;
+
+  storage_wait(&w->req);
+  close(w->fd);
+  ext_free(w->data);
+  free(w->path);
+  cache_used -= w->size;
+
+  for (uint8_t i = 0; i < CONFIG_MAX_PARTITIONS; i++)
+    if (claimed[i] == w)
+      claimed[i] = NULL;
+
+  memset(w, 0, sizeof(warm_t));
+}
+
+static warm_t *warm_find(const char *path) {
+  for (uint8_t i = 0; i < WARM_SLOTS; i++)
+    if (warm[i].path != NULL && !strcmp(warm[i].path, path))
+      return &warm[i];
+
+  return NULL;
+}
+
+/* Start reading an image in the background if it fits into the budget */
+static void warm_start(const char *path) {
+  struct stat st;
+  warm_t *w = NULL;
+
+  if (path == NULL || warm_find(path) != NULL)
+    return;
+
+  for (uint8_t i = 0; i < WARM_SLOTS; i++)
+    if (warm[i].path == NULL)
+      w = &warm[i];
+
+  if (w == NULL || stat(path, &st) || !S_ISREG(st.st_mode) ||
+      st.st_size > CONFIG_IMAGE_CACHE_SIZE - cache_used)
+    return;
+
+  w->path = strdup(path);
+  w->data = ext_malloc(st.st_size);
+  w->fd   = open(path, O_RDONLY);
+  if (w->path == NULL || w->data == NULL || w->fd < 0) {
+    if (w->fd >= 0)
+      close(w->fd);
+    ext_free(w->data);
+    free(w->path);
+    memset(w, 0, sizeof(warm_t));
+    return;
+  }
+
+  w->size  = st.st_size;
+  w->mtime = st.st_mtime;
+  cache_used += w->size;
+
+  w->req.op     = STORAGE_READ;
+  w->req.fd     = w->fd;
+  w->req.offset = 0;
+  w->req.data   = w->data;
+  w->req.length = w->size;
+  storage_submit(&w->req);
+}
+
+/* Release all copies that are not claimed by a partition */
+static void warm_release(void) {
+  for (uint8_t i = 0; i < WARM_SLOTS; i++) {
+    bool used = false;
+
+    for (uint8_t j = 0; j < CONFIG_MAX_PARTITIONS; j++)
+      if (claimed[j] == &warm[i])
+        used = true;
+
+    if (!used)
+      warm_drop(&warm[i]);
+  }
+}
+
+/**
+ * imgcache_warm - read images that may be mounted soon
+ * @next: full path of the first image file, may be NULL
+ * @prev: full path of the second image file, may be NULL
+ *
+ * This function starts reading the given image files in the background
+ * if they fit into the cache budget, and releases the copies of all
+ * other files that were read this way.
+ */
+void imgcache_warm(const char *next, const char *prev) {
+  for (uint8_t i = 0; i < WARM_SLOTS; i++) {
+    warm_t *w = &warm[i];
+
+    if (w->path != NULL &&
+        (next == NULL || strcmp(w->path, next)) &&
+        (prev == NULL || strcmp(w->path, prev)))
+      warm_drop(w);
+  }
+
+  warm_start(next);
+  warm_start(prev);
+}
+
+/**
+ * imgcache_claim - use a warm copy for the next mount of a partition
+ * @part: partition number
+ * @path: full path of the image file that is about to be mounted
+ *
+ * If @path was read by imgcache_warm and the file is still unchanged,
+ * the next imgcache_mount of @part takes over its data instead of
+ * reading the image again.
+ */
+void imgcache_claim(uint8_t part, const char *path) {
+  warm_t *w = warm_find(path);
+  struct stat st;
+
+  claimed[part] = NULL;
+  if (w == NULL)
+    return;
+
+  storage_wait(&w->req);
+  if (w->req.result != (int32_t)w->size || stat(path, &st) ||
+      st.st_size != w->size || st.st_mtime != w->mtime) {
+    warm_drop(w);
+    return;
+  }
+
+  claimed[part] = w;
+}
+#endif
+
+/* Mark the sectors in a byte range as dirty */
+static void mark_dirty(imgcache_t *c, uint32_t offset, uint32_t bytes) {
+  for (uint32_t i = offset / 256; i <= (offset + bytes - 1) / 256; i++) {
+    if (!(c->dirty[i / 8] & (1 << (i % 8)))) {
+      c->dirty[i / 8] |= 1 << (i % 8);
+      c->dirtycount++;
+    }
+  }
+}
+
+/* Mark the sectors in a byte range as clean */
+static void mark_clean(imgcache_t *c, uint32_t offset, uint32_t bytes) {
+  for (uint32_t i = offset / 256; i <= (offset + bytes - 1) / 256; i++) {
+    if (c->dirty[i / 8] & (1 << (i % 8))) {
+      c->dirty[i / 8] &= (uint8_t)~(1 << (i % 8));
+      c->dirtycount--;
+    }
+  }
+}
+
+#ifdef CONFIG_STORAGE_TASK
+/**
+ * writeback_reap - wait for a background write and check it
+ * @c  : cache entry
+ * @req: write request of @c
+ *
+ * The sectors of a write stay dirty until it is done and are only
+ * marked clean if it was successful, so the next commit retries them
+ * otherwise. Returns 0 if the write was successful (or there was
+ * none), 1 otherwise.
+ */
+static uint8_t writeback_reap(imgcache_t *c, storage_req_t *req) {
+  uint8_t res = 0;
+
+  storage_wait(req);
+  if (req->length != 0) {
+    if (req->result == (int32_t)req->length)
+      mark_clean(c, req->offset, req->length);
+    else
+      res = 1;
+  }
+
+  req->length = 0;
+  return res;
+}
+
+/* Wait for all background writes of a cache entry */
+static uint8_t writeback_drain(imgcache_t *c) {
+  uint8_t res = 0;
+
+  for (uint8_t i = 0; i < WRITEBACK_REQUESTS; i++)
+    res |= writeback_reap(c, &c->req[i]);
+
+  return res;
+}
+#endif
+
+/* Release the memory of a cache entry and restore the parent fileops */
+static void cache_free(uint8_t part) {
+  imgcache_t *c = &imgcache[part];
+
+  if (c->data == NULL)
+    return;
+
+  /* writeback reaps its writes before it returns, none is in flight */
+  partition[part].parent_fop = c->parent;
+  cache_used -= c->size;
+  ext_free(c->data);
+  free(c->dirty);
+  memset(c, 0, sizeof(imgcache_t));
+}
+
+/**
+ * writeback - write dirty sectors of a partition to the image file
+ * @part: partition number
+ *
+ * This function writes all dirty sectors of the cache for @part
+ * to the image file using the parent fileops, combining runs of
+ * consecutive dirty sectors into one write. Writes to a card image
+ * run in the background, but all of them are done when this function
+ * returns. Sectors that could not be written stay dirty. Returns 0 if
+ * successful, != 0 otherwise.
+ */
+static uint8_t writeback(uint8_t part) {
+  imgcache_t *c = &imgcache[part];
+  uint32_t sectors = (c->size + 255) / 256;
+  uint32_t first, last;
+  uint8_t res = 0;
+
+  if (c->dirtycount == 0)
+    return 0;
+
+  first = 0;
+  while (first < sectors) {
+    if (!(c->dirty[first / 8] & (1 << (first % 8)))) {
+      first++;
+      continue;
+    }
+
+    last = first;
+    while (last + 1 < sectors && last + 1 - first < CHUNK_SECTORS &&
+           (c->dirty[(last+1) / 8] & (1 << ((last+1) % 8))))
+      last++;
+
+    uint32_t offset = first * 256;
+    uint32_t bytes  = (last + 1) * 256;
+    if (bytes > c->size)
+      bytes = c->size;
+    bytes -= offset;
+
+#ifdef CONFIG_STORAGE_TASK
+    if (c->parent == &vfsops) {
+      /* Write in the background, directly from the cache */
+      storage_req_t *req = &c->req[c->nextreq];
+
+      c->nextreq = (c->nextreq + 1) % WRITEBACK_REQUESTS;
+      res |= writeback_reap(c, req);
+
+      req->op     = STORAGE_WRITE;
+      req->fd     = partition[part].imagefd;
+      req->offset = offset;
+      req->data   = c->data + offset;
+      req->length = bytes;
+      storage_submit(req);
+    } else
+#endif
+    if ((pgmcall(c->parent->image_write))(part, offset, c->data + offset, bytes, 0))
+      res = 1;
+    else
+      mark_clean(c, offset, bytes);
+
+    first = last + 1;
+  }
+
+#ifdef CONFIG_STORAGE_TASK
+  res |= writeback_drain(c);
+#endif
+
+  /* Flush once after all sectors are written */
+  if (!res)
+    res = (pgmcall(c->parent->image_write))(part, (DWORD)-1, c->data, 0, 1);
+
+  return res;
+}
+
+/**
+ * imgcache_mount - read a mounted image into memory
+ * @part: partition number
+ * @size: size of the image file
+ *
+ * This function reads the whole image on partition @part into memory
+ * if it fits into the remaining cache budget and redirects the image
+ * accesses of the partition to the cache. If the image does not fit
+ * or memory is short it is silently left uncached. Returns 0 if
+ * successful (cached or not), != 0 if the image could not be read.
+ */
+uint8_t imgcache_mount(uint8_t part, uint32_t size) {
+  imgcache_t *c = &imgcache[part];
+  uint32_t offset;
+
+  cache_free(part);
+
+#ifdef CONFIG_STORAGE_TASK
+  warm_t *w = claimed[part];
+
+  if (w != NULL && w->size == size) {
+    /* Take over the data that was read in the background */
+    c->dirty = calloc((size / 256 + 8) / 8, 1);
+    if (c->dirty != NULL) {
+      c->data = w->data;
+      close(w->fd);
+      free(w->path);
+      cache_used -= size;
+      memset(w, 0, sizeof(warm_t));
+      claimed[part] = NULL;
+      goto done;
+    }
+  }
+
+  claimed[part] = NULL;
+  if (size > CONFIG_IMAGE_CACHE_SIZE - cache_used)
+    warm_release();
+#endif
+
+  if (size > CONFIG_IMAGE_CACHE_SIZE - cache_used)
+    return 0;
+
+  c->data = ext_malloc(size);
+  if (c->data == NULL)
+    return 0;
+
+  c->dirty = calloc((size / 256 + 8) / 8, 1);
+  if (c->dirty == NULL) {
+    ext_free(c->data);
+    c->data = NULL;
+    return 0;
+  }
+
+  /* Read chunks the parent can handle in batches. The chunks are
+     adjacent, so the parent may merge each batch into one read. */
+  for (offset = 0; offset < size; ) {
+    image_iov_t iov[MOUNT_CHUNKS];
+    uint8_t count = 0;
+
+    while (count < MOUNT_CHUNKS && offset < size) {
+      uint32_t bytes = size - offset;
+
+      if (bytes > CHUNK_SECTORS * 256)
+        bytes = CHUNK_SECTORS * 256;
+
+      iov[count].offset = offset;
+      iov[count].buffer = c->data + offset;
+      iov[count].bytes  = bytes;
+      offset += bytes;
+      count++;
+    }
+
+    if (image_readv(part, iov, count)) {
+      ext_free(c->data);
+      free(c->dirty);
+      memset(c, 0, sizeof(imgcache_t));
+      return 1;
+    }
+  }
+
+#ifdef CONFIG_STORAGE_TASK
+ done:
+#endif
+  c->size   = size;
+  c->parent = partition[part].parent_fop;
+  partition[part].parent_fop = &imgcacheops;
+  cache_used += size;
+
+  return 0;
+}
+
+/**
+ * imgcache_unmount - write back and release the cache of a partition
+ * @part: partition number
+ *
+ * This function must be called before the image file is closed.
+ * The cache is released even if the write-back failed. Returns 0 if
+ * successful, != 0 otherwise.
+ */
+uint8_t imgcache_unmount(uint8_t part) {
+  uint8_t res;
+
+  if (imgcache[part].data == NULL)
+    return 0;
+
+  res = writeback(part);
+  cache_free(part);
+  return res;
+}
+
+/**
+ * imgcache_commit - write back all dirty sectors
+ *
+ * This function writes the dirty sectors of all cached images back
+ * to their image files. Returns 0 if successful, != 0 otherwise.
+ */
+uint8_t imgcache_commit(void) {
+  uint8_t res = 0;
+
+  for (uint8_t i = 0; i < CONFIG_MAX_PARTITIONS; i++)
+    if (imgcache[i].data != NULL)
+      res |= writeback(i);
+
+  return res;
+}
+
+/**
+ * imgcache_invalidate - drop all cached images
+ *
+ * This function releases all caches without writing them back,
+ * used when the card was changed.
+ */
+void imgcache_invalidate(void) {
+  for (uint8_t i = 0; i < CONFIG_MAX_PARTITIONS; i++)
+    cache_free(i);
+
+#ifdef CONFIG_STORAGE_TASK
+  for (uint8_t i = 0; i < WARM_SLOTS; i++)
+    warm_drop(&warm[i]);
+#endif
+}
+
+/* ------------------------------------------------------------------------- */
+/*  fileops-API                                                              */
+/* ------------------------------------------------------------------------- */
+
+static uint8_t imgcache_image_unmount(uint8_t part) {
+  return (pgmcall(imgcache[part].parent->image_unmount))(part);
+}
+
+/**
+ * imgcache_read - read data from the cached image
+ * @part  : partition number
+ * @offset: offset to read from, (DWORD)-1 to continue after the last access
+ * @buffer: pointer to where the data should be read to
+ * @bytes : number of bytes to read
+ *
+ * Returns 0 on success, 1 if less than bytes byte could be read.
+ */
+static uint8_t imgcache_read(uint8_t part, DWORD offset, void *buffer, uint16_t bytes) {
+  imgcache_t *c = &imgcache[part];
+  uint8_t res = 0;
+
+  if (offset == (DWORD)-1)
+    offset = c->position;
+
+  if (offset >= c->size) {
+    bytes = 0;
+    res = 1;
+  } else if (offset + bytes > c->size) {
+    bytes = c->size - offset;
+    res = 1;
+  }
+
+  memcpy(buffer, c->data + offset, bytes);
+  c->position = offset + bytes;
+  return res;
+}
+
+/**
+ * imgcache_write - write data to the cached image
+ * @part  : partition number
+ * @offset: offset to write to, (DWORD)-1 to continue after the last access
+ * @buffer: pointer to the data to be written
+ * @bytes : number of bytes to write
+ * @flush : ignored, data is written back on commit
+ *
+ * Returns 0 on success, 1 if less than bytes byte could be written.
+ */
+static uint8_t imgcache_write(uint8_t part, DWORD offset, void *buffer, uint16_t bytes, uint8_t flush) {
+  imgcache_t *c = &imgcache[part];
+  uint8_t res = 0;
+
+  (void)flush;
+
+  /* Let the parent report the error for read-only images */
+  if (partition[part].flag & FLAG_RO)
+    return (pgmcall(c->parent->image_write))(part, offset, buffer, bytes, flush);
+
+  dirlist_invalidate();
+
+  if (offset == (DWORD)-1)
+    offset = c->position;
+
+  if (offset >= c->size) {
+    bytes = 0;
+    res = 1;
+  } else if (offset + bytes > c->size) {
+    bytes = c->size - offset;
+    res = 1;
+  }
+
+  memcpy(c->data + offset, buffer, bytes);
+  c->position = offset + bytes;
+
+  if (bytes)
+    mark_dirty(c, offset, bytes);
+
+  return res;
+}
+
+/**
+ * imgcache_readv - read several parts of the cached image
+ * @part : partition number
+ * @iov  : array of parts to read
+ * @count: number of parts
+ *
+ * Returns 0 on success, 1 if a part could not be read completely.
+ */
+static uint8_t imgcache_readv(uint8_t part, image_iov_t *iov, uint8_t count) {
+  uint8_t res = 0;
+
+  for (uint8_t i = 0; i < count; i++)
+    res |= imgcache_read(part, iov[i].offset, iov[i].buffer, iov[i].bytes);
+
+  return res;
+}
+
+/**
+ * imgcache_writev - write several parts of the cached image
+ * @part : partition number
+ * @iov  : array of parts to write
+ * @count: number of parts
+ * @flush: ignored, data is written back on commit
+ *
+ * Returns 0 on success, 1 if a part could not be written completely.
+ */
+static uint8_t imgcache_writev(uint8_t part, image_iov_t *iov, uint8_t count, uint8_t flush) {
+  imgcache_t *c = &imgcache[part];
+  uint8_t res = 0;
+
+  /* Let the parent report the error for read-only images */
+  if (partition[part].flag & FLAG_RO)
+    return (pgmcall(c->parent->image_writev))(part, iov, count, flush);
+
+  for (uint8_t i = 0; i < count; i++)
+    res |= imgcache_write(part, iov[i].offset, iov[i].buffer, iov[i].bytes, flush);
+
+  return res;
+}
+
+static const fileops_t imgcacheops = {
+  .image_unmount = imgcache_image_unmount,
+  .image_read    = imgcache_read,
+  .image_write   = imgcache_write,
+  .image_readv   = imgcache_readv,
+  .image_writev  = imgcache_writev,
+};
+
+#endif
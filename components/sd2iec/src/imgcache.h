@@ -0,0 +1,62 @@
+/* sd2iec - SD/MMC to Commodore serial bus interface/controller
+   Copyright (C) 2007-2022  Ingo Korb <ingo@akana.de>
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+   imgcache.h: Whole-image RAM cache for mounted disk images
+
+*/
+
+#ifndef IMGCACHE_H
+#define IMGCACHE_H
+
+#include <stdint.h>
+
+#ifdef CONFIG_IMAGE_CACHE
+
+uint8_t imgcache_mount(uint8_t part, uint32_t size);
+uint8_t imgcache_unmount(uint8_t part);
+uint8_t imgcache_commit(void);
+void    imgcache_invalidate(void);
+
+#else
+
+#  define imgcache_mount(p,s)  0
+static inline uint8_t imgcache_unmount(uint8_t part) {
+  (void)part;
+  return 0;
+}
+#  define imgcache_commit()    0
+#  define imgcache_invalidate() do {} while (0)
+
+#endif
+
+#if defined(CONFIG_IMAGE_CACHE) && defined(CONFIG_STORAGE_TASK)
+
+void    imgcache_warm(const char *next, const char *prev);
+void    imgcache_claim(uint8_t part, const char *path);
+
+#else
+
+#  define imgcache_warm(n,p)   do {} while (0)
+#  define imgcache_claim(p,n)  do {} while (0)
+
+#endif
+
+#endif
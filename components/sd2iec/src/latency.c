@@ -0,0 +1,125 @@
+/* sd2iec - SD/MMC to Commodore serial bus interface/controller
+   Copyright (C) 2007-2022  Ingo Korb <ingo@akana.de>
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+   latency.c: Latency histograms of bus and storage operations
+
+   Every measured operation takes two timestamps from the trace clock
+   and increments one of 16 power-of-two buckets, so the histograms can
+   stay enabled on production builds. A measurement must start and end
+   on the same core because the cores have separate cycle counters,
+   refills run by the storage task are timed there.
+
+*/
+
+#include <string.h>
+#include "config.h"
+#include "latency.h"
+
+#ifdef CONFIG_LATENCY_STATS
+
+latency_hist_t latency_hist[LAT_OPS];
+volatile uint32_t latency_atn_ticks;
+volatile uint8_t  latency_atn_pending;
+
+/**
+ * latency_record - add a measurement to a histogram
+ * @op   : measured operation
+ * @start: value returned by latency_start() before the operation
+ */
+TRACE_ATTRIB
+void latency_record(latency_op_t op, uint32_t start) {
+  uint32_t us = (trace_ticks() - start) / TRACE_TICKS_PER_US;
+  uint8_t bucket;
+
+  if (us == 0)
+    bucket = 0;
+  else
+    bucket = 31 - __builtin_clz(us);
+  if (bucket >= LATENCY_BUCKETS)
+    bucket = LATENCY_BUCKETS - 1;
+
+  __atomic_fetch_add(&latency_hist[op].count[bucket], 1, __ATOMIC_RELAXED);
+  if (us > latency_hist[op].max)
+    latency_hist[op].max = us;
+}
+
+/**
+ * latency_clear - clear all histograms
+ */
+void latency_clear(void) {
+  memset(latency_hist, 0, sizeof(latency_hist));
+}
+
+/**
+ * latency_samples - return the number of measurements of an operation
+ * @op: operation
+ */
+uint32_t latency_samples(latency_op_t op) {
+  uint32_t sum = 0;
+  uint8_t i;
+
+  for (i = 0; i < LATENCY_BUCKETS; i++)
+    sum += latency_hist[op].count[i];
+  return sum;
+}
+
+/**
+ * latency_percentile - estimate a percentile of an operation
+ * @op     : operation
+ * @percent: percentile
+ *
+ * This function returns the upper bound in microseconds of the bucket
+ * that contains the requested percentile, or the longest latency seen
+ * if that is lower. Returns 0 if there are no measurements.
+ */
+uint32_t latency_percentile(latency_op_t op, uint8_t percent) {
+  uint32_t total = latency_samples(op);
+  uint32_t limit = (uint64_t)total * percent / 100;
+  uint32_t sum = 0;
+  uint8_t i;
+
+  if (total == 0)
+    return 0;
+
+  for (i = 0; i < LATENCY_BUCKETS - 1; i++) {
+    sum += latency_hist[op].count[i];
+    if (sum > limit || sum == total)
+      break;
+  }
+
+  if (i == LATENCY_BUCKETS - 1 || latency_hist[op].max < (2UL << i))
+    return latency_hist[op].max;
+  return 2UL << i;
+}
+
+static const char * const latency_names[LAT_OPS] = {
+  "", "ATN", "PUTC", "D64READ", "VFSREAD", "DIRECT", "OPEN", "IMGREAD"
+};
+
+/**
+ * latency_name - return the name of an operation
+ * @op: operation
+ */
+const char *latency_name(latency_op_t op) {
+  return latency_names[op];
+}
+
+#endif
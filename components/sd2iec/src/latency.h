@@ -0,0 +1,93 @@
+/* sd2iec - SD/MMC to Commodore serial bus interface/controller
+   Copyright (C) 2007-2022  Ingo Korb <ingo@akana.de>
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+   latency.h: Latency histograms of bus and storage operations
+
+*/
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+#include "timer.h"
+
+/* Measured operations, numbered from 1 for the XL command */
+typedef enum {
+  LAT_ATN = 1,   /* ATN interrupt until the bus loop answers      */
+  LAT_PUTC,      /* a byte sent with iec_putc                     */
+  LAT_D64READ,   /* block refill from a disk image                */
+  LAT_VFSREAD,   /* block refill from a file                      */
+  LAT_DIRECT,    /* direct access buffer refill                   */
+  LAT_OPEN,      /* file_open                                     */
+  LAT_IMGREAD,   /* image_read from the card                      */
+  LAT_OPS
+} latency_op_t;
+
+/* Bucket n counts latencies below 2^(n+1) microseconds, the last one
+   counts everything above */
+#define LATENCY_BUCKETS 16
+
+typedef struct {
+  uint32_t count[LATENCY_BUCKETS];
+  uint32_t max;                    /* longest latency in microseconds */
+} latency_hist_t;
+
+#ifdef CONFIG_LATENCY_STATS
+
+extern latency_hist_t latency_hist[LAT_OPS];
+
+void latency_record(latency_op_t op, uint32_t start);
+void latency_clear(void);
+uint32_t latency_samples(latency_op_t op);
+uint32_t latency_percentile(latency_op_t op, uint8_t percent);
+const char *latency_name(latency_op_t op);
+
+/* Start of a measurement, pass the result to latency_record */
+static inline uint32_t latency_start(void) {
+  return trace_ticks();
+}
+
+/* ATN is timed from the interrupt until the bus loop reaches BUS_FOUNDATN */
+extern volatile uint32_t latency_atn_ticks;
+extern volatile uint8_t  latency_atn_pending;
+
+static inline void latency_atn(void) {
+  latency_atn_ticks   = trace_ticks();
+  latency_atn_pending = 1;
+}
+
+static inline void latency_atn_done(void) {
+  if (latency_atn_pending) {
+    latency_atn_pending = 0;
+    latency_record(LAT_ATN, latency_atn_ticks);
+  }
+}
+
+#else
+
+#  define latency_start()      0
+#  define latency_record(o,s)  do { (void)(s); } while (0)
+#  define latency_atn()        do {} while (0)
+#  define latency_atn_done()   do {} while (0)
+
+#endif
+
+#endif
@@ -43,8 +43,10 @@
 #include "time.h"
 #include "rtc.h"
 #include "spi.h"
+#include "storage.h"
 #include "system.h"
 #include "timer.h"
+#include "trace.h"
 #include "uart.h"
 #include "ustring.h"
 #include "utils.h"
@@ -77,7 +79,6 @@ int main(void) {
   enable_interrupts();
 
   /* Internal-only initialisation, called here because it's faster */
-  buffers_init();
   buttons_init();
 
   /* Anything that does something which needs the system clock */
@@ -85,7 +86,10 @@ int main(void) {
   bus_init();    // needs delay
   rtc_init();    // accesses I2C
   disk_init();   // accesses card
+  storage_init();
+  trace_init();
   read_configuration();
+  buffers_init(); // pool size is part of the configuration
 
   filesystem_init(0);
   change_init();
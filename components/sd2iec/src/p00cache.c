@@ -23,6 +23,7 @@
 
 */
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <string.h>
 #include <stdio.h>
@@ -32,50 +33,312 @@
 
 #include "uart.h"
 
+#ifdef CONFIG_P00CACHE
+
+/*
+ * Names are found through a hash table keyed by partition, directory
+ * and file. The callers derive the directory and file keys from
+ * whatever identifies a file on their medium: FAT passes the start
+ * cluster, VFS a CRC of the path and the size and date of the file,
+ * so a file that was changed on the PC is not found anymore. All
+ * entries share one pool and the least recently used one is replaced
+ * when it is full, independent of the partition.
+ */
+
+#define P00_NONE 0xffff
+
 typedef struct {
-  uint32_t cluster;
+  uint32_t dir;
+  uint32_t file;
+  uint16_t hnext;          /* next entry in the same hash bucket */
+  uint16_t newer;          /* neighbours in the LRU list         */
+  uint16_t older;
+  uint8_t  part;
   uint8_t  name[CBM_NAME_LENGTH];
 } p00name_t;
 
-static P00CACHE_ATTRIB p00name_t p00cache[CONFIG_P00CACHE_SIZE / sizeof(p00name_t)];
-static uint8_t      cache_part;
-static unsigned int entries;
+static p00name_t *p00cache;
+static uint16_t  *buckets;
+static uint16_t   bucketmask;
+static uint16_t   capacity;
+static uint16_t   entries;
+static uint16_t   newest, oldest;
 
-void p00cache_invalidate(void) {
-  cache_part = -1;
-  entries    = 0;
+/* Allocate the pool on first use */
+static bool p00cache_setup(void) {
+  unsigned int count, nbuckets;
+
+  if (p00cache != NULL)
+    return true;
+
+  count = CONFIG_P00CACHE_SIZE / (sizeof(p00name_t) + sizeof(uint16_t));
+  if (count >= P00_NONE)
+    count = P00_NONE - 1;
+
+  /* one bucket per one or two entries */
+  nbuckets = 1;
+  while (2 * nbuckets <= count)
+    nbuckets *= 2;
+
+  p00cache = ext_malloc(count * sizeof(p00name_t) +
+                        nbuckets * sizeof(uint16_t));
+  if (p00cache == NULL)
+    return false;
+
+  buckets    = (uint16_t *)(p00cache + count);
+  bucketmask = nbuckets - 1;
+  capacity   = count;
+  p00cache_invalidate();
+  return true;
 }
 
-uint8_t *p00cache_lookup(uint8_t part, uint32_t cluster) {
-  /* fail if it's for a different partition */
-  if (part != cache_part)
-    return NULL;
+static uint16_t p00cache_hash(uint8_t part, uint32_t dir, uint32_t file) {
+  return (file ^ (dir * 2654435761U) ^ part) & bucketmask;
+}
+
+/* Remove an entry from the LRU list */
+static void lru_unlink(uint16_t i) {
+  if (p00cache[i].newer != P00_NONE)
+    p00cache[p00cache[i].newer].older = p00cache[i].older;
+  else
+    newest = p00cache[i].older;
+
+  if (p00cache[i].older != P00_NONE)
+    p00cache[p00cache[i].older].newer = p00cache[i].newer;
+  else
+    oldest = p00cache[i].newer;
+}
+
+/* Insert an entry as most recently used */
+static void lru_push(uint16_t i) {
+  p00cache[i].newer = P00_NONE;
+  p00cache[i].older = newest;
+  if (newest != P00_NONE)
+    p00cache[newest].newer = i;
+  else
+    oldest = i;
+  newest = i;
+}
+
+static uint16_t p00cache_find(uint8_t part, uint32_t dir, uint32_t file) {
+  uint16_t i = buckets[p00cache_hash(part, dir, file)];
 
-  /* linear search for the correct cluster number */
-  /* (binary search was only 6-8% faster overall) */
-  for (unsigned int i=0; i<entries; i++) {
-    if (p00cache[i].cluster == cluster)
-      return p00cache[i].name;
+  while (i != P00_NONE) {
+    if (p00cache[i].file == file && p00cache[i].dir == dir &&
+        p00cache[i].part == part)
+      break;
+    i = p00cache[i].hnext;
   }
 
-  /* noting found */
-  return NULL;
+  return i;
+}
+
+/* Add or update an entry, returns false if nothing was changed */
+static bool p00cache_store(uint8_t part, uint32_t dir, uint32_t file,
+                           uint8_t *name) {
+  uint16_t i;
+
+  if (!p00cache_setup())
+    return false;
+
+  i = p00cache_find(part, dir, file);
+  if (i != P00_NONE) {
+    lru_unlink(i);
+    lru_push(i);
+    if (!memcmp(p00cache[i].name, name, CBM_NAME_LENGTH))
+      return false;
+
+    memcpy(p00cache[i].name, name, CBM_NAME_LENGTH);
+    return true;
+  }
+
+  if (entries < capacity) {
+    i = entries++;
+  } else {
+    /* replace the least recently used entry */
+    uint16_t *ptr;
+
+    i = oldest;
+    lru_unlink(i);
+    ptr = &buckets[p00cache_hash(p00cache[i].part, p00cache[i].dir,
+                                 p00cache[i].file)];
+    while (*ptr != i)
+      ptr = &p00cache[*ptr].hnext;
+    *ptr = p00cache[i].hnext;
+  }
+
+  p00cache[i].part = part;
+  p00cache[i].dir  = dir;
+  p00cache[i].file = file;
+  memcpy(p00cache[i].name, name, CBM_NAME_LENGTH);
+
+  uint16_t bucket = p00cache_hash(part, dir, file);
+  p00cache[i].hnext = buckets[bucket];
+  buckets[bucket] = i;
+  lru_push(i);
+  return true;
+}
+
+#ifdef CONFIG_P00CACHE_INDEX
+/* ------------------------------------------------------------------------- */
+/*  Index files                                                              */
+/* ------------------------------------------------------------------------- */
+
+/* Number of directories whose index file state is tracked */
+#define P00DIRS 8
+
+static const char index_magic[4] = { 'P', '0', '0', 'N' };
+
+typedef struct {
+  uint32_t file;
+  uint8_t  name[CBM_NAME_LENGTH];
+} p00record_t;
+
+static struct {
+  uint32_t dir;
+  uint8_t  part;
+  uint8_t  used:1;
+  uint8_t  dirty:1;
+} p00dirs[P00DIRS];
+static uint8_t p00dirs_next;
+
+static int8_t p00dirs_find(uint8_t part, uint32_t dir) {
+  for (uint8_t i=0; i<P00DIRS; i++)
+    if (p00dirs[i].used && p00dirs[i].dir == dir && p00dirs[i].part == part)
+      return i;
+  return -1;
 }
 
-void p00cache_add(uint8_t part, uint32_t cluster, uint8_t *name) {
-  /* don't add if the cache is full */
-  if (entries == sizeof(p00cache)/sizeof(p00cache[0]))
+/**
+ * p00cache_load - read the index file of a directory
+ * @part   : partition of the directory
+ * @dir    : directory key as used for p00cache_lookup
+ * @dirpath: full path of the directory with a trailing slash
+ *
+ * This function adds the names stored in the index file of a directory
+ * to the cache, unless it was already done since the last invalidate.
+ */
+void p00cache_load(uint8_t part, uint32_t dir, const char *dirpath) {
+  char        buffer[512]; // FIXME
+  char        magic[sizeof(index_magic)];
+  p00record_t rec;
+  FILE       *fp;
+  uint8_t     slot;
+
+  if (p00dirs_find(part, dir) >= 0 || !p00cache_setup())
     return;
 
-  /* invalidate if it's for a different partition */
-  // FIXME: ignore instead and add invalidate to CP?
-  if (part != cache_part) {
-    p00cache_invalidate();
-    cache_part = part;
+  slot = p00dirs_next;
+  p00dirs_next = (p00dirs_next + 1) % P00DIRS;
+  p00dirs[slot].part  = part;
+  p00dirs[slot].dir   = dir;
+  p00dirs[slot].used  = 1;
+  p00dirs[slot].dirty = 0;
+
+  snprintf(buffer, sizeof(buffer), "%s%s", dirpath, P00CACHE_INDEX_NAME);
+  fp = fopen(buffer, "rb");
+  if (fp == NULL)
+    return;
+
+  if (fread(magic, sizeof(magic), 1, fp) == 1 &&
+      !memcmp(magic, index_magic, sizeof(magic))) {
+    while (fread(&rec, sizeof(rec), 1, fp) == 1)
+      p00cache_store(part, dir, rec.file, rec.name);
   }
 
-  /* add entry at end of list */
-  p00cache[entries].cluster = cluster;
-  memcpy(p00cache[entries].name, name, CBM_NAME_LENGTH);
-  entries++;
+  fclose(fp);
+}
+
+/**
+ * p00cache_save - write the index file of a directory
+ * @part   : partition of the directory
+ * @dir    : directory key as used for p00cache_lookup
+ * @dirpath: full path of the directory with a trailing slash
+ *
+ * This function writes all cached names of a directory to its index
+ * file if names were added since it was loaded. It should be called
+ * some time after the whole directory was read, so the file is written
+ * once per listing and not for every new name. A failed write is not
+ * retried, e.g. the card may be read-only. Returns true if the file
+ * was written.
+ */
+bool p00cache_save(uint8_t part, uint32_t dir, const char *dirpath) {
+  char        buffer[512]; // FIXME
+  p00record_t rec;
+  FILE       *fp;
+  bool        ok;
+  int8_t      slot = p00dirs_find(part, dir);
+
+  if (slot < 0 || !p00dirs[slot].dirty)
+    return false;
+
+  p00dirs[slot].dirty = 0;
+
+  snprintf(buffer, sizeof(buffer), "%s%s", dirpath, P00CACHE_INDEX_NAME);
+  fp = fopen(buffer, "wb");
+  if (fp == NULL)
+    return false;
+
+  ok = fwrite(index_magic, sizeof(index_magic), 1, fp) == 1;
+  for (uint16_t i=newest; ok && i != P00_NONE; i = p00cache[i].older) {
+    if (p00cache[i].part != part || p00cache[i].dir != dir)
+      continue;
+
+    rec.file = p00cache[i].file;
+    memcpy(rec.name, p00cache[i].name, CBM_NAME_LENGTH);
+    ok = fwrite(&rec, sizeof(rec), 1, fp) == 1;
+  }
+
+  if (fclose(fp))
+    ok = false;
+
+  /* a truncated file would lose the names it did not get to */
+  if (!ok)
+    remove(buffer);
+
+  return ok;
+}
+#endif
+
+/* ------------------------------------------------------------------------- */
+/*  External interface                                                       */
+/* ------------------------------------------------------------------------- */
+
+void p00cache_invalidate(void) {
+  entries = 0;
+  newest  = P00_NONE;
+  oldest  = P00_NONE;
+  if (p00cache != NULL)
+    memset(buckets, 0xff, (bucketmask + 1) * sizeof(uint16_t));
+#ifdef CONFIG_P00CACHE_INDEX
+  memset(p00dirs, 0, sizeof(p00dirs));
+#endif
 }
+
+uint8_t *p00cache_lookup(uint8_t part, uint32_t dir, uint32_t file) {
+  uint16_t i;
+
+  if (p00cache == NULL)
+    return NULL;
+
+  i = p00cache_find(part, dir, file);
+  if (i == P00_NONE)
+    return NULL;
+
+  lru_unlink(i);
+  lru_push(i);
+  return p00cache[i].name;
+}
+
+void p00cache_add(uint8_t part, uint32_t dir, uint32_t file, uint8_t *name) {
+  if (!p00cache_store(part, dir, file, name))
+    return;
+
+#ifdef CONFIG_P00CACHE_INDEX
+  int8_t slot = p00dirs_find(part, dir);
+  if (slot >= 0)
+    p00dirs[slot].dirty = 1;
+#endif
+}
+
+#endif
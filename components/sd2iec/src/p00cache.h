@@ -26,19 +26,35 @@
 #ifndef P00CACHE_H
 #define P00CACHE_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
+/* Name of the per-directory index file, hidden because of the dot */
+#define P00CACHE_INDEX_NAME ".p00names"
+
 #ifdef CONFIG_P00CACHE
 
 void     p00cache_invalidate(void);
-uint8_t *p00cache_lookup(uint8_t part, uint32_t cluster);
-void     p00cache_add(uint8_t part, uint32_t cluster, uint8_t *name);
+uint8_t *p00cache_lookup(uint8_t part, uint32_t dir, uint32_t file);
+void     p00cache_add(uint8_t part, uint32_t dir, uint32_t file, uint8_t *name);
+
+#else
+
+#  define p00cache_invalidate()     do {} while (0)
+#  define p00cache_lookup(p,d,f)    ((void)(d), (void)(f), NULL)
+#  define p00cache_add(p,d,f,n)     do { (void)(d); (void)(f); } while (0)
+
+#endif
+
+#if defined(CONFIG_P00CACHE) && defined(CONFIG_P00CACHE_INDEX)
+
+void p00cache_load(uint8_t part, uint32_t dir, const char *dirpath);
+bool p00cache_save(uint8_t part, uint32_t dir, const char *dirpath);
 
 #else
 
-#  define p00cache_invalidate() do {} while (0)
-#  define p00cache_lookup(p,c)  NULL
-#  define p00cache_add(p,c,n)   do {} while (0)
+#  define p00cache_load(p,d,n) do {} while (0)
+#  define p00cache_save(p,d,n) false
 
 #endif
 
@@ -49,6 +49,9 @@ uint8_t dir_changed;
 /* Updates current_dir in the partition array and sends */
 /* the new dir to the display.                          */
 void update_current_dir(path_t *path){
+#ifdef CONFIG_HAVE_VFS
+  pathtab_assign(&partition[path->part].current_dir.path, path->dir.path);
+#endif
   partition[path->part].current_dir = path->dir;
   dir_changed = 1;
 
@@ -213,6 +216,11 @@ int8_t next_match(dh_t *dh, uint8_t *matchstr, date_t *start, date_t *end, uint8
   int8_t res;
 
   while (1) {
+    /* let the directory index of disk images skip non-matching entries */
+    if (matchstr && partition[dh->part].fop == &d64ops &&
+        d64_skip_to_match(dh, matchstr))
+      return -1;
+
     res = w_readdir(dh, dent);
     if (res == 0) {
       /* Skip if the type doesn't match */
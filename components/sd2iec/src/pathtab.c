@@ -0,0 +1,177 @@
+/* sd2iec - SD/MMC to Commodore serial bus interface/controller
+   Copyright (C) 2007-2022  Ingo Korb <ingo@akana.de>
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+   pathtab.c: Table of interned directory names
+
+   Directories on the card are referenced by a small handle instead of
+   their name, so path_t and dh_t stay small and can be copied freely.
+   Every name is stored once. Copies that live longer than a command
+   (current directories, the swap list directory, the previous file,
+   directory snapshots) hold a reference; all other copies are weak.
+   A slot whose name is not held by anyone is reused for a new name
+   when the table is full, least recently used first. Its generation
+   changes then, so a weak handle to the old name resolves to NULL
+   instead of a wrong directory.
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+#include "pathtab.h"
+
+#define PATHTAB_SLOTS    32    /* must be below 64 */
+#define PATHTAB_SLOTBITS 6
+#define PATHTAB_SLOTMASK ((1 << PATHTAB_SLOTBITS) - 1)
+#define PATHTAB_MAXGEN   (0xffff >> PATHTAB_SLOTBITS)
+
+typedef struct {
+  char     *name;     /* directory relative to the partition, NULL if free */
+  uint32_t  hash;     /* hash of name                                      */
+  uint32_t  lastuse;  /* pathtab_clock value of the last lookup            */
+  uint16_t  gen;      /* generation, 1..PATHTAB_MAXGEN                      */
+  uint16_t  refs;     /* number of held copies                             */
+} pathtab_entry_t;
+
+static pathtab_entry_t pathtab[PATHTAB_SLOTS];
+static uint32_t pathtab_clock;
+
+/* FNV-1a, only used to skip most string compares */
+static uint32_t pathtab_hash(const char *name) {
+  uint32_t hash = 2166136261UL;
+
+  while (*name)
+    hash = (hash ^ (uint8_t)*name++) * 16777619UL;
+  return hash;
+}
+
+/* Returns the entry of a handle or NULL if the handle is stale */
+static pathtab_entry_t *pathtab_entry(pathref_t ref) {
+  pathtab_entry_t *entry;
+
+  if (ref == PATHREF_ROOT || (ref & PATHTAB_SLOTMASK) >= PATHTAB_SLOTS)
+    return NULL;
+
+  entry = &pathtab[ref & PATHTAB_SLOTMASK];
+  if (entry->name == NULL || entry->gen != ref >> PATHTAB_SLOTBITS)
+    return NULL;
+  return entry;
+}
+
+/**
+ * pathtab_intern - return the handle of a directory name
+ * @name: directory name relative to the partition, "" for the root
+ *
+ * This function returns the handle of @name, adding it to the table
+ * if it is not there yet. The handle is not held. Returns
+ * PATHREF_INVALID if the table is full or there is no memory left.
+ */
+pathref_t pathtab_intern(const char *name) {
+  pathtab_entry_t *victim = NULL;
+  uint32_t hash;
+  uint8_t i;
+
+  if (*name == 0)
+    return PATHREF_ROOT;
+
+  hash = pathtab_hash(name);
+  for (i = 1; i < PATHTAB_SLOTS; i++) {
+    pathtab_entry_t *entry = &pathtab[i];
+
+    if (entry->name == NULL) {
+      if (victim == NULL || victim->name != NULL)
+        victim = entry;
+      continue;
+    }
+
+    if (entry->hash == hash && !strcmp(entry->name, name)) {
+      entry->lastuse = ++pathtab_clock;
+      return entry->gen << PATHTAB_SLOTBITS | i;
+    }
+
+    if (entry->refs == 0 &&
+        (victim == NULL ||
+         (victim->name != NULL && entry->lastuse < victim->lastuse)))
+      victim = entry;
+  }
+
+  if (victim == NULL)
+    return PATHREF_INVALID;
+
+  char *copy = strdup(name);
+  if (copy == NULL)
+    return PATHREF_INVALID;
+
+  free(victim->name);
+  victim->name    = copy;
+  victim->hash    = hash;
+  victim->lastuse = ++pathtab_clock;
+  victim->refs    = 0;
+  if (++victim->gen > PATHTAB_MAXGEN)
+    victim->gen = 1;
+
+  return victim->gen << PATHTAB_SLOTBITS | (victim - pathtab);
+}
+
+/**
+ * pathtab_name - return the name of a handle
+ * @ref: handle
+ *
+ * Returns the directory name relative to the partition or NULL if the
+ * name of a weak handle was replaced in the meantime.
+ */
+const char *pathtab_name(pathref_t ref) {
+  pathtab_entry_t *entry;
+
+  if (ref == PATHREF_ROOT)
+    return "";
+
+  entry = pathtab_entry(ref);
+  if (entry == NULL)
+    return NULL;
+
+  entry->lastuse = ++pathtab_clock;
+  return entry->name;
+}
+
+/**
+ * pathtab_hold - keep a name in the table
+ * @ref: handle
+ */
+void pathtab_hold(pathref_t ref) {
+  pathtab_entry_t *entry = pathtab_entry(ref);
+
+  if (entry != NULL)
+    entry->refs++;
+}
+
+/**
+ * pathtab_release - drop a reference taken by pathtab_hold
+ * @ref: handle
+ *
+ * The name stays in the table, but its slot may be reused.
+ */
+void pathtab_release(pathref_t ref) {
+  pathtab_entry_t *entry = pathtab_entry(ref);
+
+  if (entry != NULL && entry->refs > 0)
+    entry->refs--;
+}
@@ -0,0 +1,62 @@
+/* sd2iec - SD/MMC to Commodore serial bus interface/controller
+   Copyright (C) 2007-2022  Ingo Korb <ingo@akana.de>
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+   pathtab.h: Table of interned directory names
+
+*/
+
+#ifndef PATHTAB_H
+#define PATHTAB_H
+
+#include <stdint.h>
+
+/**
+ * pathref_t - handle of an interned directory name
+ *
+ * The low bits select a slot of the table, the high bits hold the
+ * generation of the slot so a handle that outlived its name is
+ * recognized. Handle 0 is the root directory, which is always valid.
+ */
+typedef uint16_t pathref_t;
+
+#define PATHREF_ROOT    0
+#define PATHREF_INVALID 0xffff
+
+pathref_t   pathtab_intern(const char *name);
+const char *pathtab_name(pathref_t ref);
+void        pathtab_hold(pathref_t ref);
+void        pathtab_release(pathref_t ref);
+
+/**
+ * pathtab_assign - replace a held handle
+ * @dest: held handle to be replaced
+ * @ref : new handle
+ *
+ * Use this for every copy of a handle that outlives the current
+ * command, e.g. the current directory of a partition.
+ */
+static inline void pathtab_assign(pathref_t *dest, pathref_t ref) {
+  pathtab_hold(ref);
+  pathtab_release(*dest);
+  *dest = ref;
+}
+
+#endif
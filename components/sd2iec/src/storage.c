@@ -0,0 +1,194 @@
+/* sd2iec - SD/MMC to Commodore serial bus interface/controller
+   Copyright (C) 2007-2022  Ingo Korb <ingo@akana.de>
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+   storage.c: Asynchronous card I/O through a storage task
+
+   The bus task hands prefetches, deferred writes, syncs and block
+   refills to a
+   storage task on the other core through a single-producer/single-
+   consumer ring of request pointers, so slow card accesses do not
+   stall the bus. Only the bus task may submit requests and only the
+   storage task executes them, in order. Without CONFIG_STORAGE_TASK
+   requests are executed right away by storage_submit.
+
+*/
+
+#include <errno.h>
+#include <unistd.h>
+#include "config.h"
+#include "storage.h"
+
+/**
+ * storage_execute - carry out a request
+ * @req: request
+ *
+ * This function performs the I/O described by @req, stores the
+ * result and marks the request as done.
+ */
+static void storage_execute(storage_req_t *req) {
+  ssize_t res;
+
+  switch (req->op) {
+  case STORAGE_READ:
+    res = pread(req->fd, req->data, req->length, req->offset);
+    break;
+
+  case STORAGE_WRITE:
+    res = pwrite(req->fd, req->data, req->length, req->offset);
+    break;
+
+  case STORAGE_CALL:
+    res = req->call(req->data);
+    break;
+
+  case STORAGE_SYNC:
+  default:
+    res = fsync(req->fd);
+    break;
+  }
+
+  req->error  = (res < 0 && req->op != STORAGE_CALL) ? errno : 0;
+  req->result = res;
+  __atomic_store_n(&req->busy, 0, __ATOMIC_RELEASE);
+}
+
+#ifdef CONFIG_STORAGE_TASK
+
+/* Number of queued requests, must be a power of two */
+#define STORAGE_QUEUE_SIZE 16
+
+static storage_req_t *queue[STORAGE_QUEUE_SIZE];
+static uint8_t queue_head;  /* next free slot, written by the bus task    */
+static uint8_t queue_tail;  /* next request, written by the storage task */
+
+/**
+ * storage_init - start the storage task
+ */
+void storage_init(void) {
+  storage_task_start();
+}
+
+/**
+ * storage_task - main loop of the storage task
+ *
+ * This function executes queued requests in order and sleeps
+ * while the queue is empty. It never returns.
+ */
+void storage_task(void) {
+  while (1) {
+    uint8_t tail = queue_tail;
+
+    while (tail != __atomic_load_n(&queue_head, __ATOMIC_ACQUIRE)) {
+      storage_execute(queue[tail % STORAGE_QUEUE_SIZE]);
+      tail++;
+      __atomic_store_n(&queue_tail, tail, __ATOMIC_RELEASE);
+      storage_task_done();
+    }
+
+    storage_task_sleep();
+  }
+}
+
+/**
+ * storage_submit - queue a request
+ * @req: request
+ *
+ * This function hands @req to the storage task and returns without
+ * waiting for it unless the queue is full. Requests submitted by a
+ * function running on the storage task are executed immediately.
+ */
+void storage_submit(storage_req_t *req) {
+  uint8_t head = queue_head;
+
+  if (storage_task_self()) {
+    req->busy = 1;
+    storage_execute(req);
+    return;
+  }
+
+  while ((uint8_t)(head - __atomic_load_n(&queue_tail, __ATOMIC_ACQUIRE)) >= STORAGE_QUEUE_SIZE)
+    storage_task_wait();
+
+  req->busy = 1;
+  queue[head % STORAGE_QUEUE_SIZE] = req;
+  __atomic_store_n(&queue_head, (uint8_t)(head + 1), __ATOMIC_RELEASE);
+  storage_task_wake();
+}
+
+/**
+ * storage_wait - wait until a request is done
+ * @req: request
+ *
+ * Returns immediately if @req was never submitted.
+ */
+void storage_wait(storage_req_t *req) {
+  while (__atomic_load_n(&req->busy, __ATOMIC_ACQUIRE))
+    storage_task_wait();
+}
+
+/**
+ * storage_progress - report progress of a running call
+ *
+ * A function running as STORAGE_CALL can use this to wake up the bus
+ * task in storage_wait_progress before the call is done, e.g. whenever
+ * it has produced another part of its result.
+ */
+void storage_progress(void) {
+  storage_task_done();
+}
+
+/**
+ * storage_wait_progress - wait for any progress of the storage task
+ *
+ * This function returns when a request is done or a running call
+ * reported progress. It may return early, so the caller must check
+ * its condition again.
+ */
+void storage_wait_progress(void) {
+  storage_task_wait();
+}
+
+/**
+ * storage_drain - wait until all queued requests are done
+ */
+void storage_drain(void) {
+  if (storage_task_self())
+    return;
+
+  while (__atomic_load_n(&queue_tail, __ATOMIC_ACQUIRE) != queue_head)
+    storage_task_wait();
+}
+
+#else
+
+void storage_submit(storage_req_t *req) {
+  req->busy = 1;
+  storage_execute(req);
+}
+
+void storage_wait(storage_req_t *req) {
+  (void)req;
+}
+
+void storage_drain(void) {
+}
+
+#endif
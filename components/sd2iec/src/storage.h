@@ -0,0 +1,108 @@
+/* sd2iec - SD/MMC to Commodore serial bus interface/controller
+   Copyright (C) 2007-2022  Ingo Korb <ingo@akana.de>
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+   storage.h: Asynchronous card I/O through a storage task
+
+*/
+
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <stdint.h>
+
+/* Request types */
+#define STORAGE_READ  0  /* pread() length bytes at offset into data  */
+#define STORAGE_WRITE 1  /* pwrite() length bytes from data at offset */
+#define STORAGE_SYNC  2  /* fsync() */
+#define STORAGE_CALL  3  /* call(data) on the storage task */
+
+/**
+ * struct storage_req_t - a single card I/O request
+ * @op    : one of the STORAGE_* values
+ * @busy  : set by storage_submit, cleared when the request is done
+ * @fd    : file descriptor
+ * @offset: file offset for reads and writes
+ * @data  : source or destination, must stay valid until done
+ * @length: number of bytes to transfer
+ * @result: bytes transferred (0 for sync), -1 on error,
+ *          return value of the function for calls
+ * @error : errno if result is -1
+ * @call  : function to be called for STORAGE_CALL
+ *
+ * Requests are owned by the caller. A request must not be changed
+ * or submitted again while it is busy. A called function runs on the
+ * storage task while the bus task goes on, so it must only touch
+ * state that the bus task leaves alone until the request is done.
+ * Requests submitted by a called function are executed right away.
+ * There are no locks, the two kinds of calls are:
+ *
+ * - Block refills (buffer_prefetch). The bus task only sends bytes of
+ *   the current block until the refill is done, so the refill may use
+ *   the track cache, the image cache and image file positions. It must
+ *   not report errors or free buffers, set_error and free_buffer do
+ *   nothing on the storage task and the bus task cleans up instead.
+ * - Background walks (the D64 chain prefetch). These run while the bus
+ *   task handles other commands and only use pread and their own
+ *   state. Whoever closes or replaces the file stops them first.
+ */
+typedef struct {
+  uint8_t           op;
+  volatile uint8_t  busy;
+  int               fd;
+  uint32_t          offset;
+  void             *data;
+  uint32_t          length;
+  int32_t           result;
+  int               error;
+  uint8_t         (*call)(void *data);
+} storage_req_t;
+
+/* Returns true while the request is queued or being executed */
+static inline uint8_t storage_busy(storage_req_t *req) {
+  return __atomic_load_n(&req->busy, __ATOMIC_ACQUIRE);
+}
+
+void storage_submit(storage_req_t *req);
+void storage_wait(storage_req_t *req);
+void storage_drain(void);
+
+#ifdef CONFIG_STORAGE_TASK
+
+void storage_init(void);
+void storage_task(void);
+void storage_progress(void);
+void storage_wait_progress(void);
+
+/* Provided by the architecture */
+void storage_task_start(void);  /* create a task that runs storage_task()  */
+void storage_task_wake(void);   /* wake the storage task, may come early   */
+void storage_task_sleep(void);  /* storage task: wait for storage_task_wake */
+void storage_task_done(void);   /* storage task: a request was completed   */
+void storage_task_wait(void);   /* wait for storage_task_done, may return early */
+uint8_t storage_task_self(void); /* true if called by the storage task     */
+
+#else
+
+#  define storage_init() do {} while (0)
+
+#endif
+
+#endif
@@ -0,0 +1,134 @@
+/* sd2iec - SD/MMC to Commodore serial bus interface/controller
+   Copyright (C) 2007-2022  Ingo Korb <ingo@akana.de>
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+   trace.c: Timestamped ring buffer of bus events
+
+   Events are stored in binary form with a timestamp from trace_ticks()
+   so recording one costs a few dozen cycles and never touches the
+   console. Both the bus task and the storage task record events: a
+   slot is claimed with a compare-and-swap on the head and published
+   by writing its sequence number last. trace_drain runs somewhere
+   else (a low priority task on core 0 on the ESP32), prints the
+   published entries and frees their slots. When the ring is full new
+   events are counted as dropped instead of waiting for the drain.
+
+*/
+
+#include "config.h"
+#include "timer.h"
+#include "trace.h"
+
+#ifdef CONFIG_TRACE_LEVEL
+
+uint8_t trace_level = TRACE_ERRORS;
+trace_stats_t trace_stats;
+
+static trace_entry_t trace_ring[TRACE_ENTRIES];
+static uint32_t trace_head;  /* next slot to claim, written by producers */
+static uint32_t trace_tail;  /* next slot to print, written by the drain */
+
+/**
+ * trace_record - store an event in the ring
+ * @event: event
+ * @arg  : first event parameter
+ * @value: second event parameter
+ *
+ * Use trace() instead, it checks the trace level first.
+ */
+TRACE_ATTRIB
+void trace_record(trace_event_t event, uint8_t arg, uint16_t value) {
+  uint32_t head = __atomic_load_n(&trace_head, __ATOMIC_RELAXED);
+  trace_entry_t *entry;
+
+  do {
+    if (head - __atomic_load_n(&trace_tail, __ATOMIC_ACQUIRE) >= TRACE_ENTRIES) {
+      __atomic_fetch_add(&trace_stats.dropped, 1, __ATOMIC_RELAXED);
+      return;
+    }
+  } while (!__atomic_compare_exchange_n(&trace_head, &head, head + 1, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+  entry = &trace_ring[head % TRACE_ENTRIES];
+  entry->time  = trace_ticks();
+  entry->event = event;
+  entry->arg   = arg;
+  entry->value = value;
+  entry->cpu   = trace_cpu();
+  __atomic_store_n(&entry->seq, head + 1, __ATOMIC_RELEASE);
+  __atomic_fetch_add(&trace_stats.recorded, 1, __ATOMIC_RELAXED);
+}
+
+/* Names of the events, indexed by trace_event_t */
+static const char * const trace_names[] = {
+  "?", "STATE", "ATN", "ATNABORT", "LISTEN", "TALK", "NOBUFFER",
+  "TALKABORT", "EOI", "REFILL", "DIRENTRY", "WRITE", "IOERROR", "ERROR"
+};
+
+/**
+ * trace_drain - print and remove all published events
+ * @out: stream for the output
+ *
+ * Every line shows the core that recorded the event and the time
+ * since the previous event of the same core, the cores have separate
+ * cycle counters. Must not be called by more than one task.
+ */
+void trace_drain(FILE *out) {
+  static uint32_t last_time[2];
+  static uint8_t  seen;
+  static uint32_t last_dropped;
+  uint32_t tail = trace_tail;
+  uint32_t dropped;
+  uint8_t cpu;
+
+  while (1) {
+    trace_entry_t entry;
+
+    if (__atomic_load_n(&trace_ring[tail % TRACE_ENTRIES].seq,
+                        __ATOMIC_ACQUIRE) != tail + 1)
+      break;
+
+    /* the slot may be reused as soon as the tail moves */
+    entry = trace_ring[tail % TRACE_ENTRIES];
+    tail++;
+    __atomic_store_n(&trace_tail, tail, __ATOMIC_RELEASE);
+
+    cpu = entry.cpu & 1;
+    if (!(seen & (1 << cpu)))
+      last_time[cpu] = entry.time;
+    seen |= 1 << cpu;
+
+    fprintf(out, "trace c%u +%8luus %-9s %3u %5u\n", cpu,
+            (unsigned long)((entry.time - last_time[cpu]) / TRACE_TICKS_PER_US),
+            entry.event < sizeof(trace_names) / sizeof(trace_names[0]) ?
+              trace_names[entry.event] : "?",
+            entry.arg, entry.value);
+    last_time[cpu] = entry.time;
+  }
+
+  dropped = __atomic_load_n(&trace_stats.dropped, __ATOMIC_RELAXED);
+  if (dropped != last_dropped) {
+    fprintf(out, "trace %lu events dropped\n",
+            (unsigned long)(dropped - last_dropped));
+    last_dropped = dropped;
+  }
+}
+
+#endif
@@ -0,0 +1,116 @@
+/* sd2iec - SD/MMC to Commodore serial bus interface/controller
+   Copyright (C) 2007-2022  Ingo Korb <ingo@akana.de>
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+   trace.h: Timestamped ring buffer of bus events
+
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Trace levels, an event is recorded if its level is <= trace_level */
+#define TRACE_OFF      0
+#define TRACE_ERRORS   1  /* DOS errors, aborted transfers, card errors */
+#define TRACE_COMMANDS 2  /* bus states, ATN commands, talk and listen  */
+#define TRACE_DATA     3  /* block refills and writes, EOI              */
+
+/* Events, the meaning of arg and value is given in brackets */
+typedef enum {
+  TRACE_STATE = 1,  /* bus state changed (bus state, device state)  */
+  TRACE_ATN,        /* ATN command received (command, -)            */
+  TRACE_ATNABORT,   /* ATN while receiving a command (-, -)          */
+  TRACE_LISTEN,     /* listen started (secondary, -)                 */
+  TRACE_TALK,       /* talk started (secondary, -)                   */
+  TRACE_NOBUFFER,   /* listen without a writable buffer (secondary, -) */
+  TRACE_TALKABORT,  /* talk stopped by ATN or timeout (secondary, -) */
+  TRACE_EOI,        /* EOI received (-, -)                           */
+  TRACE_REFILL,     /* file block read (secondary, bytes)            */
+  TRACE_DIRENTRY,   /* directory line generated (secondary, -)       */
+  TRACE_WRITE,      /* file block written (secondary, bytes)         */
+  TRACE_IOERROR,    /* card access failed (secondary, errno)         */
+  TRACE_ERROR       /* DOS error set (error, track << 8 | sector)    */
+} trace_event_t;
+
+/**
+ * struct trace_entry_t - a recorded event
+ * @time : trace_ticks() when the event was recorded
+ * @seq  : position in the trace plus one, written last
+ * @event: one of the TRACE_* events
+ * @arg  : first event parameter
+ * @value: second event parameter
+ * @cpu  : core that recorded the event
+ */
+typedef struct {
+  uint32_t time;
+  uint32_t seq;
+  uint8_t  event;
+  uint8_t  arg;
+  uint16_t value;
+  uint8_t  cpu;
+} trace_entry_t;
+
+#ifdef CONFIG_TRACE_LEVEL
+
+/* Number of entries in the ring, must be a power of two */
+#define TRACE_ENTRIES 256
+
+typedef struct {
+  uint32_t recorded;
+  uint32_t dropped;
+} trace_stats_t;
+
+extern uint8_t trace_level;
+extern trace_stats_t trace_stats;
+
+void trace_record(trace_event_t event, uint8_t arg, uint16_t value);
+void trace_drain(FILE *out);
+
+/* Provided by the architecture, arranges for trace_drain to be called */
+void trace_init(void);
+
+/**
+ * trace - record a bus event
+ * @level: trace level of the event
+ * @event: event
+ * @arg  : first event parameter
+ * @value: second event parameter
+ *
+ * Events above CONFIG_TRACE_LEVEL are removed at compile time,
+ * events above trace_level cost a single comparison.
+ */
+static inline void trace(uint8_t level, trace_event_t event,
+                         uint8_t arg, uint16_t value) {
+  if (level <= CONFIG_TRACE_LEVEL && level <= trace_level)
+    trace_record(event, arg, value);
+}
+
+#else
+
+#  define trace(l,e,a,v) do {} while (0)
+#  define trace_drain(f) do {} while (0)
+#  define trace_init()    do {} while (0)
+
+#endif
+
+#endif
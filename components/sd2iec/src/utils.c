@@ -40,6 +40,22 @@ uint8_t *appendnumber(uint8_t *msg, uint8_t value) {
   return msg;
 }
 
+/* Append a 32 bit decimal number to a string */
+uint8_t *appendlong(uint8_t *msg, uint32_t value) {
+  uint8_t digits[10];
+  uint8_t i = 0;
+
+  do {
+    digits[i++] = '0' + value % 10;
+    value /= 10;
+  } while (value);
+
+  while (i)
+    *msg++ = digits[--i];
+
+  return msg;
+}
+
 /* Convert a one-byte BCD value to a normal integer */
 uint8_t bcd2int(uint8_t value) {
   return (value & 0x0f) + 10*(value >> 4);
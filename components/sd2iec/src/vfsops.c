@@ -25,6 +25,7 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <esp_log.h>
 #include <esp_check.h>
@@ -37,18 +38,24 @@
 #include "buffers.h"
 #include "d64ops.h"
 #include "diskchange.h"
+#include "dirlist.h"
 #include "diskio.h"
 #include "display.h"
 #include "doscmd.h"
 #include "errormsg.h"
 #include "fileops.h"
 #include "flags.h"
+#include "imgcache.h"
+#include "latency.h"
 #include "led.h"
 #include "m2iops.h"
 #include "p00cache.h"
 #include "parser.h"
+#include "pathtab.h"
 #include "progmem.h"
-#include "uart.h"
+#include "storage.h"
+#include "timer.h"
+#include "trace.h"
 #include "utils.h"
 #include "ustring.h"
 #include "wrapops.h"
@@ -345,11 +352,1040 @@ static off_t vfs_tell(int fd) {
   return currpos;
 }
 
-static void vfs_path_dent(char *buffer, path_t *path, cbmdirent_t *dent) {
-  strcpy (buffer, partition[path->part].base_path);
+#ifdef CONFIG_VFS_READAHEAD
+/* ------------------------------------------------------------------------- */
+/*  Read-ahead                                                               */
+/* ------------------------------------------------------------------------- */
+
+/* Number of channels that can use read-ahead at the same time */
+#define READAHEAD_CHANNELS 4
+
+/* Size of one half of a read-ahead stage */
+#define READAHEAD_HALF (CONFIG_VFS_READAHEAD / 2)
+
+/**
+ * struct readahead_t - read-ahead stage of a channel
+ * @owner: buffer using this stage, may be stale
+ * @data : CONFIG_VFS_READAHEAD bytes of file data, allocated on first use
+ * @half : reads for the two halves of data
+ *
+ * Each half holds half[i].result bytes of the file starting at
+ * half[i].offset once its read is done. While the bus consumes one
+ * half, the storage task fills the other one with the following data.
+ */
+typedef struct {
+  buffer_t      *owner;
+  uint8_t       *data;
+  storage_req_t  half[2];
+} readahead_t;
+
+static readahead_t readahead[READAHEAD_CHANNELS];
+
+/* Wait until no read of the stage is in flight */
+static void readahead_idle(readahead_t *ra) {
+  storage_wait(&ra->half[0]);
+  storage_wait(&ra->half[1]);
+}
+
+/**
+ * readahead_fill - start reading file data into one half of a stage
+ * @buf   : buffer that owns the stage
+ * @i     : half to be filled
+ * @offset: file offset to read from
+ */
+static void readahead_fill(buffer_t *buf, uint8_t i, uint32_t offset) {
+  readahead_t   *ra  = buf->pvt.vfs.readahead;
+  storage_req_t *req = &ra->half[i];
+
+  req->op     = STORAGE_READ;
+  req->fd     = buf->pvt.vfs.fd;
+  req->offset = offset;
+  req->data   = ra->data + i * READAHEAD_HALF;
+  req->length = READAHEAD_HALF;
+  storage_submit(req);
+}
+
+/**
+ * readahead_attach - assign a read-ahead stage to a buffer
+ * @buf: buffer of a file opened for reading
+ *
+ * This function tries to find an unused read-ahead stage for @buf.
+ * A stage is unused if its owner was closed or reused for something
+ * else. If no stage is available, @buf reads directly from the file.
+ */
+static void readahead_attach(buffer_t *buf) {
+  buf->pvt.vfs.readahead = NULL;
+
+  if (CONFIG_VFS_READAHEAD == 0)
+    return;
+
+  for (uint8_t i=0; i<READAHEAD_CHANNELS; i++) {
+    readahead_t *ra = &readahead[i];
+
+    if (ra->owner != NULL && ra->owner->allocated &&
+        ra->owner->pvt.vfs.readahead == ra)
+      continue;
+
+    if (ra->data == NULL) {
+      ra->data = ext_malloc(CONFIG_VFS_READAHEAD);
+      if (ra->data == NULL)
+        return;
+    }
+
+    readahead_idle(ra);
+    ra->owner = buf;
+    ra->half[0].result = 0;
+    ra->half[1].result = 0;
+    buf->pvt.vfs.readahead = ra;
+    return;
+  }
+}
+
+/**
+ * readahead_detach - release the read-ahead stage of a buffer
+ * @buf: buffer to be worked on
+ *
+ * This function must be called before the file is closed.
+ */
+static void readahead_detach(buffer_t *buf) {
+  readahead_t *ra = buf->pvt.vfs.readahead;
+
+#ifdef CONFIG_STORAGE_TASK
+  /* a failed prefetch copy must not release the stage of its channel */
+  if (storage_task_self())
+    return;
+#endif
+
+  if (ra != NULL) {
+    readahead_idle(ra);
+    ra->owner = NULL;
+    buf->pvt.vfs.readahead = NULL;
+  }
+}
+
+/* Returns true if a completed read of a stage holds the byte at offset */
+static bool readahead_holds(storage_req_t *req, uint32_t offset) {
+  return !storage_busy(req) && req->result > 0 &&
+    offset >= req->offset && offset - req->offset < (uint32_t)req->result;
+}
+
+/**
+ * readahead_read - read file data through the read-ahead stage
+ * @buf : buffer to be worked on
+ * @data: destination
+ * @len : number of bytes to read
+ *
+ * This function copies up to @len bytes from the current file offset
+ * of @buf to @data. If the data is not in the stage yet, it is read
+ * synchronously. Whenever a half of the stage is in use, the data
+ * following it is prefetched into the other half. Returns the number
+ * of bytes copied, which is less than @len only at the end of the
+ * file, or -1 on error.
+ */
+static ssize_t readahead_read(buffer_t *buf, uint8_t *data, size_t len) {
+  readahead_t *ra = buf->pvt.vfs.readahead;
+  uint32_t offset = buf->pvt.vfs.offset;
+  size_t done = 0;
+
+  while (done < len && offset < buf->pvt.vfs.size) {
+    storage_req_t *req;
+    uint8_t i;
+
+    /* wait for a prefetch that covers the current offset */
+    for (i=0; i<2; i++) {
+      req = &ra->half[i];
+      if (storage_busy(req) && offset >= req->offset &&
+          offset - req->offset < req->length)
+        storage_wait(req);
+    }
+
+    for (i=0; i<2; i++)
+      if (readahead_holds(&ra->half[i], offset))
+        break;
+
+    if (i == 2) {
+      /* miss, read synchronously into a half that is not busy */
+      i = storage_busy(&ra->half[0]) ? 1 : 0;
+      storage_wait(&ra->half[i]);
+      readahead_fill(buf, i, offset);
+      storage_wait(&ra->half[i]);
+
+      if (ra->half[i].result < 0) {
+        errno = ra->half[i].error;
+        return -1;
+      }
+      if (ra->half[i].result == 0)
+        break;
+    }
+
+    req = &ra->half[i];
+    size_t count = req->offset + req->result - offset;
+    if (count > len - done)
+      count = len - done;
+
+    memcpy(data + done, (uint8_t *)req->data + (offset - req->offset), count);
+    done   += count;
+    offset += count;
+
+    /* prefetch the data after this half into the other one */
+    uint32_t next = req->offset + req->result;
+    storage_req_t *other = &ra->half[i ^ 1];
+    if (next < buf->pvt.vfs.size && !storage_busy(other) &&
+        !readahead_holds(other, next))
+      readahead_fill(buf, i ^ 1, next);
+  }
+
+  buf->pvt.vfs.offset = offset;
+  return done;
+}
+#else
+#  define readahead_attach(buf) do {} while (0)
+#  define readahead_detach(buf) do {} while (0)
+#endif
+
+#ifdef CONFIG_VFS_WRITEBEHIND
+/* ------------------------------------------------------------------------- */
+/*  Write-behind                                                             */
+/* ------------------------------------------------------------------------- */
+
+/* Number of channels that can use write-behind at the same time */
+#define WRITEBEHIND_CHANNELS 2
+
+/* Size of one half of a write-behind stage */
+#define WRITEBEHIND_HALF (CONFIG_VFS_WRITEBEHIND / 2)
+
+/**
+ * struct writebehind_t - write-behind stage of a channel
+ * @owner : buffer using this stage, may be stale
+ * @data  : CONFIG_VFS_WRITEBEHIND bytes of file data, allocated on first use
+ * @start : file offset of the first byte in the current half
+ * @length: number of valid bytes in the current half
+ * @cur   : half that is being filled
+ * @status: 0 if all writes so far succeeded, -1 on error, 1 if disk full
+ * @error : errno of the first failed write
+ * @half  : writes of the two halves of data
+ * @sync  : sync request for group commits
+ *
+ * A full half is handed to the storage task while the other one is
+ * filled. Data is only ever appended, so start+length is the logical
+ * end of the file.
+ */
+typedef struct {
+  buffer_t      *owner;
+  uint8_t       *data;
+  uint32_t       start;
+  uint32_t       length;
+  uint8_t        cur;
+  int8_t         status;
+  int            error;
+  storage_req_t  half[2];
+  storage_req_t  sync;
+} writebehind_t;
+
+static writebehind_t writebehind[WRITEBEHIND_CHANNELS];
+
+/* Returns true if the stage is attached to an open channel */
+static bool writebehind_owned(writebehind_t *wb) {
+  return wb->owner != NULL && wb->owner->allocated &&
+         wb->owner->pvt.vfs.writebehind == wb;
+}
+
+/**
+ * writebehind_reap - wait for the write of a half and check it
+ * @wb : stage
+ * @req: write request of one of its halves
+ *
+ * The first failed write is remembered in the status of @wb.
+ */
+static void writebehind_reap(writebehind_t *wb, storage_req_t *req) {
+  storage_wait(req);
+
+  if (wb->status == 0) {
+    if (req->result < 0) {
+      wb->status = -1;
+      wb->error  = req->error;
+    } else if ((uint32_t)req->result != req->length) {
+      wb->status = 1;
+    }
+  }
+
+  req->result = req->length = 0;
+}
+
+/**
+ * writebehind_attach - assign a write-behind stage to a buffer
+ * @buf: buffer of a file opened for writing
+ *
+ * This function tries to find an unused write-behind stage for @buf,
+ * starting at the current file position. Nothing is attached if the
+ * commit policy is COMMIT_IMMEDIATE or no stage is available, in that
+ * case @buf writes directly to the file.
+ */
+static void writebehind_attach(buffer_t *buf) {
+  buf->pvt.vfs.writebehind = NULL;
+
+  if (CONFIG_VFS_WRITEBEHIND == 0 || commit_policy.mode == COMMIT_IMMEDIATE)
+    return;
+
+  for (uint8_t i=0; i<WRITEBEHIND_CHANNELS; i++) {
+    writebehind_t *wb = &writebehind[i];
+
+    if (writebehind_owned(wb))
+      continue;
+
+    if (wb->data == NULL) {
+      wb->data = ext_malloc(CONFIG_VFS_WRITEBEHIND);
+      if (wb->data == NULL)
+        return;
+    }
+
+    off_t start = vfs_tell(buf->pvt.vfs.fd);
+    if (start < 0)
+      return;
+
+    wb->owner  = buf;
+    wb->start  = start;
+    wb->length = 0;
+    wb->cur    = 0;
+    wb->status = 0;
+    buf->pvt.vfs.writebehind = wb;
+    return;
+  }
+}
+
+/**
+ * writebehind_flush - hand the current half of a stage to the storage task
+ * @wb: stage to be flushed
+ *
+ * This function queues the write of the current half and switches to
+ * the other half, waiting for its previous write if necessary.
+ */
+static void writebehind_flush(writebehind_t *wb) {
+  storage_req_t *req = &wb->half[wb->cur];
+
+  if (wb->length == 0)
+    return;
+
+  req->op     = STORAGE_WRITE;
+  req->fd     = wb->owner->pvt.vfs.fd;
+  req->offset = wb->start;
+  req->data   = wb->data + wb->cur * WRITEBEHIND_HALF;
+  req->length = wb->length;
+  storage_submit(req);
+
+  wb->start += wb->length;
+  wb->length = 0;
+  wb->cur   ^= 1;
+  writebehind_reap(wb, &wb->half[wb->cur]);
+}
+
+/**
+ * writebehind_write - write file data through the write-behind stage
+ * @buf : buffer to be worked on
+ * @data: source
+ * @len : number of bytes to write
+ *
+ * This function appends @len bytes to the stage of @buf. A full half
+ * is written to the file in the background. The chunks are aligned to
+ * multiples of the half size in the file, so only the first one may be
+ * shorter. Errors of a background write are reported by the next call
+ * that reuses its half. Returns the number of bytes accepted, which is
+ * less than @len only if the disk is full, or -1 on error.
+ */
+static ssize_t writebehind_write(buffer_t *buf, uint8_t *data, size_t len) {
+  writebehind_t *wb = buf->pvt.vfs.writebehind;
+  size_t done = 0;
+
+  while (done < len) {
+    size_t space = WRITEBEHIND_HALF -
+      (wb->start % WRITEBEHIND_HALF) - wb->length;
+
+    if (space == 0) {
+      writebehind_flush(wb);
+      if (wb->status < 0) {
+        errno = wb->error;
+        return -1;
+      }
+      if (wb->status > 0)
+        break;
+      continue;
+    }
+
+    if (space > len - done)
+      space = len - done;
+
+    memcpy(wb->data + wb->cur * WRITEBEHIND_HALF + wb->length,
+           data + done, space);
+    wb->length += space;
+    done       += space;
+  }
+
+  return done;
+}
+
+/**
+ * writebehind_drop - release the write-behind stage without writing it
+ * @buf: buffer to be worked on
+ *
+ * This function must be called before the file is closed on errors.
+ */
+static void writebehind_drop(buffer_t *buf) {
+  writebehind_t *wb = buf->pvt.vfs.writebehind;
+
+  if (wb != NULL) {
+    storage_wait(&wb->half[0]);
+    storage_wait(&wb->half[1]);
+    storage_wait(&wb->sync);
+    wb->owner = NULL;
+    buf->pvt.vfs.writebehind = NULL;
+  }
+}
+
+/**
+ * writebehind_detach - write out and release the write-behind stage
+ * @buf: buffer to be worked on
+ *
+ * This function waits until all data of the stage is in the file and
+ * leaves the file position at its end. It must be called before the
+ * file is closed. Returns 0 if successful or if @buf has no stage,
+ * 1 if data could not be written. The error channel is set in that case.
+ */
+static uint8_t writebehind_detach(buffer_t *buf) {
+  writebehind_t *wb = buf->pvt.vfs.writebehind;
+
+  if (wb == NULL)
+    return 0;
+
+  writebehind_flush(wb);
+  writebehind_reap(wb, &wb->half[wb->cur ^ 1]);
+  storage_wait(&wb->sync);
+
+  lseek(buf->pvt.vfs.fd, wb->start, SEEK_SET);
+  wb->owner = NULL;
+  buf->pvt.vfs.writebehind = NULL;
+
+  if (wb->status < 0) {
+    parse_error(wb->error, 0);
+    return 1;
+  }
+  if (wb->status > 0) {
+    set_error(ERROR_DISK_FULL);
+    return 1;
+  }
+  return 0;
+}
+#else
+#  define writebehind_attach(buf) do {} while (0)
+#  define writebehind_drop(buf)   do {} while (0)
+#  define writebehind_detach(buf) 0
+#endif
+
+/* ------------------------------------------------------------------------- */
+/*  X00 name cache keys                                                      */
+/* ------------------------------------------------------------------------- */
+
+/* Key of a directory for the p00cache, dirpath as built by vfs_dirpath */
+static inline uint32_t vfs_dirkey(const char *dirpath) {
+  return crc32_le(0, (const uint8_t *)dirpath, strlen(dirpath));
+}
+
+/**
+ * vfs_mtime2date - convert a file time to a directory entry date
+ * @mtime: seconds since 1970-01-01 00:00 UTC
+ * @date : pointer to the date to be set
+ *
+ * The time is converted as UTC, the "time.h" of sd2iec does not
+ * provide localtime. Times before 1970 are clamped to its start.
+ */
+static void vfs_mtime2date(time_t mtime, date_t *date) {
+  uint32_t secs = mtime > 0 ? mtime : 0;
+  uint32_t days = secs / 86400;
+  uint32_t era, doe, yoe, doy, mp, year;
+
+  secs %= 86400;
+  date->hour   = secs / 3600;
+  date->minute = (secs / 60) % 60;
+  date->second = secs % 60;
+
+  /* days since 0000-03-01 in 400 year eras of the gregorian calendar */
+  days += 719468;
+  era   = days / 146097;
+  doe   = days - era * 146097;
+  yoe   = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  doy   = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  mp    = (5 * doy + 2) / 153;
+  year  = yoe + era * 400;
+
+  date->day   = doy - (153 * mp + 2) / 5 + 1;
+  date->month = mp < 10 ? mp + 3 : mp - 9;
+  if (date->month <= 2)
+    year++;
+  date->year  = year - 1900;
+}
+
+/* Key of a file for the p00cache, changes when the file is modified */
+static inline uint32_t vfs_filekey(const char *name, struct stat *st) {
+  uint32_t stamp[2] = { st->st_size, st->st_mtime };
+  uint32_t crc = crc32_le(0, (const uint8_t *)name, strlen(name));
+
+  return crc32_le(crc, (uint8_t *)stamp, sizeof(stamp));
+}
+
+static void vfs_dirpath(char *buffer, uint8_t part, pathref_t dir);
+static int8_t vfs_readdir_stream(dh_t *dh, cbmdirent_t *dent);
+
+#ifdef CONFIG_VFS_DIRCACHE
+/* ------------------------------------------------------------------------- */
+/*  Directory snapshots                                                      */
+/* ------------------------------------------------------------------------- */
+
+/* Number of directories that are kept at the same time */
+#define DIRSNAP_SLOTS 4
+
+/* Value of dh->dir.vfs.snap while reading directly from the directory */
+#define DIRSNAP_NONE 0xff
+
+/**
+ * struct dirsnap_entry_t - decoded directory entry in a snapshot
+ * @size    : size of the record including realname, a multiple of 2
+ * @typeflags, @blocksize, @remainder, @date, @name: as in cbmdirent_t
+ * @opstype : as in cbmdirent_t
+ * @realname: name of the file on the card
+ */
+typedef struct {
+  uint16_t size;
+  uint16_t typeflags;
+  uint16_t blocksize;
+  uint8_t  remainder;
+  uint8_t  opstype;
+  date_t   date;
+  uint8_t  name[CBM_NAME_LENGTH];
+  char     realname[];
+} dirsnap_entry_t;
+
+/**
+ * struct dirsnap_t - decoded contents of a directory
+ * @data   : dirsnap_entry_t records in directory order
+ * @size   : bytes used in data
+ * @alloc  : bytes allocated for data
+ * @path   : held handle of the directory
+ * @part   : partition of the directory
+ * @used   : true if the slot holds a snapshot
+ * @mtime  : modification time of the directory when it was read
+ * @hiding : EXTENSION_HIDING bit of globalflags when it was read
+ * @stamp  : new value whenever the slot is invalidated or refilled
+ * @lastuse: value of dirsnap_clock at the last use, for replacement
+ * @order  : offsets of the records in sorted order, NULL if not sorted
+ * @count  : number of records
+ * @sorted : DIR_ORDER_* value @order was sorted for
+ *
+ * Directory handles remember slot and stamp of their snapshot, so a
+ * handle notices if its snapshot was replaced while it was in use.
+ */
+typedef struct {
+  uint8_t  *data;
+  uint32_t  size;
+  uint32_t  alloc;
+  pathref_t path;
+  uint8_t   part;
+  bool      used;
+  time_t    mtime;
+  uint8_t   hiding;
+  uint32_t  stamp;
+  uint32_t  lastuse;
+  uint32_t *order;
+  uint16_t  count;
+  uint8_t   sorted;
+} dirsnap_t;
+
+static dirsnap_t dirsnap[DIRSNAP_SLOTS];
+static uint32_t  dirsnap_clock;
+static uint32_t  dirsnap_used;   /* bytes allocated in all slots */
+
+/* Release the memory of a snapshot and mark the slot as unused */
+static void dirsnap_free(dirsnap_t *snap) {
+  dirsnap_used -= snap->alloc;
+  ext_free(snap->data);
+  if (snap->order != NULL) {
+    dirsnap_used -= snap->count * sizeof(uint32_t);
+    ext_free(snap->order);
+  }
+  pathtab_release(snap->path);
+  snap->data   = NULL;
+  snap->order  = NULL;
+  snap->used   = false;
+  snap->size   = 0;
+  snap->alloc  = 0;
+  snap->count  = 0;
+  snap->sorted = DIR_ORDER_NONE;
+  snap->stamp  = ++dirsnap_clock;
+}
+
+/**
+ * dirsnap_invalidate - forget all directory snapshots
+ *
+ * This function must be called whenever the drive changes the
+ * contents of a directory or the size of a file, also when it
+ * writes to the card without going through vfsops.
+ */
+void dirsnap_invalidate(void) {
+  for (uint8_t i=0; i<DIRSNAP_SLOTS; i++)
+    if (dirsnap[i].used)
+      dirsnap_free(&dirsnap[i]);
+}
+
+/**
+ * dirsnap_reserve - make room for more data in the memory budget
+ * @snap : snapshot that needs the memory, it is never dropped
+ * @bytes: number of additional bytes
+ *
+ * This function drops the least recently used other snapshots until
+ * @bytes more fit into the budget. Returns false if that is not
+ * possible.
+ */
+static bool dirsnap_reserve(dirsnap_t *snap, uint32_t bytes) {
+  while (dirsnap_used + bytes > CONFIG_VFS_DIRCACHE) {
+    dirsnap_t *victim = NULL;
+
+    for (uint8_t i=0; i<DIRSNAP_SLOTS; i++)
+      if (&dirsnap[i] != snap && dirsnap[i].used &&
+          (victim == NULL || dirsnap[i].lastuse < victim->lastuse))
+        victim = &dirsnap[i];
+
+    if (victim == NULL)
+      return false;
+    dirsnap_free(victim);
+  }
+
+  return true;
+}
+
+/**
+ * dirsnap_append - add an entry to a snapshot
+ * @snap: snapshot that is being built
+ * @dent: decoded directory entry
+ *
+ * This function grows the snapshot if required, replacing other
+ * snapshots when the memory budget is used up. Returns false if
+ * the entry does not fit.
+ */
+static bool dirsnap_append(dirsnap_t *snap, cbmdirent_t *dent) {
+  size_t namelen = strlen(dent->pvt.vfs.realname) + 1;
+  uint16_t size  = (sizeof(dirsnap_entry_t) + namelen + 1) & ~1;
+  dirsnap_entry_t *ent;
+
+  if (snap->count == UINT16_MAX)
+    return false;
+
+  if (snap->size + size > snap->alloc) {
+    uint32_t alloc = snap->alloc ? 2 * snap->alloc : 4096;
+    uint8_t *data;
+
+    while (alloc < snap->size + size)
+      alloc *= 2;
+
+    /* make room by dropping the least recently used snapshots */
+    if (!dirsnap_reserve(snap, alloc - snap->alloc))
+      return false;
+
+    data = ext_realloc(snap->data, alloc);
+    if (data == NULL)
+      return false;
+
+    dirsnap_used += alloc - snap->alloc;
+    snap->data  = data;
+    snap->alloc = alloc;
+  }
+
+  ent = (dirsnap_entry_t *)(snap->data + snap->size);
+  ent->size      = size;
+  ent->typeflags = dent->typeflags;
+  ent->blocksize = dent->blocksize;
+  ent->remainder = dent->remainder;
+  ent->opstype   = dent->opstype;
+  ent->date      = dent->date;
+  memcpy(ent->name, dent->name, CBM_NAME_LENGTH);
+  memcpy(ent->realname, dent->pvt.vfs.realname, namelen);
+  snap->size += size;
+  snap->count++;
+  return true;
+}
+
+/* Snapshot data and DIR_ORDER_* value used by dirsnap_compare */
+static const uint8_t *dirsnap_sortdata;
+static uint8_t        dirsnap_sortorder;
+
+/* qsort callback comparing two record offsets of a snapshot */
+static int dirsnap_compare(const void *a, const void *b) {
+  uint32_t ofs_a = *(const uint32_t *)a;
+  uint32_t ofs_b = *(const uint32_t *)b;
+  const dirsnap_entry_t *x = (const dirsnap_entry_t *)(dirsnap_sortdata + ofs_a);
+  const dirsnap_entry_t *y = (const dirsnap_entry_t *)(dirsnap_sortdata + ofs_b);
+  int res = 0;
+
+  if (dirsnap_sortorder & DIR_ORDER_DIRFIRST) {
+    bool xdir = (x->typeflags & TYPE_MASK) == TYPE_DIR;
+    bool ydir = (y->typeflags & TYPE_MASK) == TYPE_DIR;
+
+    if (xdir != ydir)
+      return xdir ? -1 : 1;
+  }
+
+  switch (dirsnap_sortorder & DIR_ORDER_KEY) {
+  case DIR_ORDER_NAME:
+    for (uint8_t i=0; i<CBM_NAME_LENGTH && res == 0; i++) {
+      res = x->name[i] - y->name[i];
+      if (x->name[i] == 0)
+        break;
+    }
+    break;
+
+  case DIR_ORDER_DATE:
+    /* date_t runs from year to second, newest first */
+    res = memcmp(&y->date, &x->date, sizeof(date_t));
+    break;
+  }
+
+  /* keep the directory order of equal records */
+  if (res == 0)
+    res = ofs_a < ofs_b ? -1 : 1;
+  return res;
+}
+
+/**
+ * dirsnap_sort - build the sort index of a snapshot
+ * @snap : snapshot
+ * @order: DIR_ORDER_* value
+ *
+ * The index is kept with the snapshot until it is dropped, it is only
+ * sorted again when a different order is requested. Returns false if
+ * there is no memory for the index.
+ */
+static bool dirsnap_sort(dirsnap_t *snap, uint8_t order) {
+  uint32_t offset = 0;
+
+  if (snap->order != NULL && snap->sorted == order)
+    return true;
+
+  if (snap->order == NULL) {
+    size_t bytes = snap->count * sizeof(uint32_t);
+
+    if (!dirsnap_reserve(snap, bytes))
+      return false;
+
+    snap->order = ext_malloc(bytes);
+    if (snap->order == NULL)
+      return false;
+    dirsnap_used += bytes;
+  }
+
+  for (uint16_t i=0; i<snap->count; i++) {
+    snap->order[i] = offset;
+    offset += ((dirsnap_entry_t *)(snap->data + offset))->size;
+  }
+
+  dirsnap_sortdata  = snap->data;
+  dirsnap_sortorder = order;
+  qsort(snap->order, snap->count, sizeof(uint32_t), dirsnap_compare);
+  snap->sorted = order;
+  return true;
+}
+
+/**
+ * dirsnap_open - serve a directory handle from a snapshot
+ * @dh   : directory handle with part and path set up
+ * @mtime: modification time of the directory
+ *
+ * This function looks for an up-to-date snapshot of the directory of
+ * @dh. Returns true if one was found and @dh now reads from it.
+ */
+static bool dirsnap_open(dh_t *dh, time_t mtime) {
+  dh->dir.vfs.snap   = DIRSNAP_NONE;
+  dh->dir.vfs.offset = 0;
+  dh->dir.vfs.index  = 0;
+  dh->dir.vfs.order  = DIR_ORDER_NONE;
+
+  for (uint8_t i=0; i<DIRSNAP_SLOTS; i++) {
+    dirsnap_t *snap = &dirsnap[i];
+
+    if (snap->used && snap->part == dh->part &&
+        snap->path == dh->dir.vfs.path &&
+        snap->mtime == mtime &&
+        snap->hiding == (globalflags & EXTENSION_HIDING)) {
+      snap->lastuse     = ++dirsnap_clock;
+      dh->dir.vfs.snap  = i;
+      dh->dir.vfs.stamp = snap->stamp;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/**
+ * dirsnap_build - read a directory into a new snapshot
+ * @dh   : directory handle with an open dirp
+ * @mtime: modification time of the directory
+ *
+ * This function decodes all entries of the directory of @dh into the
+ * least recently used slot. If that works, the directory is closed and
+ * @dh reads from the snapshot. If the directory does not fit or an
+ * error occurs, @dh reads directly from the directory from its start.
+ */
+static void dirsnap_build(dh_t *dh, time_t mtime) {
+  dirsnap_t  *snap = &dirsnap[0];
+  cbmdirent_t dent;
+  int8_t      res;
+
+  if (CONFIG_VFS_DIRCACHE == 0)
+    return;
+
+  for (uint8_t i=1; i<DIRSNAP_SLOTS && snap->used; i++)
+    if (!dirsnap[i].used || dirsnap[i].lastuse < snap->lastuse)
+      snap = &dirsnap[i];
+
+  if (snap->used)
+    dirsnap_free(snap);
+
+  snap->path = dh->dir.vfs.path;
+  snap->used = true;
+  pathtab_hold(snap->path);
+
+  while ((res = vfs_readdir_stream(dh, &dent)) == 0)
+    if (!dirsnap_append(snap, &dent))
+      break;
+
+  /* errno tells a failed readdir or stat apart from the end */
+  if (res == 0 || errno != 0) {
+    dirsnap_free(snap);
+    rewinddir(dh->dir.vfs.dirp);
+    return;
+  }
+
+  closedir(dh->dir.vfs.dirp);
+  dh->dir.vfs.dirp = NULL;
+
+  snap->part    = dh->part;
+  snap->mtime   = mtime;
+  snap->hiding  = globalflags & EXTENSION_HIDING;
+  snap->lastuse = ++dirsnap_clock;
+  dirsnap_open(dh, mtime);
+}
+
+/**
+ * dirsnap_read - read the next entry from a snapshot
+ * @dh  : directory handle
+ * @dent: CBM directory entry for returning data
+ *
+ * If the snapshot was replaced in the meantime, this function opens
+ * the directory again and continues after the entries read so far.
+ * Returns the same as vfs_readdir.
+ */
+static int8_t dirsnap_read(dh_t *dh, cbmdirent_t *dent) {
+  dirsnap_t *snap = &dirsnap[dh->dir.vfs.snap];
+  dirsnap_entry_t *ent;
+
+  if (snap->stamp != dh->dir.vfs.stamp) {
+    uint16_t skip = dh->dir.vfs.index;
+
+    if (dh->dir.vfs.order != DIR_ORDER_NONE) {
+      uint8_t order = dh->dir.vfs.order;
+      path_t  path;
+
+      /* Sort the directory again and continue at the same position */
+      memset(&path, 0, sizeof(path));
+      path.part     = dh->part;
+      path.dir.path = dh->dir.vfs.path;
+      if (vfs_opendir(dh, &path))
+        return -1;
+
+      if (vfs_sortdir(dh, order))
+        dh->dir.vfs.index = skip;
+      else
+        /* no snapshot any more, continue in directory order */
+        while (skip--)
+          if (vfs_readdir(dh, dent))
+            return -1;
+
+      return vfs_readdir(dh, dent);
+    }
+
+    char buffer[512]; // FIXME
+
+    dh->dir.vfs.snap = DIRSNAP_NONE;
+    vfs_dirpath(buffer, dh->part, dh->dir.vfs.path);
+    dh->dir.vfs.dirp = opendir(buffer);
+    if (dh->dir.vfs.dirp == NULL) {
+      parse_error(errno,1);
+      return -1;
+    }
+
+    while (skip--)
+      if (vfs_readdir_stream(dh, dent))
+        return -1;
+
+    return vfs_readdir_stream(dh, dent);
+  }
+
+  if (dh->dir.vfs.order != DIR_ORDER_NONE) {
+    /* another listing may have sorted the snapshot differently */
+    if (dh->dir.vfs.index >= snap->count ||
+        !dirsnap_sort(snap, dh->dir.vfs.order))
+      return -1;
+
+    ent = (dirsnap_entry_t *)(snap->data + snap->order[dh->dir.vfs.index]);
+  } else {
+    if (dh->dir.vfs.offset >= snap->size)
+      return -1;
+
+    ent = (dirsnap_entry_t *)(snap->data + dh->dir.vfs.offset);
+    dh->dir.vfs.offset += ent->size;
+  }
+  dh->dir.vfs.index++;
+
+  memset(dent, 0, sizeof(cbmdirent_t));
+  memcpy(dent->name, ent->name, CBM_NAME_LENGTH);
+  dent->typeflags = ent->typeflags;
+  dent->blocksize = ent->blocksize;
+  dent->remainder = ent->remainder;
+  dent->date      = ent->date;
+  dent->opstype   = ent->opstype;
+  strcpy(dent->pvt.vfs.realname, ent->realname);
+  return 0;
+}
+#endif
+
+/* ------------------------------------------------------------------------- */
+/*  Commit policy                                                            */
+/* ------------------------------------------------------------------------- */
+
+commit_policy_t commit_policy;
+
+static uint32_t commit_pending;  /* bytes written since the last commit */
+static uint32_t commit_since;    /* uptime_ms() of the first of them    */
+static uint32_t commit_images;   /* partitions with an unsynced flush   */
+
+static storage_req_t image_sync[CONFIG_MAX_PARTITIONS];
+
+/* file offset after the last access of each image, for (DWORD)-1 */
+static uint32_t image_position[CONFIG_MAX_PARTITIONS];
+
+/**
+ * vfs_image_sync - sync an image file through the storage task
+ * @part: partition number
+ * @wait: wait until the sync is done
+ *
+ * The sync is queued behind all image writes queued so far.
+ */
+static void vfs_image_sync(uint8_t part, uint8_t wait) {
+  storage_req_t *req = &image_sync[part];
+
+  storage_wait(req);
+  req->op = STORAGE_SYNC;
+  req->fd = partition[part].imagefd;
+  storage_submit(req);
+  if (wait)
+    storage_wait(req);
+}
+
+/**
+ * vfs_commit - commit all pending writes to the card
+ *
+ * This function queues the write-behind stages of all open files
+ * followed by a sync of them and of every image file that requested
+ * a flush since the last commit. Write errors are not reported here,
+ * they turn up again on the next write or close of the file.
+ */
+void vfs_commit(void) {
+#ifdef CONFIG_VFS_WRITEBEHIND
+  for (uint8_t i=0; i<WRITEBEHIND_CHANNELS; i++) {
+    writebehind_t *wb = &writebehind[i];
+
+    if (writebehind_owned(wb)) {
+      writebehind_flush(wb);
+      storage_wait(&wb->sync);
+      wb->sync.op = STORAGE_SYNC;
+      wb->sync.fd = wb->owner->pvt.vfs.fd;
+      storage_submit(&wb->sync);
+    }
+  }
+#endif
+
+  for (uint8_t part=0; part<CONFIG_MAX_PARTITIONS; part++)
+    if ((commit_images & (1UL << part)) && partition[part].imagefd >= 0)
+      vfs_image_sync(part, 0);
+
+  commit_images  = 0;
+  commit_pending = 0;
+}
+
+/* Returns true if the time threshold of a group commit was reached */
+static bool commit_timeout(void) {
+  return commit_policy.interval != 0 &&
+    (int32_t)(uptime_ms() - commit_since) >= commit_policy.interval * 100L;
+}
+
+/**
+ * commit_account - account for data written to the card
+ * @bytes: number of bytes written
+ *
+ * This function adds @bytes to the uncommitted data and runs a group
+ * commit if a threshold of the policy was reached.
+ */
+static void commit_account(uint32_t bytes) {
+  if (commit_policy.mode != COMMIT_GROUP)
+    return;
+
+  if (commit_pending == 0)
+    commit_since = uptime_ms();
+  commit_pending += bytes;
+
+  if ((commit_policy.size != 0 &&
+       commit_pending >= commit_policy.size * 1024UL) ||
+      commit_timeout())
+    vfs_commit();
+}
+
+/**
+ * vfs_commit_poll - run a group commit that is due
+ *
+ * This function is called while the bus is idle so the time threshold
+ * of a group commit also applies when no further data is written.
+ */
+void vfs_commit_poll(void) {
+  if (commit_policy.mode == COMMIT_GROUP && commit_pending != 0 &&
+      commit_timeout())
+    vfs_commit();
+}
+
+/**
+ * vfs_dirpath - build the full path of a directory on the card
+ * @buffer: buffer for the path, 512 bytes
+ * @part  : partition of the directory
+ * @dir   : handle of the directory
+ *
+ * The path ends with a slash so a file name can be appended. If the
+ * handle is stale, @buffer is set to an empty string instead, which
+ * makes the following system call fail with ENOENT.
+ */
+static void vfs_dirpath(char *buffer, uint8_t part, pathref_t dir) {
+  const char *name = pathtab_name(dir);
+
+  if (name == NULL) {
+    buffer[0] = 0;
+    return;
+  }
+
+  strcpy (buffer, partition[part].base_path);
   strcat (buffer, "/");
-  strcat (buffer, path->dir.pathname);
+  strcat (buffer, name);
   strcat (buffer, "/");
+}
+
+static void vfs_path_dent(char *buffer, path_t *path, cbmdirent_t *dent) {
+  vfs_dirpath(buffer, path->part, path->dir.path);
+  if (buffer[0] == 0)
+    return;
 
   if (dent->pvt.vfs.realname[0])
     strcat (buffer, (char*)dent->pvt.vfs.realname);
@@ -361,18 +1397,120 @@ static void vfs_path_dent(char *buffer, path_t *path, cbmdirent_t *dent) {
 }
 
 static void vfs_path(char *buffer, path_t *path, char *name) {
-  strcpy (buffer, partition[path->part].base_path);
-  strcat (buffer, "/");
-  strcat (buffer, path->dir.pathname);
-  strcat (buffer, "/");
-  strcat (buffer, name);
+  vfs_dirpath(buffer, path->part, path->dir.path);
+  if (buffer[0] != 0)
+    strcat (buffer, name);
+}
+
+/**
+ * vfs_hostpath - build the full path of a file on the card
+ * @buffer: buffer for the path, 512 bytes
+ * @path  : path of the directory
+ * @name  : name of the file on the card
+ *
+ * This function allows other modules to access files on the card
+ * directly, e.g. for reading images ahead of time.
+ */
+void vfs_hostpath(char *buffer, path_t *path, const char *name) {
+  vfs_path(buffer, path, (char *)name);
+}
+
+#if defined(CONFIG_P00CACHE) && defined(CONFIG_P00CACHE_INDEX)
+/* ------------------------------------------------------------------------- */
+/*  [PSUR]00 index files                                                     */
+/* ------------------------------------------------------------------------- */
+
+/* The index file of a listed directory is written later while the bus  */
+/* is idle. Writing it at the end of the listing changed the time of    */
+/* the directory the snapshot was just made for and, on a read-only     */
+/* card, left errno set for the caller. Only the directory listed last  */
+/* is remembered, the names of an older one are kept in the cache and   */
+/* written after its next listing.                                      */
+
+static struct {
+  pathref_t path;
+  uint8_t   part;
+  bool      pending;
+} p00index;
+
+/* Remember a directory that was read to its end */
+static void p00index_mark(uint8_t part, pathref_t path) {
+  if (p00index.pending) {
+    if (p00index.part == part && p00index.path == path)
+      return;
+    pathtab_release(p00index.path);
+  }
+
+  pathtab_hold(path);
+  p00index.part    = part;
+  p00index.path    = path;
+  p00index.pending = true;
+}
+
+/**
+ * vfs_p00index_poll - write the index file of the last listed directory
+ *
+ * This function is called while the bus is idle. If the file is
+ * written, a snapshot of the directory is kept although the time of
+ * the directory changes, the listing itself is still the same.
+ */
+void vfs_p00index_poll(void) {
+  char      buffer[512]; // FIXME
+  uint8_t   part = p00index.part;
+  pathref_t path = p00index.path;
+#ifdef CONFIG_VFS_DIRCACHE
+  struct stat statbuf;
+  time_t mtime = 0;
+#endif
+
+  if (!p00index.pending)
+    return;
+
+  p00index.pending = false;
+  vfs_dirpath(buffer, part, path);
+  if (buffer[0] != 0) {
+#ifdef CONFIG_VFS_DIRCACHE
+    if (!stat(buffer, &statbuf))
+      mtime = statbuf.st_mtime;
+#endif
+
+    if (p00cache_save(part, vfs_dirkey(buffer), buffer)) {
+#ifdef CONFIG_VFS_DIRCACHE
+      if (mtime != 0 && !stat(buffer, &statbuf))
+        for (uint8_t i=0; i<DIRSNAP_SLOTS; i++)
+          if (dirsnap[i].used && dirsnap[i].part == part &&
+              dirsnap[i].path == path && dirsnap[i].mtime == mtime)
+            dirsnap[i].mtime = statbuf.st_mtime;
+#endif
+    }
+  }
+
+  pathtab_release(path);
 }
+#else
+#  define p00index_mark(part, path) do {} while (0)
+#endif
 
 static uint8_t _vfs_chdir(path_t *path, char *name) {
-  char *pathname = path->dir.pathname;
+  char pathname[512]; // FIXME
+  const char *cwd;
+  pathref_t dir;
+
   if (name[0] == '.' && name[1] == 0) {
     return 0;
   }
+  if (name[0] == 0 || (name[0] == '/' && name[1] == 0)) {
+    path->dir.path = PATHREF_ROOT;
+    return 0;
+  }
+
+  cwd = pathtab_name(path->dir.path);
+  if (cwd == NULL) {
+    set_error(ERROR_DIR_ERROR);
+    return 1;
+  }
+  strcpy(pathname, cwd);
+
   if (name[0] == '.' && name[1] == '.' && name[2] == 0) {
     char *p = strrchr(pathname, '/');
     if (p) {
@@ -380,17 +1518,20 @@ static uint8_t _vfs_chdir(path_t *path, char *name) {
     } else {
       pathname[0] = 0;
     }
-    return 0;
-  }
-  if (name[0] == 0 || (name[0] == '/' && name[1] == 0)) {
-    pathname[0] = 0;
-    return 0;
-  }
-  if (pathname[0]) {
-    strcat(pathname, "/");
+  } else {
+    if (pathname[0]) {
+      strcat(pathname, "/");
+    }
+    strcat(pathname, name);
   }
-  strcat(pathname, name);
 //printf("_vfs_chdir %s CWD IS NOW '%s'\n", name, pathname);
+
+  dir = pathtab_intern(pathname);
+  if (dir == PATHREF_INVALID) {
+    set_error(ERROR_DIR_ERROR);
+    return 1;
+  }
+  path->dir.path = dir;
   // FIXME check target
   return 0;
 }
@@ -414,15 +1555,21 @@ static int vfs_open(path_t *path, cbmdirent_t *dent, mode_t mode) {
  * the given buffer. Used as a refill-callback when reading files
  */
 static uint8_t vfs_file_read(buffer_t *buf) {
+  uint32_t start = latency_start();
   ssize_t bytesread;
   size_t len;
 
-  uart_putc('#');
-
   len = (buf->recordlen ? buf->recordlen : 254);
-  bytesread = read(buf->pvt.vfs.fd, buf->data+2, len);
+#ifdef CONFIG_VFS_READAHEAD
+  if (buf->pvt.vfs.readahead != NULL)
+    bytesread = readahead_read(buf, buf->data+2, len);
+  else
+#endif
+    bytesread = read(buf->pvt.vfs.fd, buf->data+2, len);
   if (bytesread < 0) {
+    trace(TRACE_ERRORS, TRACE_IOERROR, buf->secondary, errno);
     parse_error(errno, 1);
+    readahead_detach(buf);
     free_buffer(buf);
     return 1;
   }
@@ -433,6 +1580,7 @@ static uint8_t vfs_file_read(buffer_t *buf) {
     /* Experimental data suggests that this may be correct */
     buf->data[2] = (buf->recordlen ? 255 : 13);
   }
+  trace(TRACE_DATA, TRACE_REFILL, buf->secondary, bytesread);
 
   buf->position = 2;
   buf->lastused = bytesread+1;
@@ -440,13 +1588,21 @@ static uint8_t vfs_file_read(buffer_t *buf) {
     while(!buf->data[buf->lastused] && --(buf->lastused) > 1);
 
   if (bytesread < 254
+#ifdef CONFIG_VFS_READAHEAD
+      || (buf->pvt.vfs.readahead != NULL &&
+          buf->pvt.vfs.offset >= buf->pvt.vfs.size)
+      || (buf->pvt.vfs.readahead == NULL &&
+          (vfs_size(buf->pvt.vfs.fd) - vfs_tell(buf->pvt.vfs.fd)) == 0)
+#else
       || (vfs_size(buf->pvt.vfs.fd) - vfs_tell(buf->pvt.vfs.fd)) == 0
+#endif
       || buf->recordlen
      ) {
     buf->sendeoi = 1;
   } else
     buf->sendeoi = 0;
 
+  latency_record(LAT_VFSREAD, start);
   return 0;
 }
 
@@ -460,8 +1616,6 @@ static uint8_t vfs_file_read(buffer_t *buf) {
 static uint8_t write_data(buffer_t *buf) {
   ssize_t byteswritten;
 
-  uart_putc('/');
-
   if(!buf->mustflush)
     buf->lastused = buf->position - 1;
 
@@ -472,29 +1626,44 @@ static uint8_t write_data(buffer_t *buf) {
     buf->lastused = buf->recordlen + 1;
 
   size_t count = buf->lastused-1;
-  byteswritten = write(buf->pvt.vfs.fd, buf->data+2, count);
+#ifdef CONFIG_VFS_WRITEBEHIND
+  if (buf->pvt.vfs.writebehind != NULL)
+    byteswritten = writebehind_write(buf, buf->data+2, count);
+  else
+#endif
+    byteswritten = write(buf->pvt.vfs.fd, buf->data+2, count);
   if (byteswritten < 0) {
-    uart_putc('r');
+    trace(TRACE_ERRORS, TRACE_IOERROR, buf->secondary, errno);
     parse_error(errno,1);
+    writebehind_drop(buf);
     close(buf->pvt.vfs.fd);
     free_buffer(buf);
     return 1;
   }
 
   if (byteswritten != buf->lastused-1U) {
-    uart_putc('l');
+    trace(TRACE_ERRORS, TRACE_IOERROR, buf->secondary, ENOSPC);
     set_error(ERROR_DISK_FULL);
+    writebehind_drop(buf);
     close(buf->pvt.vfs.fd);
     free_buffer(buf);
     return 1;
   }
+  trace(TRACE_DATA, TRACE_WRITE, buf->secondary, count);
 
   mark_buffer_clean(buf);
   buf->mustflush = 0;
   buf->position  = 2;
   buf->lastused  = 2;
-  buf->fptr      = vfs_tell(buf->pvt.vfs.fd) - buf->pvt.vfs.headersize;
+#ifdef CONFIG_VFS_WRITEBEHIND
+  if (buf->pvt.vfs.writebehind != NULL) {
+    writebehind_t *wb = buf->pvt.vfs.writebehind;
+    buf->fptr = wb->start + wb->length - buf->pvt.vfs.headersize;
+  } else
+#endif
+    buf->fptr = vfs_tell(buf->pvt.vfs.fd) - buf->pvt.vfs.headersize;
 
+  commit_account(count);
   return 0;
 }
 
@@ -507,6 +1676,12 @@ static uint8_t write_data(buffer_t *buf) {
 static uint8_t vfs_file_write(buffer_t *buf) {
   uint32_t i = 0;
 
+#ifdef CONFIG_VFS_WRITEBEHIND
+  /* The stage only appends, fptr is always at the end of the file */
+  if (buf->pvt.vfs.writebehind != NULL)
+    return write_data(buf);
+#endif
+
   off_t fsize = vfs_size(buf->pvt.vfs.fd);
   uint32_t fptr = fsize - buf->pvt.vfs.headersize;
 
@@ -551,7 +1726,7 @@ static uint8_t vfs_file_write(buffer_t *buf) {
     //offset = lseek(buf->pvt.vfs.fd, vfs_size(buf->pvt.vfs.fd), SEEK_SET);
     offset = lseek(buf->pvt.vfs.fd, 0, SEEK_END);
     if (offset < 0) {
-      uart_putc('r');
+      trace(TRACE_ERRORS, TRACE_IOERROR, buf->secondary, errno);
       parse_error(errno,1);
       close(buf->pvt.vfs.fd);
       free_buffer(buf);
@@ -581,6 +1756,34 @@ uint8_t vfs_file_seek(buffer_t *buf, uint32_t position, uint8_t index) {
     if (vfs_file_write(buf))
       return 1;
 
+  if (writebehind_detach(buf)) {
+    close(buf->pvt.vfs.fd);
+    free_buffer(buf);
+    return 1;
+  }
+
+#ifdef CONFIG_VFS_READAHEAD
+  if (buf->pvt.vfs.readahead != NULL) {
+    /* the stage seeks by itself when required */
+    if (buf->pvt.vfs.size >= pos) {
+      buf->pvt.vfs.offset = pos;
+      if (vfs_file_read(buf))
+        return 1;
+
+      buf->position = index + 2;
+      if(index + 2 > buf->lastused)
+        buf->position = buf->lastused;
+
+      return 0;
+    }
+
+    /* beyond the known end, continue without the stage so no stale */
+    /* data is read, with the file offset where the stage stopped  */
+    readahead_detach(buf);
+    lseek(buf->pvt.vfs.fd, buf->pvt.vfs.offset, SEEK_SET);
+  }
+#endif
+
   off_t fsize = vfs_size(buf->pvt.vfs.fd);
   if (fsize >= pos) {
     off_t offset = lseek(buf->pvt.vfs.fd, pos, SEEK_SET);
@@ -632,10 +1835,20 @@ static uint8_t vfs_file_close(buffer_t *buf) {
 
   if (buf->write) {
     /* Write the remaining data using the callback */
+    dirsnap_invalidate();
+    dirlist_invalidate();
     if (buf->refill(buf))
       return 1;
   }
 
+  readahead_detach(buf);
+  if (writebehind_detach(buf)) {
+    close(buf->pvt.vfs.fd);
+    buf->pvt.vfs.fd = -1;
+    buf->cleanup = callback_dummy;
+    return 1;
+  }
+
   res = close(buf->pvt.vfs.fd);
   buf->pvt.vfs.fd = -1;
   parse_error(errno,1);
@@ -676,7 +1889,16 @@ void vfs_open_read(path_t *path, cbmdirent_t *dent, buffer_t *buf) {
     buf->pvt.vfs.headersize = P00_HEADER_SIZE;
   }
 
+  /* The file is read-only here, so its size can be cached */
+  buf->pvt.vfs.size   = vfs_size(buf->pvt.vfs.fd);
+  buf->pvt.vfs.offset = buf->pvt.vfs.headersize;
+  readahead_attach(buf);
+
   buf->read      = 1;
+#ifdef CONFIG_VFS_READAHEAD
+  /* With a stage the file offset is kept in the buffer */
+  buf->prefetch  = (buf->pvt.vfs.readahead != NULL);
+#endif
   buf->cleanup   = vfs_file_close;
   buf->refill    = vfs_file_read;
   buf->seek      = vfs_file_seek;
@@ -712,6 +1934,8 @@ int create_file(path_t *path, cbmdirent_t *dent, uint8_t type, buffer_t *buf, ui
     ustrcpy(dent->pvt.vfs.realname, dent->name);
     x00ext = build_name(dent->pvt.vfs.realname, type);
   }
+  dirsnap_invalidate();
+  dirlist_invalidate();
   int fd = vfs_open(path, dent, O_CREAT | O_EXCL | O_RDWR);
   while (x00ext != NULL && fd < 0) {
     /* File exists, increment extension */
@@ -778,10 +2002,8 @@ void vfs_open_write(path_t *path, cbmdirent_t *dent, uint8_t type, buffer_t *buf
       if (dent->opstype == OPSTYPE_VFS_X00)
         /* It's a [PSUR]00 file */
         buf->pvt.vfs.headersize = P00_HEADER_SIZE;
-      off_t fsize = vfs_size(buf->pvt.vfs.fd);
-      //off_t res = lseek(fd, fsize, SEEK_SET);
-      //off_t res = 
-      lseek(buf->pvt.vfs.fd, 0, SEEK_END);
+      off_t fsize = vfs_size(fd);
+      lseek(fd, 0, SEEK_END);
       buf->fptr = fsize - buf->pvt.vfs.headersize;
     }
   } else
@@ -799,6 +2021,7 @@ void vfs_open_write(path_t *path, cbmdirent_t *dent, uint8_t type, buffer_t *buf
   buf->cleanup   = vfs_file_close;
   buf->refill    = vfs_file_write;
   buf->seek      = vfs_file_seek;
+  writebehind_attach(buf);
 
   /* If no data is written the file should end up with a single 0x0d byte */
   buf->data[2] = 13;
@@ -862,6 +2085,20 @@ void vfs_open_rel(path_t *path, cbmdirent_t *dent, buffer_t *buf, uint8_t length
 uint8_t vfs_opendir(dh_t *dh, path_t *path) {
   char buffer[512]; // FIXME
   vfs_path(buffer, path, "");
+#ifdef CONFIG_VFS_DIRCACHE
+  struct stat statbuf;
+  time_t mtime = 0;
+
+  if (!stat(buffer, &statbuf))
+    mtime = statbuf.st_mtime;
+
+  dh->part = path->part;
+  dh->dir.vfs.path = path->dir.path;
+  if (dirsnap_open(dh, mtime)) {
+    dh->dir.vfs.dirp = NULL;
+    return 0;
+  }
+#endif
   DIR *dirp = opendir(buffer);
 //printf ("OPENDIR %p part %d '%s' %p\n", dh, path->part, buffer, dirp);
   if (!dirp) {
@@ -870,10 +2107,41 @@ uint8_t vfs_opendir(dh_t *dh, path_t *path) {
   }
   dh->part = path->part;
   dh->dir.vfs.dirp = dirp;
-  strcpy(dh->dir.vfs.pathname, buffer);
+  dh->dir.vfs.path = path->dir.path;
+  p00cache_load(dh->part, vfs_dirkey(buffer), buffer);
+#ifdef CONFIG_VFS_DIRCACHE
+  dirsnap_build(dh, mtime);
+#endif
   return 0;
 }
 
+/**
+ * vfs_sortdir - read a directory in sorted order
+ * @dh   : directory handle as set up by vfs_opendir, nothing read yet
+ * @order: DIR_ORDER_* value
+ *
+ * The sort index is built over the snapshot of the directory. If the
+ * directory is not held in a snapshot, e.g. because it is too large
+ * for SD2IEC_VFS_DIRCACHE, @dh keeps reading in directory order.
+ * Returns true if @dh reads in @order, false if it does not.
+ */
+bool vfs_sortdir(dh_t *dh, uint8_t order) {
+  if (order == DIR_ORDER_NONE)
+    return true;
+
+#ifdef CONFIG_VFS_DIRCACHE
+  if (dh->dir.vfs.snap == DIRSNAP_NONE ||
+      !dirsnap_sort(&dirsnap[dh->dir.vfs.snap], order))
+    return false;
+
+  dh->dir.vfs.order = order;
+  return true;
+#else
+  (void)dh;
+  return false;
+#endif
+}
+
 /**
  * vfs_readdir - readdir wrapper for FAT
  * @dh  : directory handle as set up by opendir
@@ -884,7 +2152,31 @@ uint8_t vfs_opendir(dh_t *dh, path_t *path) {
  * directory entries and 0 if successful.
  */
 int8_t vfs_readdir(dh_t *dh, cbmdirent_t *dent) {
+#ifdef CONFIG_VFS_DIRCACHE
+  if (dh->dir.vfs.snap != DIRSNAP_NONE)
+    return dirsnap_read(dh, dent);
+#endif
+  return vfs_readdir_stream(dh, dent);
+}
+
+/**
+ * vfs_readdir_stream - read the next entry from the directory itself
+ * @dh  : directory handle as set up by opendir
+ * @dent: CBM directory entry for returning data
+ *
+ * This function does the work of vfs_readdir for handles that are
+ * not served from a directory snapshot.
+ */
+static int8_t vfs_readdir_stream(dh_t *dh, cbmdirent_t *dent) {
   struct dirent *de;
+  char buffer[512]; // FIXME
+
+  vfs_dirpath(buffer, dh->part, dh->dir.vfs.path);
+  if (buffer[0] == 0) {
+    set_error(ERROR_DIR_ERROR);
+    return -1;
+  }
+  size_t dirlen = strlen(buffer);
 
   do {
     errno = 0;
@@ -895,6 +2187,7 @@ int8_t vfs_readdir(dh_t *dh, cbmdirent_t *dent) {
         parse_error(errno,1);
         return -1;
       }
+      p00index_mark(dh->part, dh->dir.vfs.path);
       return -1;
     }
 //printf("readdir %p %p '%s'\n", dh->dir.vfs.dirp, de, de->d_name);
@@ -902,11 +2195,8 @@ int8_t vfs_readdir(dh_t *dh, cbmdirent_t *dent) {
            (de->d_name[0] == '.' && de->d_name[1] == '.' && de->d_name[2] == 0));
 
   struct stat statbuf;
-  char buffer[512]; // FIXME
-  //vfs_path(buffer, dh->dir.path, de->d_name);
-  strcpy(buffer, dh->dir.vfs.pathname);
-  strcat(buffer, "/");
-  strcat(buffer, de->d_name);
+  uint32_t dirkey = vfs_dirkey(buffer);
+  strcpy(buffer + dirlen, de->d_name);
   int res = stat(buffer, &statbuf);
   if (res) {
 //printf("HELLO ERROR FSTAT\n");
@@ -934,18 +2224,16 @@ int8_t vfs_readdir(dh_t *dh, cbmdirent_t *dent) {
     exttype_t ext = check_extension(de->d_name, &ptr);
     if (ext == EXT_IS_X00) {
       /* [PSRU]00 file - try to read the internal name */
-      uint32_t crc = crc32_le(0, (uint8_t*)buffer, strlen(de->d_name));
-      uint8_t *name = p00cache_lookup(dh->part, crc);
+      uint32_t filekey = vfs_filekey(de->d_name, &statbuf);
+      uint8_t *name = p00cache_lookup(dh->part, dirkey, filekey);
       typechar = *ptr;
 
       if (name != NULL) {
         /* lookup successful */
         memcpy(nameptr, name, CBM_NAME_LENGTH);
       } else {
-        path_t path;
-        path.part = dh->part;
-        /* read name from file */
-        int fd = vfs_open(&path, dent, O_RDONLY);
+        /* read name from file, buffer still holds its full path */
+        int fd = open(buffer, O_RDONLY);
         if (fd < 0)
           goto notp00;
           //partition[dh->part].imagefd= res;
@@ -968,9 +2256,7 @@ int8_t vfs_readdir(dh_t *dh, cbmdirent_t *dent) {
             *ptr = 0;
 
         /* add name to cache */
-        // FIXME is 0 correct ? should be crc ?
-        uint32_t crc = crc32_le(0, (uint8_t*)buffer, ustrlen(nameptr));
-        p00cache_add(dh->part, crc, nameptr);
+        p00cache_add(dh->part, dirkey, filekey, nameptr);
       }
       fsize -= P00_HEADER_SIZE;
       dent->opstype = OPSTYPE_VFS_X00;
@@ -1037,17 +2323,10 @@ int8_t vfs_readdir(dh_t *dh, cbmdirent_t *dent) {
 #if _FIXME
   if (finfo.fattrib & AM_RDO)
     dent->typeflags |= FLAG_RO;
+#endif
 
   /* Date/Time */
-  statbuf.st_mtime...
-  dent->date.year  = (finfo.fdate >> 9) + 80;
-  dent->date.month = (finfo.fdate >> 5) & 0x0f;
-  dent->date.day   = finfo.fdate & 0x1f;
-
-  dent->date.hour   = finfo.ftime >> 11;
-  dent->date.minute = (finfo.ftime >> 5) & 0x3f;
-  dent->date.second = (finfo.ftime & 0x1f) << 1;
-#endif
+  vfs_mtime2date(statbuf.st_mtime, &dent->date);
 
   return 0;
 }
@@ -1064,6 +2343,8 @@ uint8_t vfs_delete(path_t *path, cbmdirent_t *dent) {
 
   set_dirty_led(1);
   p00cache_invalidate();
+  dirsnap_invalidate();
+  dirlist_invalidate();
 
   char buffer[512]; // FIXME
   vfs_path_dent(buffer, path, dent);
@@ -1124,7 +2405,12 @@ uint8_t vfs_chdir(path_t *path, cbmdirent_t *dent) {
     return 0;
   }
   /* D64/M2I mount request */
+  const fileops_t *old_parent = partition[path->part].parent_fop;
+  int old_fd = partition[path->part].imagefd;
+  uint8_t old_flag = partition[path->part].flag;
+
   free_multiple_buffers(FMB_USER_CLEAN);
+  dirlist_invalidate();
   /* Open image file */
   int fd = vfs_open(path, dent, O_RDWR);
   partition[path->part].flag = 0;
@@ -1134,26 +2420,39 @@ uint8_t vfs_chdir(path_t *path, cbmdirent_t *dent) {
     partition[path->part].flag = FLAG_RO;
   }
   if (fd < 0) {
+    partition[path->part].flag = old_flag;
     parse_error(errno,1);
     return 1;
   }
+  partition[path->part].imagefd = fd;
+  image_position[path->part] = 0;
 
 #ifdef CONFIG_M2I
-  if (check_imageext(dent->pvt.vfs.realname) == IMG_IS_M2I)
+  if (check_imageext(dent->pvt.vfs.realname) == IMG_IS_M2I) {
     partition[path->part].fop = &m2iops;
     partition[path->part].parent_fop = &vfsops;
-  else
+  } else
 #endif
     {
       uint32_t fsize = vfs_size(fd);
+#if defined(CONFIG_IMAGE_CACHE) && defined(CONFIG_STORAGE_TASK)
+      /* the image may have been read ahead already */
+      char hostpath[512]; // FIXME
+      vfs_path_dent(hostpath, path, dent);
+      imgcache_claim(path->part, hostpath);
+#endif
+      /* d64_mount may read the image already */
+      partition[path->part].parent_fop = &vfsops;
       if (d64_mount(path, (uint8_t *)dent->pvt.vfs.realname, fsize)) {
+        /* leave the partition as it was before */
         close(fd);
+        partition[path->part].imagefd    = old_fd;
+        partition[path->part].parent_fop = old_parent;
+        partition[path->part].flag       = old_flag;
         return 1;
       }
       partition[path->part].fop = &d64ops;
-      partition[path->part].parent_fop = &vfsops;
     }
-  partition[path->part].imagefd = fd;
   return 0;
 }
 
@@ -1162,6 +2461,8 @@ void vfs_mkdir(path_t *path, uint8_t *dirname) {
   pet2asc(dirname);
   char buffer[512]; // FIXME
   vfs_path(buffer, path, (char*)dirname);
+  dirsnap_invalidate();
+  dirlist_invalidate();
   int res = mkdir(buffer, 0);
   if (res)
     parse_error(errno,0);
@@ -1203,7 +2504,11 @@ static uint8_t vfs_getvolumename(uint8_t part, uint8_t *label) {
  */
 uint8_t vfs_getdirlabel(path_t *path, uint8_t *label) {
   memset(label, ' ', CBM_NAME_LENGTH);
-  char *pathname = path->dir.pathname;
+  const char *pathname = pathtab_name(path->dir.path);
+  if (pathname == NULL) {
+    set_error(ERROR_DIR_ERROR);
+    return 1;
+  }
   if (pathname[0]) {
     uint8_t *name = ustrrchr((uint8_t *)pathname, '/');
     if (!name) {
@@ -1338,9 +2643,17 @@ void vfs_rename(path_t *path, cbmdirent_t *dent, uint8_t *newname) {
   ssize_t byteswritten;
   int res;
 
+  dirsnap_invalidate();
+  dirlist_invalidate();
   if (dent->opstype == OPSTYPE_VFS_X00) {
     /* [PSUR]00 rename, just change the internal file name */
     p00cache_invalidate();
+#ifdef CONFIG_P00CACHE_INDEX
+    /* the date of the file may not change, drop the stored name */
+    char indexpath[512]; // FIXME
+    vfs_path(indexpath, path, P00CACHE_INDEX_NAME);
+    unlink(indexpath);
+#endif
 
     int fd = vfs_open(path, dent, O_WRONLY);
     if (fd < 0) {
@@ -1418,15 +2731,15 @@ void vfs_rename(path_t *path, cbmdirent_t *dent, uint8_t *newname) {
   if (!preserve_path) {
     current_part = 0;
     display_current_part(0);
-#ifdef CONFIG_FIXME_CHANGELIST
     set_changelist(NULL, NULLSTRING);
-#endif
     previous_file_dirent.name[0] = 0; // clear '*' file
   }
 
   /* Invalidate some caches */
   d64_invalidate();
   p00cache_invalidate();
+  dirsnap_invalidate();
+  dirlist_invalidate();
 
 #ifndef HAVE_HOTPLUG
   if (!max_part) {
@@ -1446,13 +2759,15 @@ void vfs_rename(path_t *path, cbmdirent_t *dent, uint8_t *newname) {
  * Returns 0 if successful, 1 otherwise.
  */
 static uint8_t vfs_image_unmount(uint8_t part) {
+  uint8_t failed = 0;
 
   free_multiple_buffers(FMB_USER_CLEAN);
+  dirlist_invalidate();
 
   /* call D64 unmount function to handle BAM refcounting etc. */
   // FIXME: ops entry?
   if (partition[part].fop == &d64ops)
-    d64_unmount(part);
+    failed = d64_unmount(part);
 
   if (display_found) {
     /* Send current path to display */
@@ -1464,13 +2779,16 @@ static uint8_t vfs_image_unmount(uint8_t part) {
   }
 
   partition[part].fop = &vfsops;
+  /* close() syncs the image anyway */
+  commit_images &= ~(1UL << part);
+  storage_drain();
   int res = close(partition[part].imagefd);
   partition[part].imagefd = -1;
   if (res < 0) {
     parse_error(errno, 0);
     return 1;
   }
-  return 0;
+  return failed;
 }
 
 /**
@@ -1506,73 +2824,203 @@ void image_mkdir(path_t *path, uint8_t *dirname) {
   return;
 }
 
+uint32_t image_writes[CONFIG_MAX_PARTITIONS];
+
 /**
- * vfs_image_read - Seek to a specified image offset and read data
+ * image_pread - read from an image file at an offset
  * @part  : partition number
- * @offset: offset to be seeked to
+ * @offset: offset in the image file
  * @buffer: pointer to where the data should be read to
- * @bytes : number of bytes to read from the image file
+ * @bytes : number of bytes to read
  *
- * This function seeks to offset in the image file and reads bytes
- * byte into buffer. It returns 0 on success, 1 if less than
- * bytes byte could be read and 2 on failure.
+ * Positional reads leave the file offset alone, so no seek is needed
+ * and the storage task can access the same file in the meantime.
+ * Returns 0 on success, 1 if less than bytes byte could be read and
+ * 2 on failure.
  */
-static uint8_t vfs_image_read(uint8_t part, DWORD offset, void *buffer, uint16_t bytes) {
+static uint8_t image_pread(uint8_t part, uint32_t offset, void *buffer, size_t bytes) {
+  ssize_t bytesread = pread(partition[part].imagefd, buffer, bytes, offset);
 
-  if (offset != (DWORD)-1) {
-    off_t off = lseek(partition[part].imagefd, offset, SEEK_SET);
-    if (off < 0) {
-      parse_error(errno,1);
-      return 2;
-    }
+  if (bytesread < 0) {
+    parse_error(errno,1);
+    return 2;
   }
 
-  ssize_t bytesread = read(partition[part].imagefd, buffer, bytes);
-  if (bytesread < 0) {
+  image_position[part] = offset + bytesread;
+  return bytesread != (ssize_t)bytes;
+}
+
+/**
+ * image_pwrite - write to an image file at an offset
+ * @part  : partition number
+ * @offset: offset in the image file
+ * @buffer: pointer to the data to be written
+ * @bytes : number of bytes to write
+ *
+ * Returns 0 on success, 1 if less than bytes byte could be written
+ * and 2 on failure.
+ */
+static uint8_t image_pwrite(uint8_t part, uint32_t offset, void *buffer, size_t bytes) {
+  ssize_t byteswritten = pwrite(partition[part].imagefd, buffer, bytes, offset);
+
+  if (byteswritten < 0) {
     parse_error(errno,1);
     return 2;
   }
 
-  if (bytesread != bytes)
-    return 1;
+  image_position[part] = offset + byteswritten;
+  return byteswritten != (ssize_t)bytes;
+}
 
-  return 0;
+/* Request a flush of an image after a write */
+static void image_flush(uint8_t part) {
+  if (commit_policy.mode == COMMIT_IMMEDIATE)
+    vfs_image_sync(part, 1);
+  else
+    commit_images |= 1UL << part;
+}
+
+/**
+ * image_merge - count the parts of a vectored access that form one run
+ * @iov  : pointer to the first part
+ * @count: number of parts
+ * @bytes: pointer to a variable receiving the length of the run
+ *
+ * Parts are merged if they follow each other both in the image file
+ * and in memory. Returns the number of merged parts.
+ */
+static uint8_t image_merge(image_iov_t *iov, uint8_t count, size_t *bytes) {
+  uint8_t n = 1;
+
+  *bytes = iov->bytes;
+  while (n < count &&
+         iov[n].offset == iov->offset + *bytes &&
+         (uint8_t *)iov[n].buffer == (uint8_t *)iov->buffer + *bytes) {
+    *bytes += iov[n].bytes;
+    n++;
+  }
+
+  return n;
+}
+
+/**
+ * vfs_image_read - Read data from a specified image offset
+ * @part  : partition number
+ * @offset: offset to read from, (DWORD)-1 to continue after the last access
+ * @buffer: pointer to where the data should be read to
+ * @bytes : number of bytes to read from the image file
+ *
+ * This function reads bytes byte at offset of the image file into
+ * buffer. It returns 0 on success, 1 if less than bytes byte could
+ * be read and 2 on failure.
+ */
+static uint8_t vfs_image_read(uint8_t part, DWORD offset, void *buffer, uint16_t bytes) {
+  uint32_t start = latency_start();
+  uint8_t res;
+
+  if (offset == (DWORD)-1)
+    offset = image_position[part];
+
+  res = image_pread(part, offset, buffer, bytes);
+  latency_record(LAT_IMGREAD, start);
+  return res;
 }
 
 /**
- * vfs_image_write - Seek to a specified image offset and write data
+ * vfs_image_write - Write data to a specified image offset
  * @part  : partition number
- * @offset: offset to be seeked to
+ * @offset: offset to write to, (DWORD)-1 to continue after the last access
  * @buffer: pointer to the data to be written
  * @bytes : number of bytes to read from the image file
  * @flush : Flags if written data should be flushed to disk immediately
  *
- * This function seeks to offset in the image file and writes bytes
- * byte into buffer. It returns 0 on success, 1 if less than
- * bytes byte could be written and 2 on failure.
+ * This function writes bytes byte from buffer at offset of the image
+ * file. It returns 0 on success, 1 if less than bytes byte could be
+ * written and 2 on failure.
  */
 static uint8_t vfs_image_write(uint8_t part, DWORD offset, void *buffer, uint16_t bytes, uint8_t flush) {
-  if (offset != (DWORD)-1) {
-    off_t off = lseek(partition[part].imagefd, offset, SEEK_SET);
-    if (off < 0) {
-      parse_error(errno,0);
-      return 2;
-    }
-  }
+  uint8_t res;
 
-  ssize_t byteswritten = write(partition[part].imagefd, buffer, bytes);
-  if (byteswritten < 0) {
-    parse_error(errno,1);
-    return 2;
+  image_writes[part]++;
+  dirlist_invalidate();
+
+  if (offset == (DWORD)-1)
+    offset = image_position[part];
+
+  res = image_pwrite(part, offset, buffer, bytes);
+  if (res)
+    return res;
+
+  if (flush)
+    image_flush(part);
+
+  commit_account(bytes);
+  return 0;
+}
+
+/**
+ * vfs_image_readv - Read several parts of an image
+ * @part : partition number
+ * @iov  : array of parts to read
+ * @count: number of parts
+ *
+ * Parts that are adjacent both in the image and in memory are read
+ * with a single call. Returns 0 on success, 1 if a part could not be
+ * read completely and 2 on failure.
+ */
+static uint8_t vfs_image_readv(uint8_t part, image_iov_t *iov, uint8_t count) {
+  uint8_t res = 0;
+
+  while (count > 0) {
+    size_t  bytes;
+    uint8_t n = image_merge(iov, count, &bytes);
+
+    res = image_pread(part, iov->offset, iov->buffer, bytes);
+    if (res)
+      return res;
+
+    iov   += n;
+    count -= n;
   }
 
-  if (byteswritten != bytes)
-    return 1;
+  return 0;
+}
 
-  if (flush) {
-    fsync(partition[part].imagefd);
+/**
+ * vfs_image_writev - Write several parts of an image
+ * @part : partition number
+ * @iov  : array of parts to write
+ * @count: number of parts
+ * @flush: Flags if written data should be flushed to disk immediately
+ *
+ * Parts that are adjacent both in the image and in memory are written
+ * with a single call. Returns 0 on success, 1 if a part could not be
+ * written completely and 2 on failure.
+ */
+static uint8_t vfs_image_writev(uint8_t part, image_iov_t *iov, uint8_t count, uint8_t flush) {
+  uint32_t total = 0;
+  uint8_t res = 0;
+
+  image_writes[part]++;
+  dirlist_invalidate();
+
+  while (count > 0) {
+    size_t  bytes;
+    uint8_t n = image_merge(iov, count, &bytes);
+
+    res = image_pwrite(part, iov->offset, iov->buffer, bytes);
+    if (res)
+      return res;
+
+    total += bytes;
+    iov   += n;
+    count -= n;
   }
 
+  if (flush)
+    image_flush(part);
+
+  commit_account(total);
   return 0;
 }
 
@@ -1606,4 +3054,6 @@ const PROGMEM fileops_t vfsops = {  // These should be at bottom, to be consiste
   &vfs_image_unmount,
   &vfs_image_read,
   &vfs_image_write,
+  &vfs_image_readv,
+  &vfs_image_writev,
 };
@@ -30,6 +30,29 @@
 #include "cbmdirent.h"
 #include "wrapops.h"
 
+/* Commit policies for data written to the card */
+#define COMMIT_IMMEDIATE 0  /* write every block, sync every flush request */
+#define COMMIT_ON_CLOSE  1  /* sync when the file or image is closed */
+#define COMMIT_GROUP     2  /* sync after a size or time threshold */
+
+/**
+ * struct commit_policy_t - when written data is committed to the card
+ * @mode    : one of the COMMIT_* values
+ * @size    : group commit after this many KB were written, 0 disables
+ * @interval: group commit after this many 1/10 s, 0 disables
+ */
+typedef struct {
+  uint8_t mode;
+  uint8_t size;
+  uint8_t interval;
+} commit_policy_t;
+
+extern commit_policy_t commit_policy;
+
+/* Number of writes to the image file of each partition, lets readers */
+/* outside the bus task detect that data they fetched may be stale    */
+extern uint32_t image_writes[CONFIG_MAX_PARTITIONS];
+
 /* API */
 void     vfsops_init(uint8_t preserve_dir, const char *basepath);
 void     parse_error(int res, uint8_t readflag);
@@ -43,9 +66,25 @@ uint8_t  vfs_getid(path_t *path, uint8_t *id);
 uint16_t vfs_freeblocks(uint8_t part);
 uint8_t  vfs_opendir(dh_t *dh, path_t *dir);
 int8_t   vfs_readdir(dh_t *dh, cbmdirent_t *dent);
+bool     vfs_sortdir(dh_t *dh, uint8_t order);
 void     vfs_read_sector(buffer_t *buf, uint8_t part, uint8_t track, uint8_t sector);
 void     vfs_write_sector(buffer_t *buf, uint8_t part, uint8_t track, uint8_t sector);
 void     format_dummy(uint8_t drive, uint8_t *name, uint8_t *id);
+void     vfs_commit(void);
+void     vfs_commit_poll(void);
+void     vfs_hostpath(char *buffer, path_t *path, const char *name);
+
+#ifdef CONFIG_VFS_DIRCACHE
+void     dirsnap_invalidate(void);
+#else
+#  define dirsnap_invalidate() do {} while (0)
+#endif
+
+#if defined(CONFIG_P00CACHE) && defined(CONFIG_P00CACHE_INDEX)
+void     vfs_p00index_poll(void);
+#else
+#  define vfs_p00index_poll() do {} while (0)
+#endif
 
 extern const fileops_t vfsops;
 
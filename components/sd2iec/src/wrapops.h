@@ -37,6 +37,18 @@
 #endif
 #include "progmem.h"
 
+/**
+ * struct image_iov_s - one part of a vectored image access
+ * @offset: offset in the image file
+ * @buffer: pointer to the data
+ * @bytes : number of bytes
+ */
+typedef struct image_iov_s {
+  uint32_t offset;
+  void     *buffer;
+  uint16_t bytes;
+} image_iov_t;
+
 /**
  * struct fileops_t - function pointers to file operations
  * @open_read   : open a file for reading
@@ -55,6 +67,11 @@
  * @mkdir       : create a directory
  * @chdir       : change current directory
  * @rename      : rename a file
+ * @image_unmount: unmount an image mounted on top of this file system
+ * @image_read  : read data from a mounted image file
+ * @image_write : write data to a mounted image file
+ * @image_readv : read several parts of a mounted image file
+ * @image_writev: write several parts of a mounted image file
  *
  * This structure holds function pointers for the various
  * abstracted operations on the supported file systems/images.
@@ -81,6 +98,8 @@ typedef struct fileops_s {
   uint8_t  (*image_unmount)(uint8_t part);
   uint8_t  (*image_read)(uint8_t part, uint32_t offset, void *buffer, uint16_t bytes);
   uint8_t  (*image_write)(uint8_t part, uint32_t offset, void *buffer, uint16_t bytes, uint8_t flush);
+  uint8_t  (*image_readv)(uint8_t part, image_iov_t *iov, uint8_t count);
+  uint8_t  (*image_writev)(uint8_t part, image_iov_t *iov, uint8_t count, uint8_t flush);
 } fileops_t;
 
 /* Helper-Define to avoid lots of typedefs */
@@ -111,5 +130,7 @@ typedef struct fileops_s {
 #define image_unmount(part)  ((pgmcall(partition[part].parent_fop->image_unmount))(part))
 #define image_read(part,offset,buffer,bytes) ((pgmcall(partition[part].parent_fop->image_read))(part,offset,buffer,bytes))
 #define image_write(part,offset,buffer,bytes,flush) ((pgmcall(partition[part].parent_fop->image_write))(part,offset,buffer,bytes,flush))
+#define image_readv(part,iov,count) ((pgmcall(partition[part].parent_fop->image_readv))(part,iov,count))
+#define image_writev(part,iov,count,flush) ((pgmcall(partition[part].parent_fop->image_writev))(part,iov,count,flush))
 
 #endif